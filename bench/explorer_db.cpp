@@ -0,0 +1,330 @@
+#include "explorer_db.h"
+#include <sqlite3.h>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static const char* SCHEMA_SQL =
+    "CREATE TABLE IF NOT EXISTS profiles ("
+    "  id INTEGER PRIMARY KEY, name TEXT);"
+
+    "CREATE TABLE IF NOT EXISTS folders ("
+    "  id INTEGER PRIMARY KEY, storageid INTEGER, name TEXT);"
+
+    "CREATE TABLE IF NOT EXISTS books_impl ("
+    "  id INTEGER PRIMARY KEY, title TEXT, first_title_letter TEXT, author TEXT,"
+    "  firstauthor TEXT, first_author_letter TEXT, series TEXT, numinseries INTEGER,"
+    "  size INTEGER, isbn TEXT, sort_title TEXT, creationtime INTEGER,"
+    "  updated INTEGER, ts_added INTEGER, hidden INTEGER DEFAULT 0);"
+
+    "CREATE TABLE IF NOT EXISTS files ("
+    "  id INTEGER PRIMARY KEY, storageid INTEGER, folder_id INTEGER, book_id INTEGER,"
+    "  filename TEXT, size INTEGER, modification_time INTEGER, ext TEXT);"
+
+    "CREATE TABLE IF NOT EXISTS books_settings ("
+    "  bookid INTEGER, profileid INTEGER, cpage INTEGER, npage INTEGER,"
+    "  completed INTEGER DEFAULT 0, favorite INTEGER DEFAULT 0,"
+    "  completed_ts INTEGER DEFAULT 0, opentime INTEGER DEFAULT 0);"
+
+    "CREATE TABLE IF NOT EXISTS bookshelfs ("
+    "  id INTEGER PRIMARY KEY, name TEXT, is_deleted INTEGER DEFAULT 0, ts INTEGER);"
+
+    "CREATE TABLE IF NOT EXISTS bookshelfs_books ("
+    "  bookshelfid INTEGER, bookid INTEGER, ts INTEGER, is_deleted INTEGER DEFAULT 0,"
+    "  UNIQUE (bookshelfid, bookid));"
+
+    // The firmware stamps completed_ts itself when a book becomes completed
+    "CREATE TRIGGER IF NOT EXISTS books_settings_completed_insert "
+    "AFTER INSERT ON books_settings WHEN NEW.completed = 1 BEGIN "
+    "  UPDATE books_settings SET completed_ts = strftime('%s', 'now') "
+    "  WHERE rowid = NEW.rowid; END;"
+
+    "CREATE TRIGGER IF NOT EXISTS books_settings_completed_update "
+    "AFTER UPDATE OF completed ON books_settings "
+    "WHEN NEW.completed = 1 AND OLD.completed <> 1 BEGIN "
+    "  UPDATE books_settings SET completed_ts = strftime('%s', 'now') "
+    "  WHERE rowid = NEW.rowid; END;"
+
+    "INSERT OR IGNORE INTO profiles (id, name) VALUES (1, 'default');";
+
+bool createExplorerDb(const std::string& path) {
+    sqlite3* db = nullptr;
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create %s: %s\n", path.c_str(), db ? sqlite3_errmsg(db) : "out of memory");
+        if (db) sqlite3_close(db);
+        return false;
+    }
+
+    char* err = nullptr;
+    bool ok = sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, &err) == SQLITE_OK &&
+              sqlite3_exec(db, SCHEMA_SQL, NULL, NULL, &err) == SQLITE_OK;
+    if (!ok) {
+        fprintf(stderr, "Failed to create schema in %s: %s\n", path.c_str(), err ? err : "?");
+        sqlite3_free(err);
+    }
+
+    sqlite3_close(db);
+    return ok;
+}
+
+// xorshift32, so that a seed always produces the same library
+class GeneratorRandom {
+    unsigned int state;
+public:
+    explicit GeneratorRandom(unsigned int seed) : state(seed ? seed : 1) {}
+    unsigned int next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+    double uniform() { return (next() >> 8) / 16777216.0; }
+};
+
+static const char* extensionForBook(int index) {
+    switch (index % 10) {
+        case 7:  return "fb2";
+        case 8:  return "pdf";
+        default: return "epub";
+    }
+}
+
+std::string generatedBookLpath(int index, const ExplorerDbOptions& options) {
+    int author = index / (options.booksPerFolder > 0 ? options.booksPerFolder : 1);
+    char buf[128];
+    snprintf(buf, sizeof(buf), "Author %05d/Generated Book %06d - Author %05d.%s",
+             author, index, author, extensionForBook(index));
+    return buf;
+}
+
+static bool createPlaceholder(const std::string& path, long long size, time_t mtime) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = ftruncate(fd, size) == 0;
+    close(fd);
+
+    struct timeval times[2];
+    times[0].tv_sec = mtime;
+    times[0].tv_usec = 0;
+    times[1] = times[0];
+    utimes(path.c_str(), times);
+    return ok;
+}
+
+bool populateExplorerDb(const std::string& path, const std::string& flashDir,
+                        const std::string& cardDir, const ExplorerDbOptions& options) {
+    sqlite3* db = nullptr;
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), db ? sqlite3_errmsg(db) : "out of memory");
+        if (db) sqlite3_close(db);
+        return false;
+    }
+
+    sqlite3_stmt* insertFolder = nullptr;
+    sqlite3_stmt* insertBook = nullptr;
+    sqlite3_stmt* insertFile = nullptr;
+    sqlite3_stmt* insertSettings = nullptr;
+    sqlite3_stmt* insertShelf = nullptr;
+    sqlite3_stmt* insertShelfBook = nullptr;
+    sqlite3_stmt* insertProfile = nullptr;
+    sqlite3_stmt* updateCompletedTs = nullptr;
+
+    bool ok =
+        sqlite3_prepare_v2(db, "INSERT INTO folders (storageid, name) VALUES (?, ?)",
+                           -1, &insertFolder, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+            "INSERT INTO books_impl (title, first_title_letter, author, firstauthor, "
+            "first_author_letter, series, numinseries, size, isbn, sort_title, creationtime, "
+            "updated, ts_added, hidden) VALUES (?, 'G', ?, ?, 'A', ?, ?, ?, ?, ?, ?, 0, ?, 0)",
+            -1, &insertBook, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+            "INSERT INTO files (storageid, folder_id, book_id, filename, size, modification_time, ext) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?)", -1, &insertFile, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+            "INSERT INTO books_settings (bookid, profileid, cpage, npage, completed, favorite, completed_ts) "
+            "VALUES (?, ?, ?, 100, ?, ?, ?)", -1, &insertSettings, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "INSERT INTO bookshelfs (name, is_deleted, ts) VALUES (?, 0, ?)",
+                           -1, &insertShelf, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+            "INSERT OR IGNORE INTO bookshelfs_books (bookshelfid, bookid, ts, is_deleted) "
+            "VALUES (?, ?, ?, 0)", -1, &insertShelfBook, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO profiles (id, name) VALUES (?, ?)",
+                           -1, &insertProfile, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+            "UPDATE books_settings SET completed_ts = ? WHERE rowid = ?",
+            -1, &updateCompletedTs, nullptr) == SQLITE_OK;
+
+    if (!ok) {
+        fprintf(stderr, "Failed to prepare generator statements: %s\n", sqlite3_errmsg(db));
+    }
+
+    GeneratorRandom random(options.seed);
+    time_t now = time(NULL);
+    std::map<std::string, int> folderIds;
+    std::vector<int> bookIds;
+    bookIds.reserve(options.books > 0 ? options.books : 0);
+
+    if (ok) sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+    for (int p = 2; ok && p <= options.profiles; p++) {
+        std::string name = "Profile " + std::to_string(p);
+        sqlite3_reset(insertProfile);
+        sqlite3_bind_int(insertProfile, 1, p);
+        sqlite3_bind_text(insertProfile, 2, name.c_str(), -1, SQLITE_TRANSIENT);
+        ok = sqlite3_step(insertProfile) == SQLITE_DONE;
+    }
+
+    for (int i = 0; ok && i < options.books; i++) {
+        bool onCard = !cardDir.empty() && random.uniform() < options.cardRatio;
+        int storageId = onCard ? 2 : 1;
+        const std::string& root = onCard ? cardDir : flashDir;
+
+        std::string lpath = generatedBookLpath(i, options);
+        size_t slash = lpath.rfind('/');
+        std::string folderPath = root + "/" + lpath.substr(0, slash);
+        std::string fileName = lpath.substr(slash + 1);
+        std::string ext = fileName.substr(fileName.rfind('.') + 1);
+
+        std::string folderKey = std::to_string(storageId) + ":" + folderPath;
+        std::map<std::string, int>::iterator folderIt = folderIds.find(folderKey);
+        int folderId;
+        if (folderIt != folderIds.end()) {
+            folderId = folderIt->second;
+        } else {
+            sqlite3_reset(insertFolder);
+            sqlite3_bind_int(insertFolder, 1, storageId);
+            sqlite3_bind_text(insertFolder, 2, folderPath.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(insertFolder) != SQLITE_DONE) {
+                ok = false;
+                break;
+            }
+            folderId = (int)sqlite3_last_insert_rowid(db);
+            folderIds[folderKey] = folderId;
+            if (options.createFiles) mkdir(folderPath.c_str(), 0755);
+        }
+
+        int author = i / (options.booksPerFolder > 0 ? options.booksPerFolder : 1);
+        char title[64], authorName[32], authorSort[32], series[32], isbn[32];
+        snprintf(title, sizeof(title), "Generated Book %06d", i);
+        snprintf(authorName, sizeof(authorName), "Author %05d", author);
+        snprintf(authorSort, sizeof(authorSort), "%05d, Author", author);
+        snprintf(series, sizeof(series), "Series %d", i % 50);
+        snprintf(isbn, sizeof(isbn), "978%010d", i);
+        time_t mtime = now - (time_t)(options.books - i) * 60;
+
+        sqlite3_reset(insertBook);
+        sqlite3_bind_text(insertBook, 1, title, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insertBook, 2, authorName, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insertBook, 3, authorSort, -1, SQLITE_TRANSIENT);
+        if (i % 4 == 0) {
+            sqlite3_bind_text(insertBook, 4, series, -1, SQLITE_TRANSIENT);
+        } else {
+            sqlite3_bind_text(insertBook, 4, "", -1, SQLITE_STATIC);
+        }
+        sqlite3_bind_int(insertBook, 5, i % 4 == 0 ? i % 10 + 1 : 0);
+        sqlite3_bind_int64(insertBook, 6, options.fileSize);
+        sqlite3_bind_text(insertBook, 7, isbn, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insertBook, 8, title, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(insertBook, 9, mtime);
+        sqlite3_bind_int64(insertBook, 10, mtime);
+        if (sqlite3_step(insertBook) != SQLITE_DONE) {
+            ok = false;
+            break;
+        }
+        int bookId = (int)sqlite3_last_insert_rowid(db);
+        bookIds.push_back(bookId);
+
+        sqlite3_reset(insertFile);
+        sqlite3_bind_int(insertFile, 1, storageId);
+        sqlite3_bind_int(insertFile, 2, folderId);
+        sqlite3_bind_int(insertFile, 3, bookId);
+        sqlite3_bind_text(insertFile, 4, fileName.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(insertFile, 5, options.fileSize);
+        sqlite3_bind_int64(insertFile, 6, mtime);
+        sqlite3_bind_text(insertFile, 7, ext.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(insertFile) != SQLITE_DONE) {
+            ok = false;
+            break;
+        }
+
+        for (int p = 1; p <= options.profiles; p++) {
+            bool read = random.uniform() < options.readRatio;
+            bool favorite = random.uniform() < options.favoriteRatio;
+            sqlite3_reset(insertSettings);
+            sqlite3_bind_int(insertSettings, 1, bookId);
+            sqlite3_bind_int(insertSettings, 2, p);
+            sqlite3_bind_int(insertSettings, 3, read ? 100 : (int)(random.next() % 100));
+            sqlite3_bind_int(insertSettings, 4, read ? 1 : 0);
+            sqlite3_bind_int(insertSettings, 5, favorite ? 1 : 0);
+            sqlite3_bind_int64(insertSettings, 6, 0);
+            if (sqlite3_step(insertSettings) != SQLITE_DONE) {
+                ok = false;
+                break;
+            }
+
+            // The insert trigger stamped "now", backdate it like a sync from calibre does
+            if (read) {
+                sqlite3_reset(updateCompletedTs);
+                sqlite3_bind_int64(updateCompletedTs, 1, (long long)(mtime + 3600));
+                sqlite3_bind_int64(updateCompletedTs, 2, sqlite3_last_insert_rowid(db));
+                sqlite3_step(updateCompletedTs);
+            }
+        }
+
+        if (ok && options.createFiles) {
+            std::string filePath = folderPath + "/" + fileName;
+            if (!createPlaceholder(filePath, options.fileSize, mtime)) {
+                fprintf(stderr, "Failed to create %s\n", filePath.c_str());
+                ok = false;
+            }
+        }
+    }
+
+    for (int c = 0; ok && c < options.collections && !bookIds.empty(); c++) {
+        std::string name = "Collection " + std::to_string(c);
+        sqlite3_reset(insertShelf);
+        sqlite3_bind_text(insertShelf, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(insertShelf, 2, now);
+        if (sqlite3_step(insertShelf) != SQLITE_DONE) {
+            ok = false;
+            break;
+        }
+        int shelfId = (int)sqlite3_last_insert_rowid(db);
+
+        for (int j = 0; j < options.collectionSize; j++) {
+            sqlite3_reset(insertShelfBook);
+            sqlite3_bind_int(insertShelfBook, 1, shelfId);
+            sqlite3_bind_int(insertShelfBook, 2, bookIds[random.next() % bookIds.size()]);
+            sqlite3_bind_int64(insertShelfBook, 3, now);
+            if (sqlite3_step(insertShelfBook) != SQLITE_DONE) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    if (ok) {
+        ok = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+    } else {
+        fprintf(stderr, "Library generation failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    }
+
+    sqlite3_finalize(insertFolder);
+    sqlite3_finalize(insertBook);
+    sqlite3_finalize(insertFile);
+    sqlite3_finalize(insertSettings);
+    sqlite3_finalize(insertShelf);
+    sqlite3_finalize(insertShelfBook);
+    sqlite3_finalize(insertProfile);
+    sqlite3_finalize(updateCompletedTs);
+
+    if (ok) sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL);
+    sqlite3_close(db);
+    return ok;
+}
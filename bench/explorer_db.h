@@ -0,0 +1,41 @@
+#ifndef EXPLORER_DB_H
+#define EXPLORER_DB_H
+
+#include <string>
+
+// Synthetic PocketBook library database (system/explorer-3/explorer-3.db) for
+// host runs. The tables and columns match what BookManager reads and writes on
+// the device, with only the firmware's indexes: a library the app has not run
+// on yet. BookManager::initialize adds its calibre_connect_idx_* lookup indexes
+// as on the device, and every bench calls it before timing anything.
+bool createExplorerDb(const std::string& path);
+
+// Shape of a generated library
+struct ExplorerDbOptions {
+    int books;
+    int booksPerFolder;      // folder fan-out: one author folder per this many books
+    int collections;
+    int collectionSize;      // books per collection
+    int profiles;            // every profile gets its own books_settings rows
+    double readRatio;        // share of completed books (per profile)
+    double favoriteRatio;
+    double cardRatio;        // share of books on the SD card (storageid 2)
+    long long fileSize;      // placeholder size, files are sparse
+    bool createFiles;        // also create the placeholder files on disk
+    unsigned int seed;
+
+    ExplorerDbOptions()
+        : books(1000), booksPerFolder(8), collections(20), collectionSize(50), profiles(1),
+          readRatio(0.3), favoriteRatio(0.05), cardRatio(0.0), fileSize(256 * 1024),
+          createFiles(true), seed(1) {}
+};
+
+// Relative path of generated book 'index' below its storage root
+std::string generatedBookLpath(int index, const ExplorerDbOptions& options);
+
+// Fill an existing (createExplorerDb) database with a synthetic library whose
+// books live below flashDir / cardDir, the way BookManager::addBook stores them
+bool populateExplorerDb(const std::string& path, const std::string& flashDir,
+                        const std::string& cardDir, const ExplorerDbOptions& options);
+
+#endif // EXPLORER_DB_H
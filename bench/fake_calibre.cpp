@@ -0,0 +1,399 @@
+#include "fake_calibre.h"
+#include "network.h"
+#include "metrics.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+static const size_t SEND_CHUNK = 64 * 1024;
+
+// Deterministic filler so that runs are comparable
+static unsigned int nextRandom(unsigned int& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Random bytes framed by JPEG SOI/EOI markers, base64 encoded like calibre does
+static std::string fakeJpegBase64(int rawBytes) {
+    static const char ALPHABET[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    if (rawBytes <= 0) return "";
+
+    std::vector<unsigned char> raw((size_t)rawBytes);
+    unsigned int state = 0x9e3779b9u;
+    for (size_t i = 0; i < raw.size(); i++) {
+        raw[i] = (unsigned char)(nextRandom(state) & 0xFF);
+    }
+    static const unsigned char SOI[] = { 0xFF, 0xD8, 0xFF, 0xE0 };
+    for (size_t i = 0; i < sizeof(SOI) && i < raw.size(); i++) raw[i] = SOI[i];
+    if (raw.size() >= sizeof(SOI) + 2) {
+        raw[raw.size() - 2] = 0xFF;
+        raw[raw.size() - 1] = 0xD9;
+    }
+
+    std::string out;
+    out.reserve((raw.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < raw.size(); i += 3) {
+        unsigned int v = (unsigned int)raw[i] << 16;
+        if (i + 1 < raw.size()) v |= (unsigned int)raw[i + 1] << 8;
+        if (i + 2 < raw.size()) v |= raw[i + 2];
+        out += ALPHABET[(v >> 18) & 63];
+        out += ALPHABET[(v >> 12) & 63];
+        out += i + 1 < raw.size() ? ALPHABET[(v >> 6) & 63] : '=';
+        out += i + 2 < raw.size() ? ALPHABET[v & 63] : '=';
+    }
+    return out;
+}
+
+FakeCalibre::FakeCalibre(const FakeCalibreConfig& cfg)
+    : config(cfg), listenFd(-1), clientFd(-1) {
+    long long maxSize = config.bookSizeMax > config.bookSize ? config.bookSizeMax : config.bookSize;
+    payload.resize((size_t)maxSize);
+    unsigned int state = 0x12345678u;
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = (char)(nextRandom(state) & 0xFF);
+    }
+    thumbnail = fakeJpegBase64(config.thumbnailBytes);
+}
+
+FakeCalibre::~FakeCalibre() {
+    abort();
+    if (worker.joinable()) worker.join();
+    if (clientFd >= 0) close(clientFd);
+    if (listenFd >= 0) close(listenFd);
+}
+
+int FakeCalibre::listen() {
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t len = sizeof(addr);
+    if (bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        ::listen(listenFd, 1) < 0 ||
+        getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0) {
+        close(listenFd);
+        listenFd = -1;
+        return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+void FakeCalibre::start() {
+    worker = std::thread(&FakeCalibre::run, this);
+}
+
+const FakeCalibreResult& FakeCalibre::wait() {
+    if (worker.joinable()) worker.join();
+    return result;
+}
+
+void FakeCalibre::abort() {
+    if (clientFd >= 0) shutdown(clientFd, SHUT_RDWR);
+    if (listenFd >= 0) shutdown(listenFd, SHUT_RDWR);
+}
+
+std::string FakeCalibre::lpathForBook(int index) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "Author %03d/Book %05d - Author %03d.epub",
+             index % 97, index, index % 97);
+    return buf;
+}
+
+long long FakeCalibre::bookSizeFor(int index) const {
+    if (config.bookSizeMax <= config.bookSize) return config.bookSize;
+    unsigned int state = 0x2545F491u + (unsigned int)index * 2654435761u;
+    long long span = config.bookSizeMax - config.bookSize + 1;
+    return config.bookSize + (long long)(nextRandom(state) % (unsigned long long)span);
+}
+
+// Roughly what calibre's smart device driver sends for a book
+std::string FakeCalibre::bookMetadataJson(int index, bool isRead) const {
+    char head[1024];
+    int author = index % 97;
+    snprintf(head, sizeof(head),
+             "{\"title\":\"Book %05d\",\"authors\":[\"Author %03d\"],\"author_sort\":\"%03d, Author\","
+             "\"uuid\":\"00000000-0000-4000-8000-%012d\",\"lpath\":\"%s\",\"size\":%lld,"
+             "\"series\":\"Series %d\",\"series_index\":%d,\"publisher\":\"Bench Press\","
+             "\"pubdate\":\"2020-01-01T00:00:00+00:00\",\"timestamp\":\"2024-05-01T10:00:00+00:00\","
+             "\"last_modified\":\"2024-05-01T10:00:00+00:00\",\"languages\":[\"eng\"],"
+             "\"tags\":[\"Fiction\",\"Bench\"],\"identifiers\":{\"isbn\":\"978%010d\"},"
+             "\"application_id\":%d,\"db_id\":null,\"rating\":null,",
+             index, author, author, index, lpathForBook(index).c_str(), bookSizeFor(index),
+             index % 13, index % 7 + 1, index, index + 1);
+
+    std::string json = head;
+    json += "\"comments\":\"";
+    for (int i = 0; i < 8; i++) {
+        json += "<p>Synthetic description paragraph for benchmarking the metadata path.</p>";
+    }
+    json += "\",";
+
+    json += "\"thumbnail\":[180,240,\"";
+    json += thumbnail;
+    json += "\"],";
+
+    json += "\"user_metadata\":{";
+    if (!config.readColumn.empty()) {
+        json += "\"" + config.readColumn + "\":{\"datatype\":\"bool\",\"name\":\"Read\",\"#value#\":";
+        json += isRead ? "true" : "false";
+        json += "}";
+    }
+    if (!config.readDateColumn.empty()) {
+        if (!config.readColumn.empty()) json += ",";
+        json += "\"" + config.readDateColumn + "\":{\"datatype\":\"datetime\",\"name\":\"Read date\",\"#value#\":";
+        json += isRead ? "\"2024-06-01T12:00:00+00:00\"" : "null";
+        json += "}";
+    }
+    json += "}}";
+    return json;
+}
+
+void FakeCalibre::run() {
+    result = FakeCalibreResult();
+
+    clientFd = accept(listenFd, NULL, NULL);
+    if (clientFd < 0) {
+        fail(std::string("accept failed: ") + strerror(errno));
+        return;
+    }
+    int one = 1;
+    setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    result.ok = play();
+    shutdown(clientFd, SHUT_RDWR);
+}
+
+bool FakeCalibre::play() {
+    result.sessionStartUs = SessionMetrics::nowUs();
+    unsigned long long t = result.sessionStartUs;
+
+    // Handshake
+    if (!sendFrame(GET_INITIALIZATION_INFO,
+                   "{\"serverProtocolVersion\":1,\"validExtensions\":[\"epub\",\"pdf\",\"fb2\"],"
+                   "\"passwordChallenge\":\"\",\"currentLibraryName\":\"Bench\","
+                   "\"currentLibraryUUID\":\"bench-library\",\"pubdateFormat\":\"MMM yyyy\","
+                   "\"timestampFormat\":\"dd MMM yyyy\",\"lastModifiedFormat\":\"dd MMM yyyy\","
+                   "\"calibre_version\":[7,0,0]}") ||
+        !expectOK("GET_INITIALIZATION_INFO") ||
+        !sendFrame(GET_DEVICE_INFORMATION, "{}") ||
+        !expectOK("GET_DEVICE_INFORMATION") ||
+        !sendFrame(SET_CALIBRE_DEVICE_INFO,
+                   "{\"device_store_uuid\":\"bench-device\",\"device_name\":\"Bench\","
+                   "\"location_code\":\"main\",\"last_library_uuid\":\"bench-library\"}") ||
+        !expectOK("SET_CALIBRE_DEVICE_INFO") ||
+        !sendFrame(FREE_SPACE, "{}") ||
+        !expectOK("FREE_SPACE")) {
+        return false;
+    }
+    unsigned long long now = SessionMetrics::nowUs();
+    result.handshakeUs = now - t;
+    t = now;
+
+    // Book list of the device
+    std::string reply;
+    if (!sendFrame(GET_BOOK_COUNT,
+                   "{\"willUseCachedMetadata\":true,\"supportsSync\":true,"
+                   "\"canSupportBookFormatSync\":true}") ||
+        !expectOK("GET_BOOK_COUNT", &reply)) {
+        return false;
+    }
+    size_t countPos = reply.find("\"count\":");
+    result.deviceBookCount = countPos != std::string::npos ? atoi(reply.c_str() + countPos + 8) : 0;
+    for (int i = 0; i < result.deviceBookCount; i++) {
+        if (!expectOK("GET_BOOK_COUNT entry")) return false;
+    }
+    now = SessionMetrics::nowUs();
+    result.bookCountUs = now - t;
+    t = now;
+
+    // Books
+    result.sendBooksStartUs = t;
+    for (int i = 0; i < config.books; i++) {
+        long long size = bookSizeFor(i);
+        char head[512];
+        snprintf(head, sizeof(head),
+                 "{\"lpath\":\"%s\",\"length\":%lld,\"thisBook\":%d,\"totalBooks\":%d,"
+                 "\"willStreamBooks\":true,\"willStreamBinary\":true,"
+                 "\"wantsSendOkToSendbook\":true,\"canSupportLpathChanges\":true,\"metadata\":",
+                 lpathForBook(i).c_str(), size, i, config.books);
+        std::string json = head + bookMetadataJson(i, false) + "}";
+
+        if (!sendFrame(SEND_BOOK, json) || !expectOK("SEND_BOOK")) return false;
+
+        // Books share the random payload; the first bytes carry the index so
+        // that their contents differ, as real books do
+        char stamp[16];
+        snprintf(stamp, sizeof(stamp), "%015d", i);
+        long long sent = std::min<long long>(size, (long long)sizeof(stamp));
+        if (!sendAll(stamp, (size_t)sent)) {
+            return fail("connection lost while sending book data");
+        }
+        while (sent < size) {
+            size_t chunk = (size_t)std::min<long long>(size - sent, (long long)SEND_CHUNK);
+            if (!sendAll(&payload[(size_t)sent], chunk)) {
+                return fail("connection lost while sending book data");
+            }
+            sent += chunk;
+        }
+        result.booksSent++;
+        result.bookBytesSent += size;
+    }
+    if (!barrier("SEND_BOOK")) return false;
+    now = SessionMetrics::nowUs();
+    result.sendBooksUs = now - t;
+    t = now;
+
+    // Collections
+    std::string booklists = "{\"count\":" + std::to_string(config.books) + ",\"collections\":{";
+    for (int c = 0; c < config.collections; c++) {
+        if (c) booklists += ",";
+        booklists += "\"Collection " + std::to_string(c) + " (Tags)\":[";
+        for (int j = 0; j < config.collectionSize && config.books > 0; j++) {
+            if (j) booklists += ",";
+            booklists += "\"" + lpathForBook((c * 7 + j) % config.books) + "\"";
+        }
+        booklists += "]";
+    }
+    booklists += "},\"willStreamMetadata\":true,\"supportsSync\":true}";
+    if (!sendFrame(SEND_BOOKLISTS, booklists) || !barrier("SEND_BOOKLISTS")) return false;
+    now = SessionMetrics::nowUs();
+    result.booklistsUs = now - t;
+    t = now;
+
+    // Read state updates, alternating so that every message changes something
+    if (config.books > 0) {
+        for (int i = 0; i < config.metadataUpdates; i++) {
+            std::string json = "{\"index\":" + std::to_string(i) +
+                               ",\"count\":" + std::to_string(config.metadataUpdates) +
+                               ",\"supportsSync\":true,\"data\":" +
+                               bookMetadataJson(i % config.books, (i / config.books) % 2 == 0) + "}";
+            if (!sendFrame(SEND_BOOK_METADATA, json)) return false;
+        }
+    }
+    if (!barrier("SEND_BOOK_METADATA")) return false;
+    now = SessionMetrics::nowUs();
+    result.metadataUs = now - t;
+    t = now;
+
+    // Deletes: one OK for the command, then one per book
+    int deletes = std::min(config.deletes, config.books);
+    if (deletes > 0) {
+        std::string json = "{\"lpaths\":[";
+        for (int i = 0; i < deletes; i++) {
+            if (i) json += ",";
+            json += "\"" + lpathForBook(i) + "\"";
+        }
+        json += "]}";
+        if (!sendFrame(DELETE_BOOK, json)) return false;
+        for (int i = 0; i <= deletes; i++) {
+            if (!expectOK("DELETE_BOOK")) return false;
+        }
+    }
+    now = SessionMetrics::nowUs();
+    result.deleteUs = now - t;
+
+    if (!sendFrame(NOOP, "{\"ejecting\":true}") || !expectOK("NOOP")) return false;
+
+    result.totalUs = SessionMetrics::nowUs() - result.sessionStartUs;
+    return true;
+}
+
+bool FakeCalibre::sendFrame(int opcode, const std::string& json) {
+    std::string message = "[" + std::to_string(opcode) + "," + json + "]";
+    std::string frame = std::to_string(message.size()) + message;
+    if (!sendAll(frame.data(), frame.size())) {
+        return fail(std::string("connection lost while sending ") + getOpcodeName(opcode));
+    }
+    return true;
+}
+
+bool FakeCalibre::receiveFrame(int& opcode, std::string& json) {
+    char lengthBuf[32];
+    size_t pos = 0;
+    for (;;) {
+        char c;
+        if (!receiveAll(&c, 1)) return false;
+        if (c == '[') break;
+        if (pos >= sizeof(lengthBuf) - 1) return false;
+        lengthBuf[pos++] = c;
+    }
+    lengthBuf[pos] = '\0';
+
+    int length = atoi(lengthBuf);
+    if (length < 2) return false;
+
+    std::string message(length, '[');
+    if (!receiveAll(&message[1], length - 1)) return false;
+
+    opcode = atoi(message.c_str() + 1);
+    size_t comma = message.find(',');
+    json = comma != std::string::npos ? message.substr(comma + 1, message.size() - comma - 2) : "";
+    return true;
+}
+
+bool FakeCalibre::expectOK(const char* what, std::string* json) {
+    int opcode;
+    std::string body;
+    if (!receiveFrame(opcode, body)) {
+        return fail(std::string("no reply to ") + what);
+    }
+    if (opcode != OK) {
+        return fail(std::string(what) + " answered with " + getOpcodeName(opcode) + " " + body);
+    }
+    if (json) json->swap(body);
+    return true;
+}
+
+bool FakeCalibre::barrier(const char* what) {
+    if (!sendFrame(NOOP, "{}")) return false;
+    return expectOK(what);
+}
+
+bool FakeCalibre::sendAll(const void* data, size_t length) {
+    const char* ptr = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t sent = send(clientFd, ptr, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            return false;
+        }
+        ptr += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+bool FakeCalibre::receiveAll(void* buffer, size_t length) {
+    char* ptr = static_cast<char*>(buffer);
+    while (length > 0) {
+        ssize_t received = recv(clientFd, ptr, length, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) continue;
+            return false;
+        }
+        ptr += received;
+        length -= received;
+    }
+    return true;
+}
+
+bool FakeCalibre::fail(const std::string& message) {
+    if (result.error.empty()) result.error = message;
+    return false;
+}
@@ -0,0 +1,107 @@
+#ifndef FAKE_CALIBRE_H
+#define FAKE_CALIBRE_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+// What the fake server sends in one session
+struct FakeCalibreConfig {
+    int books;                // SEND_BOOK count
+    long long bookSize;       // bytes per book
+    long long bookSizeMax;    // if > bookSize, sizes are spread over [bookSize, bookSizeMax]
+    int thumbnailBytes;       // raw cover size, sent base64 encoded in the metadata
+    int metadataUpdates;      // SEND_BOOK_METADATA messages after the booklists
+    int collections;          // collections in SEND_BOOKLISTS
+    int collectionSize;       // books per collection
+    int deletes;              // lpaths in the final DELETE_BOOK
+    std::string readColumn;   // user_metadata column carrying the read flag
+    std::string readDateColumn;
+
+    FakeCalibreConfig()
+        : books(100), bookSize(512 * 1024), bookSizeMax(0), thumbnailBytes(12 * 1024),
+          metadataUpdates(100), collections(10), collectionSize(20), deletes(10),
+          readColumn("#read"), readDateColumn("#read_date") {}
+};
+
+// Server side view of the session, times are SessionMetrics::nowUs() values
+// or durations in microseconds
+struct FakeCalibreResult {
+    bool ok;
+    std::string error;
+
+    int deviceBookCount;         // "count" answered to GET_BOOK_COUNT
+    int booksSent;
+    unsigned long long bookBytesSent;
+
+    unsigned long long sessionStartUs;
+    unsigned long long sendBooksStartUs;
+    unsigned long long handshakeUs;
+    unsigned long long bookCountUs;
+    unsigned long long sendBooksUs;
+    unsigned long long booklistsUs;
+    unsigned long long metadataUs;
+    unsigned long long deleteUs;
+    unsigned long long totalUs;
+
+    FakeCalibreResult()
+        : ok(false), deviceBookCount(0), booksSent(0), bookBytesSent(0),
+          sessionStartUs(0), sendBooksStartUs(0), handshakeUs(0), bookCountUs(0),
+          sendBooksUs(0), booklistsUs(0), metadataUs(0), deleteUs(0), totalUs(0) {}
+};
+
+// Loopback stand-in for the calibre smart device server. It accepts one
+// connection from NetworkManager and plays a fixed session:
+//   GET_INITIALIZATION_INFO, GET_DEVICE_INFORMATION, SET_CALIBRE_DEVICE_INFO,
+//   FREE_SPACE, GET_BOOK_COUNT, N x SEND_BOOK, SEND_BOOKLISTS,
+//   M x SEND_BOOK_METADATA, DELETE_BOOK, NOOP (ejecting)
+// Messages the device does not answer are followed by an empty NOOP so that
+// every phase ends when the device has actually processed it.
+class FakeCalibre {
+public:
+    explicit FakeCalibre(const FakeCalibreConfig& config);
+    ~FakeCalibre();
+
+    // Bind 127.0.0.1 on an ephemeral port, returns the port or -1
+    int listen();
+
+    // Accept and play the session on a background thread
+    void start();
+
+    // Join the session thread
+    const FakeCalibreResult& wait();
+
+    // Unblock the session thread if the device side gave up
+    void abort();
+
+    static std::string lpathForBook(int index);
+
+    // The "metadata" object sent with SEND_BOOK / SEND_BOOK_METADATA
+    std::string bookMetadataJson(int index, bool isRead) const;
+
+private:
+    FakeCalibreConfig config;
+    FakeCalibreResult result;
+    int listenFd;
+    std::atomic<int> clientFd;
+    std::thread worker;
+
+    std::vector<char> payload;
+    std::string thumbnail;
+
+    void run();
+    bool play();
+
+    long long bookSizeFor(int index) const;
+
+    bool sendFrame(int opcode, const std::string& json);
+    bool receiveFrame(int& opcode, std::string& json);
+    bool expectOK(const char* what, std::string* json = nullptr);
+    bool barrier(const char* what);
+    bool sendAll(const void* data, size_t length);
+    bool receiveAll(void* buffer, size_t length);
+    bool fail(const std::string& message);
+};
+
+#endif // FAKE_CALIBRE_H
@@ -0,0 +1,97 @@
+// Synthetic library generator: writes <root>/ext1/system/explorer-3/explorer-3.db
+// with the requested shape and (optionally) matching sparse placeholder files,
+// so that BookManager queries can be measured at 1k / 10k / 100k books.
+// Point the host engine at it with CALIBRE_HOST_FLASHDIR=<root>/ext1.
+
+#include "explorer_db.h"
+#include "metrics.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s --root DIR [options]\n"
+            "  --books N             books (1000)\n"
+            "  --fanout N            books per author folder (8)\n"
+            "  --collections N       collections (20)\n"
+            "  --collection-size N   books per collection (50)\n"
+            "  --profiles N          reader profiles (1)\n"
+            "  --read-ratio R        share of read books per profile (0.3)\n"
+            "  --favorite-ratio R    share of favorites per profile (0.05)\n"
+            "  --card-ratio R        share of books on the SD card, <root>/ext2 (0)\n"
+            "  --file-size BYTES     placeholder file size (262144, sparse)\n"
+            "  --no-files            only write the database\n"
+            "  --seed N              random seed (1)\n",
+            argv0);
+}
+
+static long long fileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (long long)st.st_size : 0;
+}
+
+int main(int argc, char** argv) {
+    ExplorerDbOptions options;
+    std::string root;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--root" && hasValue) root = argv[++i];
+        else if (arg == "--books" && hasValue) options.books = atoi(argv[++i]);
+        else if (arg == "--fanout" && hasValue) options.booksPerFolder = atoi(argv[++i]);
+        else if (arg == "--collections" && hasValue) options.collections = atoi(argv[++i]);
+        else if (arg == "--collection-size" && hasValue) options.collectionSize = atoi(argv[++i]);
+        else if (arg == "--profiles" && hasValue) options.profiles = atoi(argv[++i]);
+        else if (arg == "--read-ratio" && hasValue) options.readRatio = atof(argv[++i]);
+        else if (arg == "--favorite-ratio" && hasValue) options.favoriteRatio = atof(argv[++i]);
+        else if (arg == "--card-ratio" && hasValue) options.cardRatio = atof(argv[++i]);
+        else if (arg == "--file-size" && hasValue) options.fileSize = atoll(argv[++i]);
+        else if (arg == "--no-files") options.createFiles = false;
+        else if (arg == "--seed" && hasValue) options.seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (root.empty() || options.books < 0 || options.profiles < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    while (root.size() > 1 && root[root.size() - 1] == '/') root.erase(root.size() - 1);
+
+    std::string flashDir = root + "/ext1";
+    std::string cardDir = options.cardRatio > 0 ? root + "/ext2" : "";
+    std::string dbDir = flashDir + "/system/explorer-3";
+    std::string dbPath = dbDir + "/explorer-3.db";
+
+    mkdir(root.c_str(), 0755);
+    mkdir(flashDir.c_str(), 0755);
+    mkdir((flashDir + "/system").c_str(), 0755);
+    mkdir(dbDir.c_str(), 0755);
+    if (!cardDir.empty()) mkdir(cardDir.c_str(), 0755);
+
+    // Always start from an empty database
+    remove(dbPath.c_str());
+    remove((dbPath + "-wal").c_str());
+    remove((dbPath + "-shm").c_str());
+
+    unsigned long long start = SessionMetrics::nowUs();
+    if (!createExplorerDb(dbPath) || !populateExplorerDb(dbPath, flashDir, cardDir, options)) {
+        return 1;
+    }
+    unsigned long long elapsedUs = SessionMetrics::nowUs() - start;
+
+    printf("{\"db\":\"%s\",\"books\":%d,\"author_folders\":%d,\"collections\":%d,\"profiles\":%d,"
+           "\"files\":%s,\"db_bytes\":%lld,\"elapsed_ms\":%.3f}\n",
+           dbPath.c_str(), options.books,
+           options.booksPerFolder > 0 ? (options.books + options.booksPerFolder - 1) / options.booksPerFolder
+                                      : options.books,
+           options.books > 0 ? options.collections : 0, options.profiles,
+           options.createFiles ? "true" : "false", fileSize(dbPath), elapsedUs / 1000.0);
+    return 0;
+}
@@ -0,0 +1,471 @@
+// Micro-benchmarks for the sync engine hot paths: JSON conversion, base64, the
+// metadata cache, BookManager SQL, collection diffing and NetworkManager
+// framing. Prints one JSON document to stdout:
+//   {"library_books":N,"benchmarks":[{"name":...,"ns_per_op":...},...]}
+// ns_per_op is the median over --repeat runs, ns_per_op_min the best run.
+
+#include "fake_calibre.h"
+#include "explorer_db.h"
+#include "calibre_protocol.h"
+#include "network.h"
+#include "book_manager.h"
+#include "cache_manager.h"
+#include "metrics.h"
+#include "base64.h"
+#include "inkview.h"
+#include <json-c/json.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <set>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Access to the private hot paths (friend of CalibreProtocol and BookManager)
+class BenchmarkAccess {
+public:
+    static json_object* parseJSON(CalibreProtocol& p, const std::string& frame) { return p.parseJSON(frame); }
+    static void freeJSON(CalibreProtocol& p, json_object* obj) { p.freeJSON(obj); }
+    static std::string jsonToString(CalibreProtocol& p, json_object* obj) { return p.jsonToString(obj); }
+    static BookMetadata jsonToMetadata(CalibreProtocol& p, json_object* obj) { return p.jsonToMetadata(obj); }
+    static bool pullSendBook(CalibreProtocol& p, const std::string& frame, SendBookRequest& request) {
+        return p.pullSendBook(frame, request);
+    }
+    static bool pullSendBookMetadata(CalibreProtocol& p, const std::string& frame, BookMetadata& m) {
+        return p.pullSendBookMetadata(frame, m);
+    }
+    static void writeBookJson(std::string& out, const BookMetadata& m, bool cached, int priKey) {
+        CalibreProtocol::writeBookJson(out, m, cached, priKey);
+    }
+    static std::string cleanCollectionName(const std::string& name) {
+        return CalibreProtocol::cleanCollectionName(name);
+    }
+    static void diffCollection(const std::set<std::string>& calibreFiles,
+                               const std::set<std::string>& deviceFiles,
+                               std::vector<std::string>& toAdd, std::vector<std::string>& toRemove) {
+        BookManager::diffCollection(calibreFiles, deviceFiles, toAdd, toRemove);
+    }
+    static bool processBookSettings(BookManager& b, sqlite3* db, int bookId,
+                                    const BookMetadata& m, int profileId) {
+        return b.processBookSettings(db, bookId, m, profileId);
+    }
+};
+
+struct BenchOptions {
+    std::string filter;
+    int repeat;
+    double scale;
+    int libraryBooks;
+    BenchOptions() : repeat(5), scale(1.0), libraryBooks(2000) {}
+};
+
+static BenchOptions options;
+static bool firstResult = true;
+
+// Keeps the compiler from dropping results
+static volatile size_t sink;
+
+// Runs fn(0 .. iterations-1) 'repeat' times; fn gets a global op index so
+// that stateful benchmarks never repeat an input
+static void bench(const char* name, long long iterations, long long bytesPerOp,
+                  const std::function<void(long long)>& fn) {
+    if (!options.filter.empty() && strstr(name, options.filter.c_str()) == NULL) return;
+
+    iterations = std::max(1LL, (long long)(iterations * options.scale));
+    std::vector<double> runs;
+    long long op = 0;
+
+    fn(op++); // warm-up
+    for (int r = 0; r < options.repeat; r++) {
+        unsigned long long start = SessionMetrics::nowUs();
+        for (long long i = 0; i < iterations; i++) fn(op++);
+        unsigned long long elapsed = SessionMetrics::nowUs() - start;
+        runs.push_back(elapsed * 1000.0 / iterations);
+    }
+    std::sort(runs.begin(), runs.end());
+
+    printf("%s\n  {\"name\":\"%s\",\"iterations\":%lld,\"repeat\":%d,\"ns_per_op\":%.1f,"
+           "\"ns_per_op_min\":%.1f",
+           firstResult ? "" : ",", name, iterations, options.repeat,
+           runs[runs.size() / 2], runs[0]);
+    if (bytesPerOp > 0) {
+        printf(",\"bytes_per_op\":%lld,\"mb_per_s\":%.2f", bytesPerOp,
+               bytesPerOp / (runs[runs.size() / 2] / 1e9) / (1024.0 * 1024.0));
+    }
+    printf("}");
+    fflush(stdout);
+    firstResult = false;
+}
+
+static std::string frame(int opcode, const std::string& json) {
+    return "[" + std::to_string(opcode) + "," + json + "]";
+}
+
+static void touchFile(const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) close(fd);
+}
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
+}
+
+static BookMetadata sampleMetadata(int index) {
+    BookMetadata m;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "00000000-0000-4000-8000-%012d", index);
+    m.uuid = buf;
+    snprintf(buf, sizeof(buf), "Book %05d", index);
+    m.title = buf;
+    m.authors = "Author " + std::to_string(index % 97);
+    m.lpath = FakeCalibre::lpathForBook(index);
+    m.series = index % 3 == 0 ? "Series " + std::to_string(index % 13) : "";
+    m.seriesIndex = index % 7;
+    m.lastModified = "2024-05-01T10:00:00+00:00";
+    m.size = 512 * 1024;
+    m.isRead = index % 2 == 0;
+    if (m.isRead) m.lastReadDate = "2024-06-01T12:00:00+00:00";
+    return m;
+}
+
+// --- JSON ---
+
+static void benchJson(CalibreProtocol& protocol) {
+    FakeCalibreConfig config;
+    config.bookSize = 0;
+    FakeCalibre calibre(config);
+
+    std::string metadataJson = calibre.bookMetadataJson(1, true);
+    std::string sendBook = frame(SEND_BOOK,
+        "{\"lpath\":\"" + FakeCalibre::lpathForBook(1) + "\",\"length\":524288,\"thisBook\":1,"
+        "\"totalBooks\":100,\"willStreamBooks\":true,\"willStreamBinary\":true,"
+        "\"wantsSendOkToSendbook\":true,\"canSupportLpathChanges\":true,\"metadata\":" + metadataJson + "}");
+    std::string sendMetadata = frame(SEND_BOOK_METADATA,
+        "{\"index\":1,\"count\":100,\"supportsSync\":true,\"data\":" + metadataJson + "}");
+    std::string noop = frame(NOOP, "{\"priKey\":42}");
+
+    bench("json/parseJSON/SEND_BOOK", 2000, sendBook.size(), [&](long long) {
+        json_object* obj = BenchmarkAccess::parseJSON(protocol, sendBook);
+        BenchmarkAccess::freeJSON(protocol, obj);
+    });
+    bench("json/parseJSON/SEND_BOOK_METADATA", 2000, sendMetadata.size(), [&](long long) {
+        json_object* obj = BenchmarkAccess::parseJSON(protocol, sendMetadata);
+        BenchmarkAccess::freeJSON(protocol, obj);
+    });
+    // Handler-ready metadata straight from the frame (no DOM, no jsonToMetadata),
+    // reusing the request like handleMessages does
+    SendBookRequest request;
+    bench("json/pull/SEND_BOOK", 20000, sendBook.size(), [&](long long) {
+        request.clear();
+        if (BenchmarkAccess::pullSendBook(protocol, sendBook, request)) sink += request.metadata.title.size();
+    });
+    bench("json/pull/SEND_BOOK_METADATA", 20000, sendMetadata.size(), [&](long long) {
+        request.clear();
+        if (BenchmarkAccess::pullSendBookMetadata(protocol, sendMetadata, request.metadata)) {
+            sink += request.metadata.title.size();
+        }
+    });
+    // Cover thumbnail from SEND_BOOK, as decoded by the cover writer
+    std::string thumbnail;
+    request.clear();
+    if (BenchmarkAccess::pullSendBook(protocol, sendBook, request)) thumbnail = request.metadata.thumbnail;
+    std::vector<unsigned char> jpeg(base64DecodedSize(thumbnail.size()));
+    bench("base64/decode/thumbnail", 20000, thumbnail.size(), [&](long long) {
+        size_t length = 0;
+        if (base64Decode(thumbnail.data(), thumbnail.size(), jpeg.data(), length)) sink += length;
+    });
+    bench("json/parseJSON/NOOP", 50000, noop.size(), [&](long long) {
+        json_object* obj = BenchmarkAccess::parseJSON(protocol, noop);
+        BenchmarkAccess::freeJSON(protocol, obj);
+    });
+
+    json_object* parsed = BenchmarkAccess::parseJSON(protocol, sendMetadata);
+    json_object* data = NULL;
+    json_object_object_get_ex(parsed, "data", &data);
+    bench("json/jsonToMetadata", 20000, 0, [&](long long) {
+        BookMetadata m = BenchmarkAccess::jsonToMetadata(protocol, data);
+        sink += m.title.size();
+    });
+    BenchmarkAccess::freeJSON(protocol, parsed);
+
+    BookMetadata metadata = sampleMetadata(3);
+    // Same reusable buffer as the GET_BOOK_COUNT stream
+    std::string entry;
+    bench("json/writeBookJson", 50000, 0, [&](long long i) {
+        entry.clear();
+        BenchmarkAccess::writeBookJson(entry, metadata, false, (int)i);
+        sink += entry.size();
+    });
+    bench("json/writeBookJson/cached", 50000, 0, [&](long long i) {
+        entry.clear();
+        BenchmarkAccess::writeBookJson(entry, metadata, true, (int)i);
+        sink += entry.size();
+    });
+}
+
+// --- Metadata cache ---
+
+static void benchCache(int entries) {
+    CacheManager cache;
+    cache.initialize("00000000-0000-4000-8000-0000000bench");
+    cache.clearCache();
+
+    std::vector<BookMetadata> books;
+    for (int i = 0; i < entries; i++) books.push_back(sampleMetadata(i));
+
+    bench("cache/updateCache", entries, 0, [&](long long i) {
+        cache.updateCache(books[i % entries]);
+    });
+    bench("cache/purgeOldEntries", 20, 0, [&](long long) {
+        cache.purgeOldEntries(30);
+    });
+    bench("cache/saveCache", 10, 0, [&](long long) {
+        cache.saveCache();
+    });
+    bench("cache/loadCache", 10, 0, [&](long long) {
+        cache.clearCache();
+        cache.loadCache();
+        sink += cache.getCacheSize();
+    });
+}
+
+// --- BookManager ---
+
+static void benchBookManager(const std::string& flashDir) {
+    BookManager books;
+    books.initialize("");
+    const StorageContext& storage = books.getStorage("main");
+
+    bench("db/getAllBooks", 10, 0, [&](long long) {
+        sink += books.getAllBooks(storage).size();
+    });
+
+    std::string newDir = flashDir + "/Bench New";
+    mkdir(newDir.c_str(), 0755);
+    long long addIterations = std::max(1LL, (long long)(200 * options.scale));
+    for (long long i = 0; i <= addIterations * options.repeat; i++) {
+        touchFile(newDir + "/New " + std::to_string(i) + ".epub");
+    }
+    bench("db/addBook/insert", 200, 0, [&](long long i) {
+        BookMetadata m = sampleMetadata((int)i);
+        m.lpath = "Bench New/New " + std::to_string(i) + ".epub";
+        books.addBook(storage, m);
+    });
+
+    BookMetadata existing = sampleMetadata(0);
+    existing.lpath = "Bench New/New 0.epub";
+    bench("db/addBook/update", 200, 0, [&](long long i) {
+        existing.isRead = (i % 2) == 0;
+        books.addBook(storage, existing);
+    });
+
+    sqlite3* db = books.openDB();
+    if (db) {
+        int bookId = books.findBookIdByPath(db, storage, existing.lpath);
+        sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+        bench("db/processBookSettings", 2000, 0, [&](long long i) {
+            existing.isRead = (i % 2) == 0;
+            BenchmarkAccess::processBookSettings(books, db, bookId, existing, 1);
+        });
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+
+        std::string lpath = generatedBookLpath(options.libraryBooks / 2, ExplorerDbOptions());
+        bench("db/findBookIdByPath", 2000, 0, [&](long long) {
+            sink += books.findBookIdByPath(db, storage, lpath);
+        });
+        books.closeDB(db);
+    }
+}
+
+// --- Collections ---
+
+static void benchCollections() {
+    const char* names[] = { "Fantasy (Tags)", "Favourites", "Ursula K. Le Guin (Authors)", "Plain" };
+    bench("collections/cleanCollectionName", 200000, 0, [&](long long i) {
+        sink += BenchmarkAccess::cleanCollectionName(names[i & 3]).size();
+    });
+
+    std::set<std::string> calibreFiles, deviceFiles;
+    for (int i = 0; i < 1000; i++) {
+        if (i % 10 != 0) calibreFiles.insert(FakeCalibre::lpathForBook(i));
+        if (i % 10 != 5) deviceFiles.insert(FakeCalibre::lpathForBook(i));
+    }
+    bench("collections/diffCollection/1000", 2000, 0, [&](long long) {
+        std::vector<std::string> toAdd, toRemove;
+        BenchmarkAccess::diffCollection(calibreFiles, deviceFiles, toAdd, toRemove);
+        sink += toAdd.size() + toRemove.size();
+    });
+}
+
+// --- NetworkManager framing over loopback ---
+
+class LoopbackPeer {
+public:
+    LoopbackPeer() : listenFd(-1), peerFd(-1), port(0) {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0 &&
+            listen(listenFd, 1) == 0 &&
+            getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0) {
+            port = ntohs(addr.sin_port);
+        }
+    }
+    ~LoopbackPeer() {
+        if (worker.joinable()) worker.join();
+        if (peerFd >= 0) close(peerFd);
+        if (listenFd >= 0) close(listenFd);
+    }
+
+    bool connect(NetworkManager& network) {
+        if (port == 0 || !network.connectToServer("127.0.0.1", port)) return false;
+        peerFd = accept(listenFd, NULL, NULL);
+        return peerFd >= 0;
+    }
+
+    // Discard everything until the device side closes
+    void drain() {
+        worker = std::thread([this]() {
+            std::vector<char> buffer(64 * 1024);
+            while (recv(peerFd, buffer.data(), buffer.size(), 0) > 0) {}
+        });
+    }
+
+    // Send 'data' 'count' times
+    void feed(const std::string& data, long long count) {
+        worker = std::thread([this, data, count]() {
+            for (long long i = 0; i < count; i++) {
+                const char* p = data.data();
+                size_t left = data.size();
+                while (left > 0) {
+                    ssize_t sent = send(peerFd, p, left, MSG_NOSIGNAL);
+                    if (sent <= 0) return;
+                    p += sent;
+                    left -= sent;
+                }
+            }
+        });
+    }
+
+private:
+    int listenFd;
+    int peerFd;
+    int port;
+    std::thread worker;
+};
+
+static void benchNetwork() {
+    FakeCalibreConfig config;
+    config.bookSize = 0;
+    FakeCalibre calibre(config);
+    std::string body = "{\"index\":1,\"count\":100,\"data\":" + calibre.bookMetadataJson(1, false) + "}";
+    std::string message = frame(SEND_BOOK_METADATA, body);
+    std::string wire = std::to_string(message.size()) + message;
+
+    {
+        NetworkManager network;
+        LoopbackPeer peer;
+        if (peer.connect(network)) {
+            peer.drain();
+            bench("network/sendJSON", 5000, wire.size(), [&](long long) {
+                network.sendJSON(OK, body.c_str());
+            });
+            network.disconnect();
+        }
+    }
+
+    {
+        long long iterations = std::max(1LL, (long long)(5000 * options.scale));
+        NetworkManager network;
+        LoopbackPeer peer;
+        if (peer.connect(network)) {
+            peer.feed(wire, iterations * (options.repeat + 1));
+            bench("network/receiveJSON", 5000, wire.size(), [&](long long) {
+                CalibreOpcode opcode;
+                std::string json;
+                network.receiveJSON(opcode, json);
+                sink += json.size();
+            });
+            network.disconnect();
+        }
+    }
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --filter TEXT   only run benchmarks whose name contains TEXT\n"
+            "  --repeat N      timed runs per benchmark (5)\n"
+            "  --scale F       multiply iteration counts (1.0)\n"
+            "  --library N     books in the generated library for db/ and cache/ (2000)\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--filter" && hasValue) options.filter = argv[++i];
+        else if (arg == "--repeat" && hasValue) options.repeat = std::max(1, atoi(argv[++i]));
+        else if (arg == "--scale" && hasValue) options.scale = atof(argv[++i]);
+        else if (arg == "--library" && hasValue) options.libraryBooks = std::max(1, atoi(argv[++i]));
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/calibre-microbench-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    std::string flashDir = root + "/ext1";
+    iv_host_set_flashdir(flashDir.c_str());
+    iv_host_set_sdcarddir((root + "/ext2").c_str());
+
+    mkdir(flashDir.c_str(), 0755);
+    mkdir(BookManager::getSystemPath("").c_str(), 0755);
+    mkdir(BookManager::getSystemPath("explorer-3").c_str(), 0755);
+
+    std::string dbPath = BookManager::getSystemPath("explorer-3/explorer-3.db");
+    ExplorerDbOptions library;
+    library.books = options.libraryBooks;
+    library.fileSize = 0;
+    if (!createExplorerDb(dbPath) || !populateExplorerDb(dbPath, flashDir, "", library)) {
+        return 1;
+    }
+
+    printf("{\"library_books\":%d,\"benchmarks\":[", options.libraryBooks);
+
+    {
+        NetworkManager network;
+        BookManager books;
+        CacheManager cache;
+        CalibreProtocol protocol(&network, &books, &cache, "#read", "#read_date", "");
+        benchJson(protocol);
+    }
+    benchCache(options.libraryBooks);
+    benchBookManager(flashDir);
+    benchCollections();
+    benchNetwork();
+
+    printf("\n]}\n");
+
+    nftw(root.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
@@ -0,0 +1,265 @@
+// End-to-end transfer benchmark: drives CalibreProtocol against FakeCalibre
+// over loopback, with a scratch library and a synthetic explorer-3.db.
+// Prints one JSON object to stdout.
+
+#include "fake_calibre.h"
+#include "explorer_db.h"
+#include "calibre_protocol.h"
+#include "network.h"
+#include "book_manager.h"
+#include "cache_manager.h"
+#include "logger.h"
+#include "metrics.h"
+#include "inkview.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --books N            books to send (100)\n"
+            "  --size BYTES         book size (524288)\n"
+            "  --size-max BYTES     spread book sizes up to this value\n"
+            "  --thumbnail BYTES    raw cover size in the metadata (12288)\n"
+            "  --metadata N         SEND_BOOK_METADATA messages (100)\n"
+            "  --collections N      collections in SEND_BOOKLISTS (10)\n"
+            "  --collection-size N  books per collection (20)\n"
+            "  --delete N           books deleted at the end (10)\n"
+            "  --library N          pre-populate a new library with N generated books (0)\n"
+            "  --dir PATH           library root (default: new directory in /tmp)\n"
+            "  --keep               keep the library root afterwards\n"
+            "  --indexer            simulate the library rescanning on every BookReady\n"
+            "  --fail-books N       make the last N books fail to store, and check they\n"
+            "                       end up neither in the DB nor in the cache (0)\n"
+            "  --no-log             do not write calibre-connect.log\n",
+            argv0);
+}
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
+}
+
+// Book bytes still in the page cache after the transfer
+static unsigned long long cachedBookBytes = 0;
+
+static int addCachedBytes(const char* path, const struct stat* st, int type, struct FTW*) {
+    size_t length = (size_t)st->st_size;
+    if (type != FTW_F || length == 0 || strstr(path, "/system/")) return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    void* map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident((length + page - 1) / page);
+    if (mincore(map, length, resident.data()) == 0) {
+        for (size_t i = 0; i < resident.size(); i++) {
+            if (resident[i] & 1) cachedBookBytes += page;
+        }
+    }
+    munmap(map, length);
+    return 0;
+}
+
+static double perSecond(double amount, unsigned long long us) {
+    return us > 0 ? amount * 1000000.0 / us : 0.0;
+}
+
+int main(int argc, char** argv) {
+    FakeCalibreConfig config;
+    std::string root;
+    bool keep = false;
+    bool log = true;
+    int libraryBooks = 0;
+    bool indexer = false;
+    int failBooks = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--books" && hasValue) config.books = atoi(argv[++i]);
+        else if (arg == "--size" && hasValue) config.bookSize = atoll(argv[++i]);
+        else if (arg == "--size-max" && hasValue) config.bookSizeMax = atoll(argv[++i]);
+        else if (arg == "--thumbnail" && hasValue) config.thumbnailBytes = atoi(argv[++i]);
+        else if (arg == "--metadata" && hasValue) config.metadataUpdates = atoi(argv[++i]);
+        else if (arg == "--collections" && hasValue) config.collections = atoi(argv[++i]);
+        else if (arg == "--collection-size" && hasValue) config.collectionSize = atoi(argv[++i]);
+        else if (arg == "--delete" && hasValue) config.deletes = atoi(argv[++i]);
+        else if (arg == "--library" && hasValue) libraryBooks = atoi(argv[++i]);
+        else if (arg == "--dir" && hasValue) root = argv[++i];
+        else if (arg == "--keep") keep = true;
+        else if (arg == "--indexer") indexer = true;
+        else if (arg == "--fail-books" && hasValue) failBooks = atoi(argv[++i]);
+        else if (arg == "--no-log") log = false;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    bool ownRoot = root.empty();
+    if (ownRoot) {
+        char tmpl[] = "/tmp/calibre-bench-XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        root = tmpl;
+    }
+
+    std::string flashDir = root + "/ext1";
+    iv_host_set_flashdir(flashDir.c_str());
+    iv_host_set_sdcarddir((root + "/ext2").c_str()); // not created: no SD card
+
+    mkdir(flashDir.c_str(), 0755);
+    mkdir(BookManager::getSystemPath("").c_str(), 0755);
+    mkdir(BookManager::getSystemPath("explorer-3").c_str(), 0755);
+
+    std::string dbPath = BookManager::getSystemPath("explorer-3/explorer-3.db");
+    struct stat st;
+    if (stat(dbPath.c_str(), &st) != 0) {
+        if (!createExplorerDb(dbPath)) return 1;
+
+        if (libraryBooks > 0) {
+            ExplorerDbOptions library;
+            library.books = libraryBooks;
+            if (!populateExplorerDb(dbPath, flashDir, "", library)) return 1;
+        }
+    }
+
+    // Fixed identity so that a reused --dir also reuses the metadata cache
+    WriteString(GetGlobalConfig(), "calibre_device_uuid", "00000000-0000-4000-8000-0000000bench");
+
+    if (log) {
+        Logger::open(BookManager::getSystemPath("calibre-connect.log").c_str(), 1024 * 1024);
+        Logger::setLevel(LOG_INFO);
+    }
+
+    iv_host_set_indexer(indexer);
+
+    FakeCalibre server(config);
+    int port = server.listen();
+    if (port < 0) {
+        perror("listen");
+        return 1;
+    }
+    server.start();
+
+    std::atomic<unsigned long long> firstBookUs(0);
+    bool handshakeOk;
+    std::string protocolError;
+    bool failedBooksOk = true;
+    {
+        NetworkManager network;
+        BookManager books;
+        CacheManager cache;
+        books.initialize("");
+
+        // A non-empty directory where the book goes makes its final rename
+        // fail, after the book was acknowledged
+        std::vector<std::string> failLpaths;
+        for (int i = std::max(config.books - failBooks, 0); i < config.books; i++) {
+            std::string lpath = FakeCalibre::lpathForBook(i);
+            std::string path = books.getStorage("").getBookFilePath(lpath);
+            mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+            mkdir(path.c_str(), 0755);
+            fclose(fopen((path + "/blocker").c_str(), "w"));
+            failLpaths.push_back(lpath);
+        }
+
+        CalibreProtocol protocol(&network, &books, &cache,
+                                 config.readColumn, config.readDateColumn, "");
+
+        handshakeOk = network.connectToServer("127.0.0.1", port) &&
+                      protocol.performHandshake("");
+        if (handshakeOk) {
+            protocol.handleMessages([&firstBookUs](const std::string& status) {
+                if (status == "BOOK_RECEIVED" && firstBookUs.load() == 0) {
+                    firstBookUs.store(SessionMetrics::nowUs());
+                }
+            });
+        } else {
+            server.abort();
+        }
+        protocolError = protocol.getErrorMessage();
+        protocol.disconnect();
+        network.disconnect();
+
+        if (!failLpaths.empty()) {
+            failedBooksOk = protocol.getBooksReceivedCount() == config.books - (int)failLpaths.size();
+            sqlite3* db = books.openDB();
+            for (const std::string& lpath : failLpaths) {
+                BookMetadata cached;
+                if (!db || books.findBookIdByPath(db, lpath) >= 0 ||
+                    cache.getCachedMetadata(lpath, cached)) {
+                    failedBooksOk = false;
+                }
+            }
+            books.closeDB(db);
+        }
+    }
+
+    const FakeCalibreResult& result = server.wait();
+    int indexerScans = iv_host_indexer_wait();
+    nftw(flashDir.c_str(), addCachedBytes, 16, FTW_PHYS);
+    unsigned long long sendBooksEndUs = result.sendBooksStartUs + result.sendBooksUs;
+
+    if (log) Logger::close();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    unsigned long long firstBook = firstBookUs.load();
+    printf("{\"ok\":%s,\"books\":%d,\"book_bytes\":%llu,\"device_book_count\":%d,"
+           "\"handshake_ms\":%.3f,\"book_count_ms\":%.3f,\"send_books_ms\":%.3f,"
+           "\"books_per_s\":%.2f,\"mb_per_s\":%.2f,\"first_book_ms\":%.3f,"
+           "\"booklists_ms\":%.3f,\"metadata_ms\":%.3f,\"metadata_per_s\":%.2f,"
+           "\"delete_ms\":%.3f,\"total_ms\":%.3f,\"book_ready_calls\":%d,"
+           "\"book_ready_during_send_books\":%d,\"indexer_scans\":%d,"
+           "\"indexer_busy_during_send_books_ms\":%.3f,\"covers_cached\":%d,"
+           "\"book_page_cache_kb\":%llu,\"peak_rss_kb\":%ld,\"failed_books_ok\":%s",
+           result.ok && handshakeOk && failedBooksOk ? "true" : "false",
+           result.booksSent, result.bookBytesSent, result.deviceBookCount,
+           result.handshakeUs / 1000.0, result.bookCountUs / 1000.0, result.sendBooksUs / 1000.0,
+           perSecond(result.booksSent, result.sendBooksUs),
+           perSecond(result.bookBytesSent / (1024.0 * 1024.0), result.sendBooksUs),
+           firstBook > result.sendBooksStartUs ? (firstBook - result.sendBooksStartUs) / 1000.0 : 0.0,
+           result.booklistsUs / 1000.0, result.metadataUs / 1000.0,
+           perSecond(config.books > 0 ? config.metadataUpdates : 0, result.metadataUs),
+           result.deleteUs / 1000.0, result.totalUs / 1000.0,
+           iv_host_book_ready_count(),
+           iv_host_book_ready_between(result.sendBooksStartUs, sendBooksEndUs), indexerScans,
+           iv_host_indexer_busy_us(result.sendBooksStartUs, sendBooksEndUs) / 1000.0,
+           iv_host_cover_count(), cachedBookBytes / 1024, usage.ru_maxrss,
+           failedBooksOk ? "true" : "false");
+    if (!result.error.empty() || !protocolError.empty()) {
+        std::string error = !result.error.empty() ? result.error : protocolError;
+        for (size_t i = 0; i < error.size(); i++) {
+            if (error[i] == '"' || error[i] == '\\' || (unsigned char)error[i] < 0x20) error[i] = ' ';
+        }
+        printf(",\"error\":\"%s\"", error.c_str());
+    }
+    if (keep || !ownRoot) {
+        printf(",\"root\":\"%s\"", root.c_str());
+    }
+    printf("}\n");
+
+    if (ownRoot && !keep) {
+        nftw(root.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    return result.ok && handshakeOk && failedBooksOk ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#ifndef INKVIEW_HOST_STUB_H
+#define INKVIEW_HOST_STUB_H
+
+// Minimal stand-in for the PocketBook SDK inkview.h, used by HOST_BUILD.
+// It covers only what the sync engine (network, protocol, book and cache
+// managers) calls; the UI in main.cpp is not built for the host.
+//
+// The storage roots are taken from the environment so that the engine can
+// be pointed at a scratch library:
+//   CALIBRE_HOST_FLASHDIR   internal storage root (default /tmp/connect-to-calibre/ext1)
+//   CALIBRE_HOST_SDCARDDIR  SD card root (default /tmp/connect-to-calibre/ext2),
+//                           the card counts as inserted when the directory exists
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLASHDIR  iv_host_flashdir()
+#define SDCARDDIR iv_host_sdcarddir()
+
+#define ICON_INFORMATION 1
+#define ICON_QUESTION    2
+#define ICON_WARNING     3
+#define ICON_ERROR       4
+
+#define CCS_FBREADER 0
+
+typedef struct iconfig_s iconfig;
+
+typedef struct {
+    unsigned short width;
+    unsigned short height;
+    unsigned short depth;
+    unsigned short scanline;
+    unsigned char data[1];
+} ibitmap;
+
+// Files
+FILE* iv_fopen(const char* filename, const char* mode);
+int iv_fclose(FILE* f);
+void iv_buildpath(const char* path);
+
+// Device
+const char* GetDeviceModel();
+int IsSDinserted();
+char* GetCurrentProfile(); // malloc'ed, caller frees
+
+// Configuration (in-memory)
+iconfig* GetGlobalConfig();
+const char* ReadString(iconfig* cfg, const char* name, const char* deflt);
+int ReadInt(iconfig* cfg, const char* name, int deflt);
+void WriteString(iconfig* cfg, const char* name, const char* value);
+void SaveConfig(iconfig* cfg);
+void NotifyConfigChanged();
+
+// Library / UI. BookReady is counted; with the simulated indexer enabled each
+// call also queues a library rescan (stat of every file under FLASHDIR plus a
+// full read of the book) on a stub thread, like the device library does.
+void BookReady(const char* path);
+void Message(int icon, const char* title, const char* text, int timeout);
+
+// Covers: LoadJPEG only checks for a JPEG signature and returns a blank
+// 8-bit bitmap; the cover cache just counts successful puts
+ibitmap* LoadJPEG(const char* path, int width, int height, int br, int co, int proportional);
+ibitmap* GetBookCover(const char* path, int width, int height);
+int CoverCachePut(int type, const char* path, ibitmap* bitmap);
+void iv_freebitmap(ibitmap* bitmap);
+
+// Host-only helpers
+const char* iv_host_flashdir();
+const char* iv_host_sdcarddir();
+void iv_host_set_flashdir(const char* path);
+void iv_host_set_sdcarddir(const char* path);
+int iv_host_book_ready_count();
+int iv_host_cover_count();
+void iv_host_set_indexer(int enabled);
+// BookReady calls made in [fromUs, toUs), CLOCK_MONOTONIC microseconds
+int iv_host_book_ready_between(unsigned long long fromUs, unsigned long long toUs);
+// Waits for queued rescans; returns how many ran
+int iv_host_indexer_wait();
+// Time the indexer spent scanning within [fromUs, toUs)
+unsigned long long iv_host_indexer_busy_us(unsigned long long fromUs, unsigned long long toUs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INKVIEW_HOST_STUB_H
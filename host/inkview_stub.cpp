@@ -0,0 +1,295 @@
+#include "inkview.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <ctime>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+struct iconfig_s {
+    std::map<std::string, std::string> values;
+};
+
+static std::mutex stubMutex;
+static std::string flashDir;
+static std::string sdcardDir;
+static std::atomic<int> bookReadyCalls(0);
+static std::atomic<int> coversCached(0);
+
+// Simulated library indexer. Never destroyed: its detached thread still waits
+// on the condition variable at exit, and destroying one with a waiter blocks.
+struct ScanInterval {
+    unsigned long long startUs;
+    unsigned long long endUs;
+};
+
+struct Indexer {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool enabled;
+    bool running;
+    bool busy;
+    std::deque<std::string> queue;
+    std::vector<unsigned long long> bookReadyTimes;
+    std::vector<ScanInterval> scans;
+
+    Indexer() : enabled(false), running(false), busy(false) {}
+};
+
+static Indexer& indexer() {
+    static Indexer* instance = new Indexer();
+    return *instance;
+}
+
+static unsigned long long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const std::string& rootFromEnv(std::string& value, const char* env, const char* deflt) {
+    if (value.empty()) {
+        const char* v = getenv(env);
+        value = (v && *v) ? v : deflt;
+        while (value.size() > 1 && value[value.size() - 1] == '/') {
+            value.erase(value.size() - 1);
+        }
+    }
+    return value;
+}
+
+const char* iv_host_flashdir() {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    return rootFromEnv(flashDir, "CALIBRE_HOST_FLASHDIR", "/tmp/connect-to-calibre/ext1").c_str();
+}
+
+const char* iv_host_sdcarddir() {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    return rootFromEnv(sdcardDir, "CALIBRE_HOST_SDCARDDIR", "/tmp/connect-to-calibre/ext2").c_str();
+}
+
+// The setters are meant to be called before the engine is used; the strings
+// returned above are not reallocated afterwards.
+void iv_host_set_flashdir(const char* path) {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    flashDir = path ? path : "";
+}
+
+void iv_host_set_sdcarddir(const char* path) {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    sdcardDir = path ? path : "";
+}
+
+int iv_host_book_ready_count() {
+    return bookReadyCalls.load();
+}
+
+int iv_host_cover_count() {
+    return coversCached.load();
+}
+
+FILE* iv_fopen(const char* filename, const char* mode) {
+    return fopen(filename, mode);
+}
+
+int iv_fclose(FILE* f) {
+    return fclose(f);
+}
+
+void iv_buildpath(const char* path) {
+    std::string current;
+    for (const char* p = path; *p; p++) {
+        current += *p;
+        if (*p == '/' && current.size() > 1) mkdir(current.c_str(), 0755);
+    }
+    mkdir(current.c_str(), 0755);
+}
+
+const char* GetDeviceModel() {
+    return "Host";
+}
+
+int IsSDinserted() {
+    struct stat st;
+    return stat(iv_host_sdcarddir(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+char* GetCurrentProfile() {
+    return NULL;
+}
+
+iconfig* GetGlobalConfig() {
+    static iconfig globalConfig;
+    return &globalConfig;
+}
+
+const char* ReadString(iconfig* cfg, const char* name, const char* deflt) {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    std::map<std::string, std::string>::const_iterator it = cfg->values.find(name);
+    return it != cfg->values.end() ? it->second.c_str() : deflt;
+}
+
+int ReadInt(iconfig* cfg, const char* name, int deflt) {
+    const char* value = ReadString(cfg, name, NULL);
+    return value ? atoi(value) : deflt;
+}
+
+void WriteString(iconfig* cfg, const char* name, const char* value) {
+    std::lock_guard<std::mutex> lock(stubMutex);
+    cfg->values[name] = value ? value : "";
+}
+
+void SaveConfig(iconfig* cfg) {
+    (void)cfg;
+}
+
+void NotifyConfigChanged() {
+}
+
+static int statEntry(const char*, const struct stat*, int, struct FTW*) {
+    return 0;
+}
+
+static void indexerScan(const std::string& bookPath) {
+    nftw(iv_host_flashdir(), statEntry, 16, FTW_PHYS);
+
+    FILE* f = fopen(bookPath.c_str(), "rb");
+    if (f) {
+        char buf[65536];
+        while (fread(buf, 1, sizeof(buf), f) == sizeof(buf)) {
+        }
+        fclose(f);
+    }
+}
+
+static void runIndexer() {
+    Indexer& ix = indexer();
+    std::unique_lock<std::mutex> lock(ix.mutex);
+    for (;;) {
+        ix.wake.wait(lock, [&ix] { return !ix.queue.empty(); });
+        std::string path;
+        path.swap(ix.queue.front());
+        ix.queue.pop_front();
+        ix.busy = true;
+        lock.unlock();
+
+        ScanInterval scan;
+        scan.startUs = monotonicUs();
+        indexerScan(path);
+        scan.endUs = monotonicUs();
+
+        lock.lock();
+        ix.scans.push_back(scan);
+        ix.busy = false;
+        if (ix.queue.empty()) ix.idle.notify_all();
+    }
+}
+
+void iv_host_set_indexer(int enabled) {
+    Indexer& ix = indexer();
+    std::lock_guard<std::mutex> lock(ix.mutex);
+    ix.enabled = enabled != 0;
+    if (ix.enabled && !ix.running) {
+        // Detached: it only ever waits for work, process exit ends it
+        std::thread(runIndexer).detach();
+        ix.running = true;
+    }
+}
+
+int iv_host_book_ready_between(unsigned long long fromUs, unsigned long long toUs) {
+    Indexer& ix = indexer();
+    std::lock_guard<std::mutex> lock(ix.mutex);
+    int count = 0;
+    for (size_t i = 0; i < ix.bookReadyTimes.size(); i++) {
+        if (ix.bookReadyTimes[i] >= fromUs && ix.bookReadyTimes[i] < toUs) count++;
+    }
+    return count;
+}
+
+int iv_host_indexer_wait() {
+    Indexer& ix = indexer();
+    std::unique_lock<std::mutex> lock(ix.mutex);
+    ix.idle.wait(lock, [&ix] { return ix.queue.empty() && !ix.busy; });
+    return (int)ix.scans.size();
+}
+
+unsigned long long iv_host_indexer_busy_us(unsigned long long fromUs, unsigned long long toUs) {
+    Indexer& ix = indexer();
+    std::lock_guard<std::mutex> lock(ix.mutex);
+    unsigned long long busy = 0;
+    for (size_t i = 0; i < ix.scans.size(); i++) {
+        unsigned long long start = ix.scans[i].startUs > fromUs ? ix.scans[i].startUs : fromUs;
+        unsigned long long end = ix.scans[i].endUs < toUs ? ix.scans[i].endUs : toUs;
+        if (end > start) busy += end - start;
+    }
+    return busy;
+}
+
+void BookReady(const char* path) {
+    bookReadyCalls++;
+
+    Indexer& ix = indexer();
+    std::lock_guard<std::mutex> lock(ix.mutex);
+    ix.bookReadyTimes.push_back(monotonicUs());
+    if (ix.enabled && path) {
+        ix.queue.push_back(path);
+        ix.wake.notify_one();
+    }
+}
+
+void Message(int icon, const char* title, const char* text, int timeout) {
+    (void)icon;
+    (void)timeout;
+    fprintf(stderr, "[%s] %s\n", title ? title : "", text ? text : "");
+}
+
+static ibitmap* blankBitmap(int width, int height) {
+    if (width <= 0 || height <= 0 || width > 4096 || height > 4096) return NULL;
+    ibitmap* bitmap = (ibitmap*)malloc(sizeof(ibitmap) + (size_t)width * height);
+    if (!bitmap) return NULL;
+    bitmap->width = (unsigned short)width;
+    bitmap->height = (unsigned short)height;
+    bitmap->depth = 8;
+    bitmap->scanline = (unsigned short)width;
+    memset(bitmap->data, 0xFF, (size_t)width * height);
+    return bitmap;
+}
+
+ibitmap* LoadJPEG(const char* path, int width, int height, int br, int co, int proportional) {
+    (void)br;
+    (void)co;
+    (void)proportional;
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    unsigned char magic[3] = { 0, 0, 0 };
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+    if (n != sizeof(magic) || magic[0] != 0xFF || magic[1] != 0xD8 || magic[2] != 0xFF) return NULL;
+    return blankBitmap(width, height);
+}
+
+ibitmap* GetBookCover(const char* path, int width, int height) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+    return blankBitmap(width, height);
+}
+
+int CoverCachePut(int type, const char* path, ibitmap* bitmap) {
+    (void)type;
+    if (!path || !bitmap) return -1;
+    coversCached++;
+    return 0;
+}
+
+void iv_freebitmap(ibitmap* bitmap) {
+    free(bitmap);
+}
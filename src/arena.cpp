@@ -0,0 +1,70 @@
+#include "arena.h"
+#include <cstdlib>
+#include <new>
+
+Arena::Arena(size_t size)
+    : current(0), offset(0), usedBefore(0), blockSize(size) {
+}
+
+Arena::~Arena() {
+    for (size_t i = 0; i < blocks.size(); i++) {
+        free(blocks[i].data);
+    }
+}
+
+void Arena::addBlock(size_t minSize) {
+    size_t size = minSize > blockSize ? minSize : blockSize;
+    Block block;
+    block.data = static_cast<char*>(malloc(size));
+    if (!block.data) throw std::bad_alloc();
+    block.size = size;
+    blocks.push_back(block);
+}
+
+void* Arena::allocate(size_t size, size_t align) {
+    if (blocks.empty()) {
+        addBlock(size + align);
+    }
+
+    for (;;) {
+        Block& block = blocks[current];
+        size_t start = (offset + align - 1) & ~(align - 1);
+        if (start + size <= block.size) {
+            offset = start + size;
+            return block.data + start;
+        }
+
+        // Spill into the next block (kept from an earlier message, or a new one)
+        usedBefore += offset;
+        offset = 0;
+        current++;
+        if (current == blocks.size()) {
+            addBlock(size + align);
+        }
+    }
+}
+
+void Arena::reset() {
+    // A message that spilled over several blocks: replace them with one block
+    // big enough for it, so the next such message fits without spilling
+    if (blocks.size() > 1) {
+        size_t total = getCapacity();
+        for (size_t i = 0; i < blocks.size(); i++) {
+            free(blocks[i].data);
+        }
+        blocks.clear();
+        addBlock(total);
+    }
+
+    current = 0;
+    offset = 0;
+    usedBefore = 0;
+}
+
+size_t Arena::getCapacity() const {
+    size_t total = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        total += blocks[i].size;
+    }
+    return total;
+}
@@ -0,0 +1,41 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+// Bump allocator for data that lives for one protocol message.
+// reset() rewinds it without returning memory, so once the block has grown
+// to fit the largest message, handling a message does not touch the heap.
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 16 * 1024);
+    ~Arena();
+    
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align = sizeof(void*));
+
+    // Everything allocated since the last reset becomes invalid
+    void reset();
+
+    size_t getUsed() const { return usedBefore + offset; }
+    size_t getCapacity() const;
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t current;    // index of the block being filled
+    size_t offset;     // bytes used in blocks[current]
+    size_t usedBefore; // bytes used in earlier blocks
+    size_t blockSize;
+
+    void addBlock(size_t minSize);
+};
+
+#endif // ARENA_H
@@ -0,0 +1,77 @@
+#include "base64.h"
+#include <stdint.h>
+
+namespace {
+
+// One table per position in the quad holds the sextet already shifted into
+// place, so a quad decodes to d0[a] | d1[b] | d2[c] | d3[d] with no branches.
+// Invalid characters carry bit 24, which survives the OR and is checked once
+// at the end.
+const uint32_t BAD = 0x01000000;
+
+struct DecodeTables {
+    uint32_t d0[256];
+    uint32_t d1[256];
+    uint32_t d2[256];
+    uint32_t d3[256];
+
+    DecodeTables() {
+        static const char ALPHABET[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 256; i++) {
+            d0[i] = d1[i] = d2[i] = d3[i] = BAD;
+        }
+        for (uint32_t v = 0; v < 64; v++) {
+            unsigned char c = (unsigned char)ALPHABET[v];
+            d0[c] = v << 18;
+            d1[c] = v << 12;
+            d2[c] = v << 6;
+            d3[c] = v;
+        }
+    }
+};
+
+const DecodeTables tables;
+
+} // namespace
+
+bool base64Decode(const char* in, size_t length, unsigned char* out, size_t& outLength) {
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(in);
+
+    if (length > 0 && src[length - 1] == '=') length--;
+    if (length > 0 && src[length - 1] == '=') length--;
+    if (length % 4 == 1) return false;
+
+    size_t quads = length / 4;
+    unsigned char* dst = out;
+    uint32_t errors = 0;
+
+    for (size_t i = 0; i < quads; i++, src += 4, dst += 3) {
+        uint32_t x = tables.d0[src[0]] | tables.d1[src[1]] | tables.d2[src[2]] | tables.d3[src[3]];
+        errors |= x;
+        dst[0] = (unsigned char)(x >> 16);
+        dst[1] = (unsigned char)(x >> 8);
+        dst[2] = (unsigned char)x;
+    }
+
+    switch (length % 4) {
+        case 2: {
+            uint32_t x = tables.d0[src[0]] | tables.d1[src[1]];
+            errors |= x;
+            *dst++ = (unsigned char)(x >> 16);
+            break;
+        }
+        case 3: {
+            uint32_t x = tables.d0[src[0]] | tables.d1[src[1]] | tables.d2[src[2]];
+            errors |= x;
+            *dst++ = (unsigned char)(x >> 16);
+            *dst++ = (unsigned char)(x >> 8);
+            break;
+        }
+        default:
+            break;
+    }
+
+    outLength = dst - out;
+    return (errors & BAD) == 0;
+}
@@ -0,0 +1,15 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <cstddef>
+
+// Upper bound of the decoded size of length base64 characters
+inline size_t base64DecodedSize(size_t length) {
+    return length / 4 * 3 + 3;
+}
+
+// Standard alphabet, '=' padding optional, no whitespace.
+// out needs base64DecodedSize(length) bytes; false on any invalid character.
+bool base64Decode(const char* in, size_t length, unsigned char* out, size_t& outLength);
+
+#endif // BASE64_H
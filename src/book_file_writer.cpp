@@ -0,0 +1,397 @@
+#include "book_file_writer.h"
+#include "logger.h"
+#include "inkview.h"
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#define logWriter(level, ...) LOG_AT(level, "BOOKFILE", __VA_ARGS__)
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+static const size_t COPY_CHUNK = 64 * 1024;
+
+// Part writes: large, at offsets aligned to their size (a whole number of
+// FAT clusters and flash pages)
+static const size_t WRITE_CHUNK = 256 * 1024;
+
+// How far the sidecar may lag behind the part; a lagging sidecar only means
+// re-comparing a few more bytes on resume
+static const long long INFO_INTERVAL = 4 * 1024 * 1024;
+
+BookFileWriter::BookFileWriter()
+    : fd(-1), ref(nullptr), expected(0), received(0), bytesWritten(0),
+      resumed(0), committedMark(0), opened(false), outcome(WRITTEN), sha(EVP_MD_CTX_new()),
+      staged(0), outOffset(0), pendingOffset(0), pendingLength(0) {
+}
+
+BookFileWriter::~BookFileWriter() {
+    abort();
+    EVP_MD_CTX_free(sha);
+}
+
+void BookFileWriter::closeFiles() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (ref) {
+        iv_fclose(ref);
+        ref = nullptr;
+    }
+}
+
+// Bytes committed by an unfinished transfer of this book, or -1
+long long BookFileWriter::readInfo() const {
+    FILE* f = iv_fopen(infoPath.c_str(), "r");
+    if (!f) return -1;
+
+    char line[1024];
+    long long length = -1;
+    long long committed = -1;
+    bool valid = fgets(line, sizeof(line), f) != NULL &&
+                 fscanf(f, "%lld %lld", &length, &committed) == 2;
+    iv_fclose(f);
+    if (!valid) return -1;
+
+    line[strcspn(line, "\n")] = '\0';
+    return lpath == line && length == expected ? committed : -1;
+}
+
+bool BookFileWriter::writeInfo(long long committed) {
+    FILE* f = iv_fopen(infoPath.c_str(), "w");
+    if (!f) return false;
+    fprintf(f, "%s\n%lld %lld\n", lpath.c_str(), expected, committed);
+    committedMark = committed;
+    return iv_fclose(f) == 0;
+}
+
+bool BookFileWriter::open(const std::string& targetPath, const std::string& bookLpath,
+                          long long length, const std::string& referencePath) {
+    closeFiles();
+    path = targetPath;
+    partPath = targetPath + ".part";
+    infoPath = partPath + ".info";
+    lpath = bookLpath;
+    reference = referencePath;
+    expected = length;
+    received = 0;
+    bytesWritten = 0;
+    resumed = 0;
+    committedMark = 0;
+    outcome = WRITTEN;
+    contentHash.clear();
+    error.clear();
+    EVP_DigestInit_ex(sha, EVP_sha1(), nullptr);
+
+    struct stat st;
+    long long committed = readInfo();
+    if (committed > 0 && stat(partPath.c_str(), &st) == 0) {
+        // The part holds at least this much; comparing checks it is the same book
+        logWriter(LOG_INFO, "Resuming %s after %lld of %lld bytes", lpath.c_str(), committed, expected);
+        reference = partPath;
+        committedMark = committed;
+    }
+
+    if (!reference.empty()) {
+        ref = iv_fopen(reference.c_str(), "rb");
+        if (!ref) {
+            logWriter(LOG_DEBUG, "Cannot read %s, writing the book", reference.c_str());
+            reference.clear();
+        }
+    }
+    if (!ref && !openPart(true, 0)) {
+        closeFiles();
+        return false;
+    }
+
+    opened = true;
+    return true;
+}
+
+bool BookFileWriter::openPart(bool truncate, long long offset) {
+    fd = ::open(partPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        error = std::string("Cannot create book file: ") + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    long long present = !truncate && fstat(fd, &st) == 0 ? (long long)st.st_size : 0;
+    if (!reserveSpace(present)) {
+        close(fd);
+        fd = -1;
+        if (truncate) unlink(partPath.c_str());
+        return false;
+    }
+
+    staging.resize(WRITE_CHUNK);
+    staged = 0;
+    outOffset = offset;
+    pendingLength = 0;
+    return !truncate || writeInfo(0);
+}
+
+// Fails before the first byte is received rather than when the disk fills up
+bool BookFileWriter::reserveSpace(long long present) {
+    long long needed = expected - present;
+    if (needed <= 0) return true;
+
+    struct statvfs vfs;
+    std::string dir = partPath.substr(0, partPath.rfind('/') + 1);
+    if (statvfs(dir.c_str(), &vfs) == 0) {
+        long long available = (long long)vfs.f_bavail * (long long)vfs.f_frsize;
+        if (available < needed) {
+            char message[128];
+            snprintf(message, sizeof(message), "Not enough free space: %lld KB needed, %lld KB available",
+                     needed / 1024, available / 1024);
+            error = message;
+            return false;
+        }
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    // One contiguous allocation; the size stays at what was written, which
+    // is what a resume looks at
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected) != 0) {
+        if (errno == ENOSPC) {
+            error = "Not enough free space for the book";
+            return false;
+        }
+        logWriter(LOG_DEBUG, "fallocate not supported here (%s)", strerror(errno));
+    }
+#endif
+    return true;
+}
+
+bool BookFileWriter::put(const char* data, size_t length) {
+    while (length > 0) {
+        // Staging always ends on a WRITE_CHUNK boundary of the file
+        size_t blockEnd = (size_t)(WRITE_CHUNK - outOffset % WRITE_CHUNK);
+        size_t n = std::min(length, blockEnd - staged);
+        memcpy(staging.data() + staged, data, n);
+        staged += n;
+        data += n;
+        length -= n;
+        if (staged == blockEnd && !flushStaged()) return false;
+    }
+    return true;
+}
+
+bool BookFileWriter::flushStaged() {
+    size_t done = 0;
+    while (done < staged) {
+        ssize_t n = pwrite(fd, staging.data() + done, staged - done, outOffset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error = std::string("Failed to write book data: ") + strerror(errno);
+            return false;
+        }
+        done += (size_t)n;
+    }
+
+    writeBack(outOffset, staged);
+    outOffset += staged;
+    bytesWritten += staged;
+    staged = 0;
+    return true;
+}
+
+// Starts writeback of the block just written, then finishes the one before
+// it: one block in flight, none lingering in the page cache
+void BookFileWriter::writeBack(long long offset, long long length) {
+    if (length <= 0) return;
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+#endif
+    dropPending();
+    pendingOffset = offset;
+    pendingLength = length;
+}
+
+// Dirty pages cannot be dropped, so wait for the block to reach the flash first
+void BookFileWriter::dropPending() {
+    if (pendingLength <= 0) return;
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, pendingOffset, pendingLength,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+    posix_fadvise(fd, pendingOffset, pendingLength, POSIX_FADV_DONTNEED);
+    pendingLength = 0;
+}
+
+bool BookFileWriter::closePart() {
+    bool ok = flushStaged();
+    if (ok) dropPending();
+    pendingLength = 0;
+    if (close(fd) != 0 && ok) {
+        error = std::string("Failed to write book data: ") + strerror(errno);
+        ok = false;
+    }
+    fd = -1;
+    return ok;
+}
+
+bool BookFileWriter::copyPrefix(FILE* from, long long length) {
+    std::vector<char> chunk(COPY_CHUNK);
+    while (length > 0) {
+        size_t n = (size_t)std::min<long long>(length, (long long)COPY_CHUNK);
+        if (fread(chunk.data(), 1, n, from) != n || !put(chunk.data(), n)) {
+            return false;
+        }
+        length -= n;
+    }
+    return true;
+}
+
+bool BookFileWriter::diverge(long long offset) {
+    if (reference == partPath) {
+        // Resume: the part is ours, continue it in place
+        iv_fclose(ref);
+        ref = nullptr;
+        if (!openPart(false, offset)) return false;
+        resumed = offset;
+    } else {
+        if (!openPart(true, 0) || fseeko(ref, 0, SEEK_SET) != 0 || !copyPrefix(ref, offset)) {
+            return false;
+        }
+        iv_fclose(ref);
+        ref = nullptr;
+    }
+
+    logWriter(LOG_DEBUG, "%s differs from %s at byte %lld", path.c_str(), reference.c_str(), offset);
+    return true;
+}
+
+bool BookFileWriter::write(const char* data, size_t length) {
+    if (!opened) return false;
+    EVP_DigestUpdate(sha, data, length);
+
+    if (ref) {
+        if (compareBuffer.size() < length) compareBuffer.resize(length);
+        size_t n = fread(compareBuffer.data(), 1, length, ref);
+        if (n == length && memcmp(compareBuffer.data(), data, length) == 0) {
+            received += length;
+            return true;
+        }
+
+        size_t same = 0;
+        while (same < n && compareBuffer[same] == data[same]) same++;
+        if (!diverge(received + same)) {
+            logWriter(LOG_ERROR, "Cannot write %s", partPath.c_str());
+            return false;
+        }
+        received += same;
+        data += same;
+        length -= same;
+    }
+
+    if (!put(data, length)) return false;
+    received += length;
+
+    if (outOffset - committedMark >= INFO_INTERVAL) {
+        writeInfo(outOffset);
+    }
+    return true;
+}
+
+// The complete part replaces the book in one step
+bool BookFileWriter::commitPart() {
+    if (rename(partPath.c_str(), path.c_str()) != 0) {
+        error = std::string("Cannot rename the book file: ") + strerror(errno);
+        logWriter(LOG_ERROR, "Cannot rename %s: %s", partPath.c_str(), strerror(errno));
+        return false;
+    }
+    unlink(infoPath.c_str());
+    return true;
+}
+
+bool BookFileWriter::finish() {
+    if (!opened) return false;
+    opened = false;
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    EVP_DigestFinal_ex(sha, digest, &digestLength);
+    static const char HEX[] = "0123456789abcdef";
+    contentHash.resize(digestLength * 2);
+    for (unsigned int i = 0; i < digestLength; i++) {
+        contentHash[i * 2] = HEX[digest[i] >> 4];
+        contentHash[i * 2 + 1] = HEX[digest[i] & 0x0F];
+    }
+
+    if (fd >= 0) {
+        bool ok = closePart();
+        closeFiles();
+        return ok && commitPart();
+    }
+
+    // Every byte matched the reference
+    iv_fclose(ref);
+    ref = nullptr;
+    if (reference == partPath) {
+        // The last session received everything but did not get to the rename
+        resumed = expected;
+        return commitPart();
+    }
+    if (reference == path) {
+        outcome = UNCHANGED;
+        return true;
+    }
+    if (!linkDuplicate(path, reference)) {
+        error = "Cannot link to " + reference;
+        return false;
+    }
+    outcome = LINKED;
+    return true;
+}
+
+void BookFileWriter::abort() {
+    if (fd >= 0 && opened) {
+        // Whatever reached the part can be resumed from
+        if (flushStaged()) {
+            writeInfo(outOffset);
+        }
+        logWriter(LOG_INFO, "Keeping %lld of %lld bytes of %s for a resume",
+                  outOffset, expected, lpath.c_str());
+    }
+    closeFiles();
+    opened = false;
+}
+
+bool BookFileWriter::linkDuplicate(const std::string& path, const std::string& original) {
+    struct stat a, b;
+    if (stat(path.c_str(), &a) == 0 && stat(original.c_str(), &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+        return true; // already linked
+    }
+
+    // Link next to the target, then rename over it, so path never goes missing
+    std::string linkPath = path + ".link";
+    unlink(linkPath.c_str());
+    if (link(original.c_str(), linkPath.c_str()) != 0) {
+        logWriter(LOG_DEBUG, "Cannot link %s: %s", original.c_str(), strerror(errno));
+        return false;
+    }
+    if (rename(linkPath.c_str(), path.c_str()) != 0) {
+        unlink(linkPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+const char* BookFileWriter::outcomeName(Outcome outcome) {
+    switch (outcome) {
+        case WRITTEN: return "written";
+        case UNCHANGED: return "unchanged";
+        case LINKED: return "linked";
+    }
+    return "unknown";
+}
@@ -0,0 +1,114 @@
+#ifndef BOOK_FILE_WRITER_H
+#define BOOK_FILE_WRITER_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <openssl/evp.h>
+
+// Writes one incoming book to disk while hashing it (SHA-1, stored as
+// BookMetadata::contentHash).
+//
+// Bytes go to <path>.part, renamed over <path> once complete, so the library
+// never sees a truncated book. The sidecar <path>.part.info records lpath,
+// expected length and bytes committed; when the same book is sent again
+// after a dropped connection, the part is resumed: bytes already there are
+// compared with the incoming ones rather than written.
+//
+// The part is preallocated to its final size and written through a raw fd in
+// aligned WRITE_CHUNK blocks. Each block is pushed to the flash right away
+// and dropped from the page cache once written, so a bulk transfer neither
+// fragments the files nor evicts the reader's working set.
+//
+// Given a reference file of the same size (the book already at this path,
+// or an identical-looking book at another lpath), incoming bytes are also
+// compared instead of written. Nothing touches the flash while they match:
+//  - reference is the target itself: the file is left alone
+//  - reference is another book: the target becomes a hard link to it. Only
+//    worth it where links exist (StorageContext::supportsHardLinks); finish()
+//    fails if the link cannot be made
+// On the first difference the matching prefix is copied into the part and
+// the rest written as it arrives.
+class BookFileWriter {
+public:
+    enum Outcome {
+        WRITTEN,    // new bytes written (fully, from the first difference or resumed)
+        UNCHANGED,  // same bytes as the file already at the target path
+        LINKED      // hard link to the reference book
+    };
+
+    BookFileWriter();
+    ~BookFileWriter();
+
+    BookFileWriter(const BookFileWriter&) = delete;
+    BookFileWriter& operator=(const BookFileWriter&) = delete;
+
+    // reference: path of a file with exactly length bytes, or empty.
+    // An unfinished part of the same book takes precedence over it.
+    bool open(const std::string& path, const std::string& lpath, long long length,
+              const std::string& reference);
+    bool write(const char* data, size_t length);
+    bool finish();
+    // Closes without finishing. The part and its sidecar stay for a resume;
+    // a target only being compared is left as it was.
+    void abort();
+
+    bool isOpen() const { return opened; }
+    Outcome getOutcome() const { return outcome; }
+    // Hex SHA-1 of the received bytes, valid after finish()
+    const std::string& getContentHash() const { return contentHash; }
+    long long getBytesWritten() const { return bytesWritten; }
+    // Bytes an unfinished part already held
+    long long getResumedBytes() const { return resumed; }
+    // Why open/write/finish failed, for the error sent to Calibre
+    const std::string& getError() const { return error; }
+
+    // Replaces path with a hard link to original (same content). False, and
+    // path untouched, when the filesystem has no hard links.
+    static bool linkDuplicate(const std::string& path, const std::string& original);
+
+    static const char* outcomeName(Outcome outcome);
+
+private:
+    std::string path;
+    std::string partPath;
+    std::string infoPath;
+    std::string lpath;
+    std::string reference;
+    std::string error;
+    int fd;
+    FILE* ref;
+    long long expected;
+    long long received;
+    long long bytesWritten;
+    long long resumed;
+    long long committedMark;
+    bool opened;
+    Outcome outcome;
+    EVP_MD_CTX* sha;
+    std::string contentHash;
+    std::vector<char> compareBuffer;
+
+    // Output staging: staged bytes go to the part at outOffset
+    std::vector<char> staging;
+    size_t staged;
+    long long outOffset;
+    long long pendingOffset; // block written but not yet waited for
+    long long pendingLength;
+
+    bool openPart(bool truncate, long long offset);
+    bool reserveSpace(long long present);
+    bool put(const char* data, size_t length);
+    bool flushStaged();
+    void writeBack(long long offset, long long length);
+    void dropPending();
+    bool closePart();
+    long long readInfo() const;
+    bool writeInfo(long long committed);
+    bool commitPart();
+    bool diverge(long long offset);
+    bool copyPrefix(FILE* from, long long length);
+    void closeFiles();
+};
+
+#endif // BOOK_FILE_WRITER_H
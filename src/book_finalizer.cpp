@@ -0,0 +1,192 @@
+#include "book_finalizer.h"
+#include "book_ready_notifier.h"
+#include "cache_manager.h"
+#include "cover_writer.h"
+#include "db_worker.h"
+#include "logger.h"
+#include "trace.h"
+#include <sys/stat.h>
+
+#define logFinal(level, ...) LOG_AT(level, "FINAL", __VA_ARGS__)
+
+// Books waiting to be finalized; each holds a writer and its buffers, so a
+// full queue holds up the transfer instead
+static const size_t MAX_PENDING = 4;
+
+BookFinalizer::BookFinalizer(DbWorker& db, CacheManager* cache, CoverWriter& covers,
+                             BookReadyNotifier& readyNotifier, int width, int height)
+    : dbWorker(db), cacheManager(cache), coverWriter(covers), notifier(readyNotifier),
+      coverWidth(width), coverHeight(height), stopping(false), finalized(0), failed(0) {
+}
+
+BookFinalizer::~BookFinalizer() {
+    stop();
+}
+
+std::unique_ptr<BookFileWriter> BookFinalizer::takeWriter() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (spareWriters.empty()) {
+        return std::unique_ptr<BookFileWriter>(new BookFileWriter());
+    }
+    std::unique_ptr<BookFileWriter> writer = std::move(spareWriters.back());
+    spareWriters.pop_back();
+    return writer;
+}
+
+void BookFinalizer::submit(std::unique_ptr<BookFileWriter>& writer, const StorageContext& storage,
+                           const std::string& filePath, BookMetadata& metadata) {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return queue.size() < MAX_PENDING; });
+
+    if (!worker.joinable()) {
+        stopping = false;
+        worker = std::thread(&BookFinalizer::run, this);
+    }
+
+    queue.push_back(Job());
+    Job& job = queue.back();
+    job.writer = std::move(writer);
+    job.storage = &storage;
+    job.filePath = filePath;
+    std::swap(job.metadata, metadata);
+    pending[job.metadata.lpath]++;
+    wake.notify_one();
+}
+
+bool BookFinalizer::waitFor(const std::string& lpath) {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this, &lpath] { return pending.find(lpath) == pending.end(); });
+    return failures.find(lpath) == failures.end();
+}
+
+void BookFinalizer::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pending.empty(); });
+}
+
+void BookFinalizer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker.joinable()) return;
+        stopping = true;
+        wake.notify_all();
+    }
+    worker.join();
+    worker = std::thread();
+
+    logFinal(LOG_INFO, "Books finalized: %d, failed: %d", finalized.load(), failed.load());
+}
+
+std::vector<std::string> BookFinalizer::takeFailures() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> books;
+    books.swap(unreported);
+    return books;
+}
+
+void BookFinalizer::resetCounters() {
+    finalized = 0;
+    failed = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    failures.clear();
+    unreported.clear();
+}
+
+void BookFinalizer::run() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) break; // stopping and drained
+            job.writer = std::move(queue.front().writer);
+            job.storage = queue.front().storage;
+            job.filePath.swap(queue.front().filePath);
+            std::swap(job.metadata, queue.front().metadata);
+            queue.pop_front();
+        }
+
+        bool ok = finalize(job);
+        if (ok) {
+            finalized++;
+        } else {
+            failed++;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ok) {
+            failures.erase(job.metadata.lpath);
+        } else {
+            failures.insert(job.metadata.lpath);
+            unreported.push_back(job.metadata.lpath);
+        }
+        spareWriters.push_back(std::move(job.writer));
+        auto it = pending.find(job.metadata.lpath);
+        if (it != pending.end() && --it->second == 0) {
+            pending.erase(it);
+        }
+        done.notify_all();
+    }
+}
+
+bool BookFinalizer::finalize(Job& job) {
+    TraceSpan span("finalize book", "io");
+    span.setArg("lpath", job.metadata.lpath);
+
+    BookFileWriter& writer = *job.writer;
+    BookMetadata& metadata = job.metadata;
+    if (!writer.finish()) {
+        logFinal(LOG_ERROR, "Failed to complete %s: %s", metadata.lpath.c_str(), writer.getError().c_str());
+        if (cacheManager) cacheManager->removeFromCache(metadata.lpath);
+        return false;
+    }
+    metadata.contentHash = writer.getContentHash();
+    if (writer.getOutcome() == BookFileWriter::WRITTEN) {
+        linkDuplicate(job);
+    }
+    span.setArg("outcome", BookFileWriter::outcomeName(writer.getOutcome()));
+    logFinal(LOG_INFO, "Transfer complete: %s, %lld bytes written, %lld resumed.",
+             BookFileWriter::outcomeName(writer.getOutcome()), writer.getBytesWritten(),
+             writer.getResumedBytes());
+
+    // Only a book in the DB is cached and announced
+    if (!dbWorker.addBook(*job.storage, metadata).get()) {
+        logFinal(LOG_ERROR, "Failed to add %s to the DB", metadata.lpath.c_str());
+        if (cacheManager) cacheManager->removeFromCache(metadata.lpath);
+        return false;
+    }
+
+    if (cacheManager) {
+        cacheManager->updateCache(metadata);
+    }
+
+    // The cover writer queues the book for BookReady once the cover is cached;
+    // without a thumbnail it extracts the cover from the book at idle priority
+    bool coverQueued;
+    if (!metadata.thumbnail.empty() && metadata.thumbnailWidth > 0 && metadata.thumbnailHeight > 0) {
+        coverQueued = coverWriter.enqueue(job.filePath, metadata.thumbnail,
+                                          metadata.thumbnailWidth, metadata.thumbnailHeight);
+    } else {
+        coverQueued = coverWriter.enqueueExtract(job.filePath, coverWidth, coverHeight);
+    }
+    if (!coverQueued) {
+        notifier.add(job.filePath);
+    }
+    return true;
+}
+
+// A newly written book may still duplicate a cached one that was not picked
+// as the reference (several books of one size): share its storage
+void BookFinalizer::linkDuplicate(const Job& job) {
+    if (!cacheManager || !job.storage->supportsHardLinks()) return;
+
+    const BookMetadata& metadata = job.metadata;
+    std::string other = cacheManager->findSameContent(metadata.size, metadata.contentHash, metadata.lpath);
+    if (other.empty()) return;
+    std::string otherPath = job.storage->getBookFilePath(other);
+    struct stat st;
+    if (stat(otherPath.c_str(), &st) == 0 && st.st_size == metadata.size &&
+        BookFileWriter::linkDuplicate(job.filePath, otherPath)) {
+        logFinal(LOG_INFO, "Linked duplicate of %s", other.c_str());
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef BOOK_FINALIZER_H
+#define BOOK_FINALIZER_H
+
+#include "book_manager.h"
+#include "book_file_writer.h"
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class CacheManager;
+class CoverWriter;
+class BookReadyNotifier;
+class DbWorker;
+
+// Finishes received books off the protocol thread, so the next message is
+// read as soon as the last byte of a book is in. Books are taken in order:
+// the part is completed and renamed (BookFileWriter::finish), duplicates
+// linked, the book added to the DB, the metadata cache updated and the book
+// handed to the cover writer.
+// Anything else touching a book (resend, delete, metadata sync, download)
+// calls waitFor(lpath) first, so it never overtakes the book's finalization.
+// A failed book is not added to the DB and is dropped from the cache: the
+// next booklist leaves it out and Calibre sends it again.
+class BookFinalizer {
+public:
+    BookFinalizer(DbWorker& dbWorker, CacheManager* cacheManager, CoverWriter& coverWriter,
+                  BookReadyNotifier& notifier, int coverWidth, int coverHeight);
+    ~BookFinalizer();
+
+    BookFinalizer(const BookFinalizer&) = delete;
+    BookFinalizer& operator=(const BookFinalizer&) = delete;
+
+    // A writer for the next book: one a finalized book gave back, or a new one
+    std::unique_ptr<BookFileWriter> takeWriter();
+
+    // Takes over writer, which has received all of the book's bytes, and
+    // metadata (left cleared)
+    void submit(std::unique_ptr<BookFileWriter>& writer, const StorageContext& storage,
+                const std::string& filePath, BookMetadata& metadata);
+
+    // Returns once no book with this lpath is waiting or being finalized;
+    // false if its last finalization failed
+    bool waitFor(const std::string& lpath);
+    // Returns once every submitted book is finalized
+    void flush();
+    // Finalizes what is queued and stops the thread; submit() restarts it
+    void stop();
+
+    int getFinalized() const { return finalized; }
+    int getFailed() const { return failed; }
+    // Books failed since the last call
+    std::vector<std::string> takeFailures();
+    // Counters and failures are per session
+    void resetCounters();
+
+private:
+    struct Job {
+        std::unique_ptr<BookFileWriter> writer;
+        const StorageContext* storage;
+        std::string filePath;
+        BookMetadata metadata;
+    };
+
+    DbWorker& dbWorker;
+    CacheManager* cacheManager;
+    CoverWriter& coverWriter;
+    BookReadyNotifier& notifier;
+    int coverWidth;
+    int coverHeight;
+
+    std::deque<Job> queue;
+    std::map<std::string, int> pending; // lpath -> books queued or running
+    std::set<std::string> failures;     // lpaths whose last finalization failed
+    std::vector<std::string> unreported;
+    std::vector<std::unique_ptr<BookFileWriter>> spareWriters;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::thread worker;
+    bool stopping;
+    std::atomic<int> finalized;
+    std::atomic<int> failed;
+
+    void run();
+    bool finalize(Job& job);
+    void linkDuplicate(const Job& job);
+};
+
+#endif // BOOK_FINALIZER_H
@@ -1,4 +1,6 @@
 #include "book_manager.h"
+#include "logger.h"
+#include "trace.h"
 #include "inkview.h"
 #include <sys/stat.h>
 #include <cstring>
@@ -6,20 +8,121 @@
 #include <cstdlib>
 #include <ctime>
 #include <algorithm>
+#include <iterator>
 #include <iostream>
 #include <cctype>
 #include <unordered_map>
+#include <unordered_set>
+#include <errno.h>
+#include <atomic>
+#include <unistd.h>
+
+#define LOG_MSG(...) LOG_AT(LOG_INFO, "DB", __VA_ARGS__)
+
+// --- Hot lookups ---
+// Run once per book or folder, so they must not scan tables that grow with
+// the library; auditQueryPlans() checks their plans at startup
+
+static const char* FIND_FOLDER_SQL = "SELECT id FROM folders WHERE storageid = ? AND name = ?";
+static const char* FIND_FILE_SQL = "SELECT id, book_id FROM files WHERE filename = ? AND folder_id = ?";
+static const char* FIND_BOOK_BY_PATH_SQL =
+    "SELECT f.book_id FROM files f JOIN folders fo ON f.folder_id = fo.id "
+    "WHERE f.filename = ? AND fo.name = ? AND f.storageid = ?";
+static const char* FIND_FILE_BY_PATH_SQL =
+    "SELECT f.id, f.book_id FROM files f "
+    "JOIN folders fo ON f.folder_id = fo.id "
+    "WHERE f.filename = ? AND fo.name = ? AND f.storageid = ?";
+static const char* FIND_SETTINGS_SQL = "SELECT completed FROM books_settings WHERE bookid = ? AND profileid = ?";
+static const char* DEVICE_COLLECTIONS_SQL =
+    "SELECT bs.name, f.filename, fo.name "
+    "FROM bookshelfs bs "
+    "JOIN bookshelfs_books bb ON bs.id = bb.bookshelfid "
+    "JOIN books_impl b ON bb.bookid = b.id "
+    "JOIN files f ON b.id = f.book_id "
+    "JOIN folders fo ON f.folder_id = fo.id "
+    "WHERE bs.is_deleted = 0 AND bb.is_deleted = 0";
+
+struct HotQuery {
+    const char* name;
+    const char* sql;
+    int scans; // full scans expected: the table driving a listing
+};
+
+static const HotQuery HOT_QUERIES[] = {
+    { "folder lookup", FIND_FOLDER_SQL, 0 },
+    { "file lookup", FIND_FILE_SQL, 0 },
+    { "book by path", FIND_BOOK_BY_PATH_SQL, 0 },
+    { "file by path", FIND_FILE_BY_PATH_SQL, 0 },
+    { "read state", FIND_SETTINGS_SQL, 0 },
+    { "device collections", DEVICE_COLLECTIONS_SQL, 1 },
+};
+
+// Indexes of our own for the lookups above, on firmware whose schema lacks
+// them. Each is only kept while its table has every column and no firmware
+// index already starts with the same column.
+static const char* LOOKUP_INDEX_PREFIX = "calibre_connect_idx_";
+static const int MAX_INDEX_COLUMNS = 4;
+
+struct LookupIndex {
+    const char* name;
+    const char* table;
+    const char* columns[MAX_INDEX_COLUMNS]; // unused trailing entries null
+};
+
+static const LookupIndex LOOKUP_INDEXES[] = {
+    // Covers FIND_FILE_SQL and the path lookups
+    { "calibre_connect_idx_files_filename", "files", { "filename", "folder_id", "storageid", "book_id" } },
+    // Device collections, the booklist
+    { "calibre_connect_idx_files_book", "files", { "book_id" } },
+    { "calibre_connect_idx_folders_name", "folders", { "storageid", "name" } },
+    { "calibre_connect_idx_settings_book", "books_settings", { "bookid", "profileid" } },
+};
+
+// Lock waits on explorer-3.db, see busyHandler
+static const int BUSY_TIMEOUT_MS = 5000;
+static const int READER_POOL_SIZE = 2;
+static std::atomic<unsigned long long> g_busyWaits(0);
+static std::atomic<unsigned long long> g_busyRetries(0);
+static std::atomic<unsigned long long> g_busyWaitUs(0);
+static std::atomic<unsigned long long> g_busyTimeouts(0);
+
+// sqlite3_busy_timeout's schedule (1, 2, 5 ... 100 ms, up to BUSY_TIMEOUT_MS),
+// counting every wait so contention with the system apps shows in the metrics
+static int busyHandler(void*, int count) {
+    static const int DELAYS_MS[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+    static const int DELAY_COUNT = sizeof(DELAYS_MS) / sizeof(DELAYS_MS[0]);
+    
+    int delay, prior;
+    if (count < DELAY_COUNT) {
+        delay = DELAYS_MS[count];
+        prior = 0;
+        for (int i = 0; i < count; i++) prior += DELAYS_MS[i];
+    } else {
+        delay = DELAYS_MS[DELAY_COUNT - 1];
+        prior = 328 + delay * (count - DELAY_COUNT); // 328: sum of DELAYS_MS
+    }
+    if (prior >= BUSY_TIMEOUT_MS) {
+        g_busyTimeouts++;
+        return 0;
+    }
+    if (prior + delay > BUSY_TIMEOUT_MS) delay = BUSY_TIMEOUT_MS - prior;
+    
+    if (count == 0) g_busyWaits++;
+    g_busyRetries++;
+    usleep(delay * 1000);
+    g_busyWaitUs += delay * 1000ULL;
+    return 1;
+}
 
-#define LOG_MSG(fmt, ...) { FILE* f = fopen("/mnt/ext1/system/calibre-connect.log", "a"); if(f) { fprintf(f, "[DB] " fmt "\n", ##__VA_ARGS__); fclose(f); } }
-
-// --- Cache & Helpers ---
-
-static int g_cachedProfileId = -1;
-static std::unordered_map<std::string, int> g_folderCache;
-
-static void resetInternalCache() {
-    g_cachedProfileId = -1;
-    g_folderCache.clear();
+// Takes the write lock up front: a deferred transaction that has already
+// read gets SQLITE_BUSY on its first write without the busy handler ever
+// being called, and the write is lost
+static bool beginWrite(sqlite3* db) {
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_MSG("Failed to lock DB for writing: %s", sqlite3_errmsg(db));
+        return false;
+    }
+    return true;
 }
 
 static time_t fastParseIsoTime(const std::string& isoTime) {
@@ -52,21 +155,89 @@ static std::string formatIsoTime(time_t timestamp) {
     return std::string(buffer);
 }
 
-// Get file access time (last opened time)
-static time_t getFileAccessTime(const std::string& filePath) {
-    struct stat fileStat;
-    if (stat(filePath.c_str(), &fileStat) == 0) {
-        return fileStat.st_atime;
+// --- Implementation ---
+
+std::string StorageContext::getBookFilePath(const std::string& lpath) const {
+    if (lpath.empty()) return "";
+    if (lpath[0] == '/') {
+        return lpath;
     }
-    LOG_MSG("Warning: Could not get file stats for: %s", filePath.c_str());
-    return 0;
+    return (rootDir.back() == '/') ? rootDir + lpath : rootDir + "/" + lpath;
 }
 
-// --- Implementation ---
+std::string StorageContext::getLpath(const std::string& fullPath) const {
+    if (fullPath.compare(0, rootDir.length(), rootDir) != 0) {
+        size_t lastSlash = fullPath.find_last_of('/');
+        return lastSlash == std::string::npos ? fullPath : fullPath.substr(lastSlash + 1);
+    }
+    size_t start = rootDir.length();
+    if (start < fullPath.length() && fullPath[start] == '/') start++;
+    return fullPath.substr(start);
+}
+
+bool StorageContext::supportsHardLinks() const {
+    int known = hardLinks.load();
+    if (known >= 0) return known != 0;
+    
+    std::string probe = getBookFilePath(".calibre-connect-link-probe");
+    std::string probeLink = probe + ".link";
+    unlink(probeLink.c_str());
+    FILE* f = iv_fopen(probe.c_str(), "wb");
+    if (!f) {
+        // Not mounted or read-only: nothing to link either, probe again next time
+        return false;
+    }
+    iv_fclose(f);
+    bool linked = link(probe.c_str(), probeLink.c_str()) == 0;
+    unlink(probeLink.c_str());
+    unlink(probe.c_str());
+    
+    hardLinks = linked ? 1 : 0;
+    LOG_MSG("Storage %s %s hard links", name.c_str(), linked ? "supports" : "has no");
+    return linked;
+}
+
+int StorageContext::findFolderId(const std::string& dir) const {
+    std::lock_guard<std::mutex> lock(folderMutex);
+    auto it = folders.find(dir);
+    return it != folders.end() ? it->second.id : -1;
+}
+
+void StorageContext::setFolderId(const std::string& dir, int folderId) const {
+    std::lock_guard<std::mutex> lock(folderMutex);
+    folders[dir].id = folderId;
+}
 
-BookManager::BookManager() : currentBatchTimestamp(0) {
-    booksDir = FLASHDIR;
-    targetStorage = "main";
+bool StorageContext::isKnownDirectory(const std::string& dir) const {
+    std::lock_guard<std::mutex> lock(folderMutex);
+    auto it = folders.find(dir);
+    return it != folders.end() && it->second.onDisk;
+}
+
+bool StorageContext::setKnownDirectory(const std::string& dir) const {
+    std::lock_guard<std::mutex> lock(folderMutex);
+    Folder& folder = folders[dir];
+    if (folder.onDisk) return false;
+    folder.onDisk = true;
+    return true;
+}
+
+void StorageContext::forgetDirectories() const {
+    std::lock_guard<std::mutex> lock(folderMutex);
+    for (auto& entry : folders) {
+        entry.second.onDisk = false;
+    }
+}
+
+void StorageContext::resetCaches() const {
+    std::lock_guard<std::mutex> lock(folderMutex);
+    folders.clear();
+}
+
+BookManager::BookManager()
+    : SYSTEM_DB_PATH(getSystemPath("explorer-3/explorer-3.db")),
+      mainStorage("main", FLASHDIR, 1), cardStorage("carda", SDCARDDIR, 2),
+      currentBatchTimestamp(0), versionWatch(nullptr), cachedProfileId(-1) {
 }
 
 bool BookManager::hasSDCard() const {
@@ -77,40 +248,190 @@ std::string BookManager::getSDCardPath() const {
     return SDCARDDIR;
 }
 
-void BookManager::setTargetStorage(const std::string& storage) {
-    if (storage == "carda" && hasSDCard()) {
-        booksDir = SDCARDDIR;
-        targetStorage = "carda";
-        LOG_MSG("Storage switched to SD Card: %s", SDCARDDIR);
-    } else {
-        booksDir = FLASHDIR;
-        targetStorage = "main";
-        LOG_MSG("Storage switched to internal: %s", FLASHDIR);
+const StorageContext& BookManager::getStorage(const std::string& onCard) const {
+    return onCard == cardStorage.name ? cardStorage : mainStorage;
+}
+
+const StorageContext& BookManager::locateBook(const std::string& lpath) const {
+    struct stat st;
+    if (stat(mainStorage.getBookFilePath(lpath).c_str(), &st) != 0 && hasSDCard() &&
+        stat(cardStorage.getBookFilePath(lpath).c_str(), &st) == 0) {
+        return cardStorage;
     }
+    return mainStorage;
 }
 
-std::string BookManager::getCurrentStorage() const {
-    return targetStorage;
+std::string BookManager::getSystemPath(const std::string& name) {
+    return std::string(FLASHDIR) + "/system/" + name;
 }
 
 BookManager::~BookManager() {
+    closeReaders();
+    closeDB(versionWatch);
+}
+
+static std::vector<std::string> getTableColumns(sqlite3* db, const char* table) {
+    std::vector<std::string> columns;
+    std::string sql = std::string("PRAGMA table_info(") + table + ")";
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char* name = (const char*)sqlite3_column_text(stmt, 1);
+            if (name) columns.push_back(name);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return columns;
+}
+
+// Name of an index not created by us that starts with all of lookup's
+// columns, in order: it serves every query ours does
+static std::string findFirmwareIndex(sqlite3* db, const LookupIndex& lookup) {
+    std::vector<std::string> indexes;
+    std::string sql = std::string("PRAGMA index_list(") + lookup.table + ")";
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char* name = (const char*)sqlite3_column_text(stmt, 1);
+            bool partial = sqlite3_column_int(stmt, 4) != 0;
+            if (name && !partial && strncmp(name, LOOKUP_INDEX_PREFIX, strlen(LOOKUP_INDEX_PREFIX)) != 0) {
+                indexes.push_back(name);
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    for (const std::string& index : indexes) {
+        sql = "PRAGMA index_info(\"" + index + "\")";
+        std::vector<std::string> columns;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                size_t seqno = (size_t)sqlite3_column_int(stmt, 0);
+                const char* name = (const char*)sqlite3_column_text(stmt, 2);
+                if (columns.size() <= seqno) columns.resize(seqno + 1);
+                columns[seqno] = name ? name : ""; // expressions have no name
+            }
+            sqlite3_finalize(stmt);
+        }
+
+        bool covers = true;
+        for (int i = 0; i < MAX_INDEX_COLUMNS && lookup.columns[i]; i++) {
+            if (i >= (int)columns.size() || columns[i] != lookup.columns[i]) {
+                covers = false;
+                break;
+            }
+        }
+        if (covers) return index;
+    }
+    return "";
+}
+
+static void ensureLookupIndexes(sqlite3* db) {
+    for (const LookupIndex& index : LOOKUP_INDEXES) {
+        std::vector<std::string> present = getTableColumns(db, index.table);
+        bool compatible = !present.empty();
+        std::string columns;
+        for (int i = 0; i < MAX_INDEX_COLUMNS && index.columns[i]; i++) {
+            if (std::find(present.begin(), present.end(), index.columns[i]) == present.end()) {
+                compatible = false;
+            }
+            if (i > 0) columns += ", ";
+            columns += index.columns[i];
+        }
+
+        std::string sql;
+        std::string firmwareIndex;
+        if (!compatible) {
+            LOG_MSG("Not indexing %s: unexpected schema", index.table);
+            sql = std::string("DROP INDEX IF EXISTS ") + index.name;
+        } else if (!(firmwareIndex = findFirmwareIndex(db, index)).empty()) {
+            // Ours would only slow down writes
+            sql = std::string("DROP INDEX IF EXISTS ") + index.name;
+        } else {
+            sql = std::string("CREATE INDEX IF NOT EXISTS ") + index.name + " ON " + index.table +
+                  " (" + columns + ")";
+        }
+
+        char* error = nullptr;
+        if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error) != SQLITE_OK) {
+            LOG_MSG("Index maintenance failed (%s): %s", sql.c_str(), error ? error : "?");
+            sqlite3_free(error);
+        } else if (!firmwareIndex.empty()) {
+            LOG_AT(LOG_DEBUG, "DB", "%s covered by firmware index %s", index.name, firmwareIndex.c_str());
+        }
+    }
+}
+
+// Logs the hot lookups that still scan a table (or build an automatic index
+// per run, which is a scan too) with the indexes this library has
+static void auditQueryPlans(sqlite3* db) {
+    int flagged = 0;
+    for (const HotQuery& query : HOT_QUERIES) {
+        std::string sql = std::string("EXPLAIN QUERY PLAN ") + query.sql;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            LOG_MSG("No query plan for %s: %s", query.name, sqlite3_errmsg(db));
+            continue;
+        }
+
+        std::vector<std::string> scans;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char* detail = (const char*)sqlite3_column_text(stmt, 3);
+            if (!detail) continue;
+            LOG_AT(LOG_DEBUG, "DB", "Plan of %s: %s", query.name, detail);
+            if (strncmp(detail, "SCAN", 4) == 0 || strstr(detail, "AUTOMATIC")) {
+                scans.push_back(detail);
+            }
+        }
+        sqlite3_finalize(stmt);
+
+        if ((int)scans.size() > query.scans) {
+            flagged++;
+            for (const std::string& scan : scans) {
+                LOG_MSG("Full scan in %s: %s", query.name, scan.c_str());
+            }
+        }
+    }
+    LOG_MSG("Query plan audit: %d of %d lookups scan a table", flagged,
+            (int)(sizeof(HOT_QUERIES) / sizeof(HOT_QUERIES[0])));
 }
 
 bool BookManager::initialize(const std::string& dbPath) {
-    resetInternalCache();
+    cachedProfileId = -1;
+    mainStorage.resetCaches();
+    cardStorage.resetCaches();
     currentBatchTimestamp = 0;
+
+    sqlite3* db = openDB();
+    if (db) {
+        ensureLookupIndexes(db);
+        auditQueryPlans(db);
+        closeDB(db);
+    }
     return true;
 }
 
-sqlite3* BookManager::openDB() {
+void BookManager::startSession() {
+    cachedProfileId = -1;
+    mainStorage.resetCaches();
+    cardStorage.resetCaches();
+}
+
+sqlite3* BookManager::openConnection(int flags) {
     sqlite3* db;
-    int rc = sqlite3_open_v2(SYSTEM_DB_PATH.c_str(), &db, SQLITE_OPEN_READWRITE, NULL);
+    int rc = sqlite3_open_v2(SYSTEM_DB_PATH.c_str(), &db, flags, NULL);
     if (rc != SQLITE_OK) {
         LOG_MSG("Failed to open DB: %s", sqlite3_errmsg(db));
         if (db) sqlite3_close(db);
         return nullptr;
     }
-    sqlite3_busy_timeout(db, 5000);
+    sqlite3_busy_handler(db, busyHandler, NULL);
+    return db;
+}
+
+sqlite3* BookManager::openDB() {
+    sqlite3* db = openConnection(SQLITE_OPEN_READWRITE);
+    if (!db) return nullptr;
     
     // Ускорение работы с БД
     sqlite3_exec(db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
@@ -123,14 +444,52 @@ void BookManager::closeDB(sqlite3* db) {
     if (db) sqlite3_close(db);
 }
 
-int BookManager::getStorageId(const std::string& filename) {
-    if (filename.compare(0, strlen(FLASHDIR), FLASHDIR) == 0) {
-        return 1; // Internal storage
+sqlite3* BookManager::acquireReader() {
+    {
+        std::lock_guard<std::mutex> lock(readersMutex);
+        if (!readers.empty()) {
+            sqlite3* db = readers.back();
+            readers.pop_back();
+            return db;
+        }
     }
-    if (filename.compare(0, strlen(SDCARDDIR), SDCARDDIR) == 0) {
-        return 2; // SD Card
+    return openConnection(SQLITE_OPEN_READONLY);
+}
+
+void BookManager::releaseReader(sqlite3* db) {
+    if (!db) return;
+    {
+        std::lock_guard<std::mutex> lock(readersMutex);
+        if ((int)readers.size() < READER_POOL_SIZE) {
+            readers.push_back(db);
+            return;
+        }
+    }
+    sqlite3_close(db);
+}
+
+void BookManager::closeReaders() {
+    std::lock_guard<std::mutex> lock(readersMutex);
+    for (size_t i = 0; i < readers.size(); i++) {
+        sqlite3_close(readers[i]);
     }
-    return (targetStorage == "carda") ? 2 : 1;
+    readers.clear();
+}
+
+DbLockStats BookManager::getLockStats() {
+    DbLockStats stats;
+    stats.waits = g_busyWaits;
+    stats.retries = g_busyRetries;
+    stats.waitUs = g_busyWaitUs;
+    stats.timeouts = g_busyTimeouts;
+    return stats;
+}
+
+void BookManager::resetLockStats() {
+    g_busyWaits = 0;
+    g_busyRetries = 0;
+    g_busyWaitUs = 0;
+    g_busyTimeouts = 0;
 }
 
 std::string BookManager::getFirstLetter(const std::string& str) {
@@ -151,11 +510,12 @@ std::string BookManager::getFirstLetter(const std::string& str) {
 }
 
 int BookManager::getCurrentProfileId(sqlite3* db) {
-    if (g_cachedProfileId != -1) return g_cachedProfileId;
+    int cached = cachedProfileId.load();
+    if (cached != -1) return cached;
 
     char* profileName = GetCurrentProfile();
     if (!profileName) {
-        g_cachedProfileId = 1;
+        cachedProfileId = 1;
         return 1; 
     }
 
@@ -173,23 +533,22 @@ int BookManager::getCurrentProfileId(sqlite3* db) {
     
     if (profileName) free(profileName);
     
-    g_cachedProfileId = id;
+    cachedProfileId = id;
     return id;
 }
 
-int BookManager::getOrCreateFolder(sqlite3* db, const std::string& folderPath, int storageId) {
-    std::string cacheKey = std::to_string(storageId) + ":" + folderPath;
-    auto it = g_folderCache.find(cacheKey);
-    if (it != g_folderCache.end()) {
-        return it->second;
+int BookManager::getOrCreateFolder(sqlite3* db, const StorageContext& storage, const std::string& folderPath) {
+    int cachedId = storage.findFolderId(folderPath);
+    if (cachedId != -1) {
+        return cachedId;
     }
+    int storageId = storage.storageId;
 
     int folderId = -1;
 
-    const char* selectSql = "SELECT id FROM folders WHERE storageid = ? AND name = ?";
     sqlite3_stmt* stmt;
     
-    if (sqlite3_prepare_v2(db, selectSql, -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, FIND_FOLDER_SQL, -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_int(stmt, 1, storageId);
         sqlite3_bind_text(stmt, 2, folderPath.c_str(), -1, SQLITE_STATIC);
         if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -211,18 +570,40 @@ int BookManager::getOrCreateFolder(sqlite3* db, const std::string& folderPath, i
     }
 
     if (folderId != -1) {
-        g_folderCache[cacheKey] = folderId;
+        storage.setFolderId(folderPath, folderId);
     }
     
     return folderId;
 }
 
-std::string BookManager::getBookFilePath(const std::string& lpath) {
-    if (lpath.empty()) return "";
-    if (lpath[0] == '/') {
-        return lpath;
+bool BookManager::ensureDirectory(const StorageContext& storage, const std::string& dirPath) {
+    if (dirPath.empty() || storage.isKnownDirectory(dirPath)) return true;
+    
+    // Try the directory itself first: its parents usually exist
+    if (mkdir(dirPath.c_str(), 0755) != 0) {
+        if (errno == ENOENT) {
+            size_t slash = dirPath.rfind('/');
+            if (slash == std::string::npos || slash == 0 ||
+                !ensureDirectory(storage, dirPath.substr(0, slash)) ||
+                (mkdir(dirPath.c_str(), 0755) != 0 && errno != EEXIST)) {
+                LOG_MSG("Failed to create directory %s: %s", dirPath.c_str(), strerror(errno));
+                return false;
+            }
+        } else if (errno != EEXIST) {
+            LOG_MSG("Failed to create directory %s: %s", dirPath.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    
+    // An existing directory implies its parents
+    for (size_t end = dirPath.size(); end > 0; end = dirPath.rfind('/', end - 1)) {
+        if (!storage.setKnownDirectory(dirPath.substr(0, end))) break;
     }
-    return (booksDir.back() == '/') ? booksDir + lpath : booksDir + "/" + lpath;
+    return true;
+}
+
+void BookManager::forgetDirectories(const StorageContext& storage) {
+    storage.forgetDirectories();
 }
 
 bool BookManager::processBookSettings(sqlite3* db, int bookId, const BookMetadata& metadata, int profileId) {
@@ -234,12 +615,11 @@ bool BookManager::processBookSettings(sqlite3* db, int bookId, const BookMetadat
     }
 
     // Check if record exists and get current completed status
-    const char* checkSql = "SELECT completed FROM books_settings WHERE bookid = ? AND profileid = ?";
     bool exists = false;
     int currentCompleted = 0;
     
     sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, checkSql, -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, FIND_SETTINGS_SQL, -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_int(stmt, 1, bookId);
         sqlite3_bind_int(stmt, 2, profileId);
         if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -351,8 +731,19 @@ bool BookManager::processBookSettings(sqlite3* db, int bookId, const BookMetadat
     return true;
 }
 
-bool BookManager::addBook(const BookMetadata& metadata) {
-    std::string fullPath = getBookFilePath(metadata.lpath);
+bool BookManager::addBook(const StorageContext& storage, const BookMetadata& metadata) {
+    sqlite3* db = openDB();
+    if (!db) return false;
+    bool added = addBook(db, storage, metadata);
+    closeDB(db);
+    return added;
+}
+
+bool BookManager::addBook(sqlite3* db, const StorageContext& storage, const BookMetadata& metadata) {
+    TraceSpan span("addBook", "db");
+    span.setArg("lpath", metadata.lpath);
+    
+    std::string fullPath = storage.getBookFilePath(metadata.lpath);
     
     std::string folderName, fileName;
     size_t lastSlash = fullPath.find_last_of('/');
@@ -379,32 +770,27 @@ bool BookManager::addBook(const BookMetadata& metadata) {
     time_t fileMtime = fileStat.st_mtime;
     time_t fileAtime = fileStat.st_atime;
 
-    sqlite3* db = openDB();
-    if (!db) return false;
-
-    int storageId = getStorageId(fullPath);
+    int storageId = storage.storageId;
     time_t now = time(NULL);
     
     if (currentBatchTimestamp == 0) {
         currentBatchTimestamp = now;
     }
 
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if (!beginWrite(db)) return false;
 
-    int folderId = getOrCreateFolder(db, folderName, storageId);
+    int folderId = getOrCreateFolder(db, storage, folderName);
     if (folderId == -1) {
         LOG_MSG("Error: Failed to get folder ID");
         sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
-        closeDB(db);
         return false;
     }
 
-    static const char* checkFileSql = "SELECT id, book_id FROM files WHERE filename = ? AND folder_id = ?";
     sqlite3_stmt* stmt;
     int fileId = -1;
     int bookId = -1;
     
-    if (sqlite3_prepare_v2(db, checkFileSql, -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, FIND_FILE_SQL, -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_text(stmt, 1, fileName.c_str(), -1, SQLITE_STATIC);
         sqlite3_bind_int(stmt, 2, folderId);
         if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -512,23 +898,26 @@ bool BookManager::addBook(const BookMetadata& metadata) {
     // sqlite3_exec(db, "PRAGMA wal_checkpoint(FULL)", NULL, NULL, NULL);
     // sqlite3_exec(db, "VACUUM", NULL, NULL, NULL);
     
-    closeDB(db);
     return true;
 }
 
-bool BookManager::updateBookSync(const BookMetadata& metadata) {
+bool BookManager::updateBookSync(const StorageContext& storage, const BookMetadata& metadata) {
     sqlite3* db = openDB();
     if (!db) return false;
+    bool res = updateBookSync(db, storage, metadata);
+    closeDB(db);
+    return res;
+}
 
-    int bookId = findBookIdByPath(db, metadata.lpath);
+bool BookManager::updateBookSync(sqlite3* db, const StorageContext& storage, const BookMetadata& metadata) {
+    int bookId = findBookIdByPath(db, storage, metadata.lpath);
     
     if (bookId == -1) {
         LOG_MSG("Sync: Book not found in DB: %s", metadata.lpath.c_str());
-        closeDB(db);
         return false;
     }
 
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if (!beginWrite(db)) return false;
 
     int profileId = getCurrentProfileId(db);
     bool res = processBookSettings(db, bookId, metadata, profileId);
@@ -537,23 +926,27 @@ bool BookManager::updateBookSync(const BookMetadata& metadata) {
 	// sqlite3_exec(db, "PRAGMA wal_checkpoint(FULL)", NULL, NULL, NULL);
 	// sqlite3_exec(db, "VACUUM", NULL, NULL, NULL);
     
-    closeDB(db);
     return res;
 }
 
-bool BookManager::updateBook(const BookMetadata& metadata) {
-    return addBook(metadata);
+bool BookManager::updateBook(const StorageContext& storage, const BookMetadata& metadata) {
+    return addBook(storage, metadata);
+}
+
+bool BookManager::deleteBook(const StorageContext& storage, const std::string& lpath) {
+    sqlite3* db = openDB();
+    if (!db) return false;
+    bool deleted = deleteBook(db, storage, lpath);
+    closeDB(db);
+    return deleted;
 }
 
-bool BookManager::deleteBook(const std::string& lpath) {
-    std::string filePath = getBookFilePath(lpath);
+bool BookManager::deleteBook(sqlite3* db, const StorageContext& storage, const std::string& lpath) {
+    std::string filePath = storage.getBookFilePath(lpath);
     LOG_MSG("Deleting book: %s", filePath.c_str());
     
     remove(filePath.c_str());
 
-    sqlite3* db = openDB();
-    if (!db) return false;
-
     std::string folderName, fileName;
     size_t lastSlash = filePath.find_last_of('/');
     if (lastSlash == std::string::npos) {
@@ -564,20 +957,15 @@ bool BookManager::deleteBook(const std::string& lpath) {
         fileName = filePath.substr(lastSlash + 1);
     }
     
-    int storageId = getStorageId(filePath);
+    int storageId = storage.storageId;
 
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if (!beginWrite(db)) return false;
 
-    static const char* findSql = 
-        "SELECT f.id, f.book_id FROM files f "
-        "JOIN folders fo ON f.folder_id = fo.id "
-        "WHERE f.filename = ? AND fo.name = ? AND f.storageid = ?";
-        
     sqlite3_stmt* stmt;
     int fileId = -1;
     int bookId = -1;
 
-    if (sqlite3_prepare_v2(db, findSql, -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, FIND_FILE_BY_PATH_SQL, -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_text(stmt, 1, fileName.c_str(), -1, SQLITE_STATIC);
         sqlite3_bind_text(stmt, 2, folderName.c_str(), -1, SQLITE_STATIC);
         sqlite3_bind_int(stmt, 3, storageId);
@@ -614,16 +1002,18 @@ bool BookManager::deleteBook(const std::string& lpath) {
 	// sqlite3_exec(db, "PRAGMA wal_checkpoint(FULL)", NULL, NULL, NULL);
 	// sqlite3_exec(db, "VACUUM", NULL, NULL, NULL);
     
-    closeDB(db);
     return true;
 }
 
-std::vector<BookMetadata> BookManager::getAllBooks() {
+std::vector<BookMetadata> BookManager::getAllBooks(const StorageContext& storage) {
     std::vector<BookMetadata> books;
     books.reserve(2048);
 
-    sqlite3* db = openDB();
+    // Read-only, in one transaction: a single snapshot for the whole listing,
+    // and writers (ours or the library's) are never waited for
+    sqlite3* db = acquireReader();
     if (!db) return books;
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
 
     int profileId = getCurrentProfileId(db);
     
@@ -633,11 +1023,13 @@ std::vector<BookMetadata> BookManager::getAllBooks() {
 		"FROM books_impl b "
 		"JOIN files f ON b.id = f.book_id "
 		"JOIN folders fo ON f.folder_id = fo.id "
-		"LEFT JOIN books_settings bs ON b.id = bs.bookid AND bs.profileid = ?";
+		"LEFT JOIN books_settings bs ON b.id = bs.bookid AND bs.profileid = ? "
+		"WHERE f.storageid = ?";
 
     sqlite3_stmt* stmt;
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_int(stmt, 1, profileId);
+        sqlite3_bind_int(stmt, 2, storage.storageId);
         
         while (sqlite3_step(stmt) == SQLITE_ROW) {
             BookMetadata meta;
@@ -658,15 +1050,7 @@ std::vector<BookMetadata> BookManager::getAllBooks() {
             const char* folder = (const char*)sqlite3_column_text(stmt, 8);
             
             if (filename && folder) {
-                std::string fullPath = std::string(folder) + "/" + filename;
-                if (fullPath.compare(0, booksDir.length(), booksDir) == 0) {
-                    meta.lpath = fullPath.substr(booksDir.length());
-                    if (!meta.lpath.empty() && meta.lpath[0] == '/') {
-                        meta.lpath.erase(0, 1);
-                    }
-                } else {
-                    meta.lpath = filename;
-                }
+                meta.lpath = storage.getLpath(std::string(folder) + "/" + filename);
             }
             
             meta.isRead = (sqlite3_column_int(stmt, 9) != 0);
@@ -674,6 +1058,7 @@ std::vector<BookMetadata> BookManager::getAllBooks() {
             
             time_t readTs = (time_t)sqlite3_column_int64(stmt, 11);
             if (meta.isRead && readTs > 0) {
+                meta.lastReadTime = readTs;
                 meta.lastReadDate = formatIsoTime(readTs);
             }
             
@@ -685,16 +1070,141 @@ std::vector<BookMetadata> BookManager::getAllBooks() {
         sqlite3_finalize(stmt);
     }
     
-    closeDB(db);
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    releaseReader(db);
     return books;
 }
 
-int BookManager::getBookCount() {
-    return getAllBooks().size();
+int BookManager::getBookCount(const StorageContext& storage) {
+    return getAllBooks(storage).size();
 }
 
-int BookManager::findBookIdByPath(sqlite3* db, const std::string& lpath) {
-    std::string fullPath = getBookFilePath(lpath);
+// An empty WAL holds nothing, and SQLite deletes it with the last connection:
+// missing and empty are the same state
+static void appendFileState(std::string& out, const char* tag, const std::string& path) {
+    struct stat st;
+    char buf[128];
+    if (stat(path.c_str(), &st) != 0 || st.st_size == 0) {
+        snprintf(buf, sizeof(buf), "%s:-;", tag);
+    } else {
+        snprintf(buf, sizeof(buf), "%s:%llu:%lld:%lld.%09ld;", tag, (unsigned long long)st.st_ino,
+                 (long long)st.st_size, (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    }
+    out += buf;
+}
+
+// Raw header bytes as hex, or nothing for a file too short to have them
+static void appendHeaderBytes(std::string& out, const char* tag, const std::string& path,
+                              long offset, size_t length) {
+    static const char HEX[] = "0123456789abcdef";
+    unsigned char bytes[16];
+    if (length > sizeof(bytes)) return;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return;
+    bool ok = fseek(f, offset, SEEK_SET) == 0 && fread(bytes, 1, length, f) == length;
+    fclose(f);
+    if (!ok) return;
+    
+    out += tag;
+    out += ':';
+    for (size_t i = 0; i < length; i++) {
+        out += HEX[bytes[i] >> 4];
+        out += HEX[bytes[i] & 0x0F];
+    }
+    out += ';';
+}
+
+std::string BookManager::getDbFingerprint() const {
+    std::string fingerprint = "profile:";
+    char* profileName = GetCurrentProfile();
+    if (profileName) {
+        fingerprint += profileName;
+        free(profileName);
+    }
+    fingerprint += ";";
+    appendFileState(fingerprint, "db", SYSTEM_DB_PATH);
+    appendFileState(fingerprint, "wal", SYSTEM_DB_PATH + "-wal");
+    // File change counter: bumped by every commit in rollback journal mode
+    appendHeaderBytes(fingerprint, "dbhdr", SYSTEM_DB_PATH, 24, 4);
+    // Checkpoint sequence and salts: change whenever the WAL is restarted,
+    // so a rewritten WAL of the same size and mtime still differs
+    appendHeaderBytes(fingerprint, "walhdr", SYSTEM_DB_PATH + "-wal", 12, 12);
+    return fingerprint;
+}
+
+// The storage root and every directory below it on the way to the book
+static void addBookDirectories(const StorageContext& storage, const std::string& lpath,
+                               std::set<std::string>& dirs) {
+    dirs.insert(storage.rootDir);
+    std::string path = storage.getBookFilePath(lpath);
+    size_t slash = path.find_last_of('/');
+    while (slash != std::string::npos && slash > storage.rootDir.size()) {
+        if (!dirs.insert(path.substr(0, slash)).second) break; // and so are its parents
+        slash = path.find_last_of('/', slash - 1);
+    }
+}
+
+std::string BookManager::getDirectoryFingerprint(const StorageContext& storage,
+                                                 const std::vector<BookMetadata>& books,
+                                                 DirectoryStamps* stamps) const {
+    std::set<std::string> dirs;
+    dirs.insert(storage.rootDir);
+    for (const BookMetadata& book : books) {
+        addBookDirectories(storage, book.lpath, dirs);
+    }
+
+    // FNV-1a over every directory's path and mtime
+    unsigned long long hash = 1469598103934665603ULL;
+    char buf[64];
+    for (const std::string& dir : dirs) {
+        std::string stamp;
+        DirectoryStamps::const_iterator known;
+        if (stamps && (known = stamps->find(dir)) != stamps->end()) {
+            stamp = known->second;
+        } else {
+            struct stat st;
+            if (stat(dir.c_str(), &st) == 0) {
+                snprintf(buf, sizeof(buf), ":%lld.%09ld;", (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+                stamp = buf;
+            } else {
+                stamp = ":-;";
+            }
+            if (stamps) (*stamps)[dir] = stamp;
+        }
+        for (char c : dir) hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+        for (char c : stamp) hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+    }
+    snprintf(buf, sizeof(buf), "dirs:%d:%016llx;", (int)dirs.size(), hash);
+    return buf;
+}
+
+void BookManager::forgetDirectoryStamps(const StorageContext& storage, const std::string& lpath,
+                                        DirectoryStamps& stamps) {
+    std::set<std::string> dirs;
+    addBookDirectories(storage, lpath, dirs);
+    for (const std::string& dir : dirs) {
+        stamps.erase(dir);
+    }
+}
+
+long long BookManager::getDataVersion() {
+    if (!versionWatch) {
+        versionWatch = openConnection(SQLITE_OPEN_READONLY);
+        if (!versionWatch) return -1;
+    }
+    long long version = -1;
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(versionWatch, "PRAGMA data_version", -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            version = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
+
+int BookManager::findBookIdByPath(sqlite3* db, const StorageContext& storage, const std::string& lpath) {
+    std::string fullPath = storage.getBookFilePath(lpath);
     std::string folderName, fileName;
     
     size_t lastSlash = fullPath.find_last_of('/');
@@ -706,13 +1216,13 @@ int BookManager::findBookIdByPath(sqlite3* db, const std::string& lpath) {
         fileName = fullPath.substr(lastSlash + 1);
     }
     
-    static const char* sql = "SELECT f.book_id FROM files f JOIN folders fo ON f.folder_id = fo.id WHERE f.filename = ? AND fo.name = ?";
     sqlite3_stmt* stmt;
     int bookId = -1;
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, FIND_BOOK_BY_PATH_SQL, -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_text(stmt, 1, fileName.c_str(), -1, SQLITE_STATIC);
         sqlite3_bind_text(stmt, 2, folderName.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, storage.storageId);
         if (sqlite3_step(stmt) == SQLITE_ROW) {
             bookId = sqlite3_column_int(stmt, 0);
         }
@@ -721,6 +1231,11 @@ int BookManager::findBookIdByPath(sqlite3* db, const std::string& lpath) {
     return bookId;
 }
 
+int BookManager::findBookIdByPath(sqlite3* db, const std::string& lpath) {
+    int bookId = findBookIdByPath(db, mainStorage, lpath);
+    return bookId != -1 ? bookId : findBookIdByPath(db, cardStorage, lpath);
+}
+
 int BookManager::getOrCreateBookshelf(sqlite3* db, const std::string& name) {
     int shelfId = -1;
     time_t now = time(NULL);
@@ -790,3 +1305,122 @@ void BookManager::linkBookToShelf(sqlite3* db, int shelfId, int bookId) {
         }
     }
 }
+
+void BookManager::diffCollection(const std::set<std::string>& calibreFiles,
+                                 const std::set<std::string>& deviceFiles,
+                                 std::vector<std::string>& toAdd,
+                                 std::vector<std::string>& toRemove) {
+    std::set_difference(calibreFiles.begin(), calibreFiles.end(),
+                        deviceFiles.begin(), deviceFiles.end(),
+                        std::back_inserter(toAdd));
+    std::set_difference(deviceFiles.begin(), deviceFiles.end(),
+                        calibreFiles.begin(), calibreFiles.end(),
+                        std::back_inserter(toRemove));
+}
+
+// Runs sql (?1 shelf, ?2 book, ?3 timestamp) for every lpath that has a book
+static void updateShelfBooks(BookManager& books, sqlite3* db, const char* sql, int shelfId,
+                             const std::vector<std::string>& lpaths, time_t now) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return;
+    
+    for (const std::string& lpath : lpaths) {
+        int bookId = books.findBookIdByPath(db, lpath);
+        if (bookId == -1) continue;
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, shelfId);
+        sqlite3_bind_int(stmt, 2, bookId);
+        sqlite3_bind_int64(stmt, 3, now);
+        sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+}
+
+bool BookManager::syncCollections(sqlite3* db,
+                                  const std::map<std::string, std::set<std::string>>& calibreCollections) {
+    TraceSpan span("collection sync", "db");
+    
+    std::map<std::string, std::set<std::string>> deviceCollections;
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, DEVICE_COLLECTIONS_SQL, -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char* shelfName = (const char*)sqlite3_column_text(stmt, 0);
+            const char* fileName = (const char*)sqlite3_column_text(stmt, 1);
+            const char* folderName = (const char*)sqlite3_column_text(stmt, 2);
+            
+            if (shelfName && fileName && folderName) {
+                std::string fullPath = std::string(folderName) + "/" + fileName;
+                const StorageContext& storage =
+                    fullPath.compare(0, cardStorage.rootDir.size() + 1, cardStorage.rootDir + "/") == 0
+                        ? cardStorage : mainStorage;
+                deviceCollections[shelfName].insert(storage.getLpath(fullPath));
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    LOG_MSG("Found %d collections on device", (int)deviceCollections.size());
+    
+    static const char* insertSql = 
+        "INSERT OR IGNORE INTO bookshelfs_books (bookshelfid, bookid, is_deleted, ts) "
+        "VALUES (?, ?, 0, ?)";
+    static const char* removeSql = 
+        "UPDATE bookshelfs_books SET is_deleted = 1, ts = ?3 "
+        "WHERE bookshelfid = ?1 AND bookid = ?2";
+    
+    if (!beginWrite(db)) return false;
+    time_t now = time(NULL);
+    
+    for (const auto& calibreEntry : calibreCollections) {
+        const std::string& collectionName = calibreEntry.first;
+        const std::set<std::string>& calibreFiles = calibreEntry.second;
+        
+        int shelfId = getOrCreateBookshelf(db, collectionName);
+        if (shelfId == -1) {
+            LOG_MSG("Failed to get/create shelf: %s", collectionName.c_str());
+            continue;
+        }
+        
+        auto deviceIt = deviceCollections.find(collectionName);
+        
+        if (deviceIt != deviceCollections.end()) {
+            std::vector<std::string> toAdd;
+            std::vector<std::string> toRemove;
+            diffCollection(calibreFiles, deviceIt->second, toAdd, toRemove);
+            
+            LOG_AT(LOG_DEBUG, "DB", "Collection '%s': %d to add, %d to remove", 
+                   collectionName.c_str(), (int)toAdd.size(), (int)toRemove.size());
+            
+            updateShelfBooks(*this, db, insertSql, shelfId, toAdd, now);
+            updateShelfBooks(*this, db, removeSql, shelfId, toRemove, now);
+            
+            deviceCollections.erase(deviceIt);
+            
+        } else {
+            LOG_MSG("Creating new collection: %s with %d books", 
+                    collectionName.c_str(), (int)calibreFiles.size());
+            
+            std::vector<std::string> toAdd(calibreFiles.begin(), calibreFiles.end());
+            updateShelfBooks(*this, db, insertSql, shelfId, toAdd, now);
+        }
+    }
+    
+    static const char* deleteShelfSql = "UPDATE bookshelfs SET is_deleted = 1, ts = ? WHERE name = ?";
+    for (const auto& deviceEntry : deviceCollections) {
+        const std::string& collectionName = deviceEntry.first;
+        
+        LOG_MSG("Removing collection no longer in Calibre: %s", collectionName.c_str());
+        
+        if (sqlite3_prepare_v2(db, deleteShelfSql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, now);
+            sqlite3_bind_text(stmt, 2, collectionName.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+    }
+    
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    
+    LOG_MSG("Collection sync completed");
+    return true;
+}
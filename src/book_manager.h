@@ -5,8 +5,11 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <sqlite3.h>
 #include <ctime>
+#include <mutex>
+#include <atomic>
 
 struct BookMetadata {
     std::string uuid;
@@ -27,15 +30,83 @@ struct BookMetadata {
     int thumbnailWidth;
     std::string isbn;
     
+    // Hex SHA-1 of the book file as received; device-side only (metadata cache)
+    std::string contentHash;
+    
     // Sync fields
     bool isRead;
     std::string lastReadDate;
     bool isFavorite;
+    // books_settings.completed_ts of a read book, as listed from the library
+    time_t lastReadTime;
     
     int dbBookId; 
     
     BookMetadata() : seriesIndex(0), size(0), thumbnailHeight(0), 
-                     thumbnailWidth(0), isRead(false), isFavorite(false), dbBookId(-1) {}
+                     thumbnailWidth(0), isRead(false), isFavorite(false), lastReadTime(0),
+                     dbBookId(-1) {}
+    
+    // Back to the default state, keeping string capacity for reuse
+    void clear() {
+        uuid.clear(); title.clear(); authors.clear(); authorSort.clear();
+        lpath.clear(); series.clear(); publisher.clear(); pubdate.clear();
+        lastModified.clear(); tags.clear(); comments.clear(); thumbnail.clear();
+        isbn.clear(); contentHash.clear(); lastReadDate.clear();
+        seriesIndex = 0; size = 0; thumbnailHeight = 0; thumbnailWidth = 0;
+        isRead = false; isFavorite = false; lastReadTime = 0; dbBookId = -1;
+    }
+};
+
+// One place books live: internal storage or the SD card. Built once by
+// BookManager and never changed, so operations on either storage can run
+// side by side; each is handed the context it works on.
+struct StorageContext {
+    std::string name;    // "main" or "carda", as in Calibre's on_card
+    std::string rootDir; // lpaths are relative to this
+    int storageId;       // storageid in the explorer DB
+    
+    StorageContext(const std::string& name, const std::string& rootDir, int storageId)
+        : name(name), rootDir(rootDir), storageId(storageId), hardLinks(-1) {}
+    
+    std::string getBookFilePath(const std::string& lpath) const;
+    // Inverse of getBookFilePath for a path under rootDir
+    std::string getLpath(const std::string& fullPath) const;
+    // Probed with a scratch file on first use (FAT has none), then cached
+    bool supportsHardLinks() const;
+    
+    // Directories seen this session, by full path (folders.name). One entry
+    // holds what both threads learned about it: the protocol thread that it
+    // exists on disk, the DB worker its folders.id.
+    int findFolderId(const std::string& dir) const; // -1 if not known
+    void setFolderId(const std::string& dir, int folderId) const;
+    bool isKnownDirectory(const std::string& dir) const;
+    // False if it was already known to exist
+    bool setKnownDirectory(const std::string& dir) const;
+    // Directories may have been removed behind our back; folder ids stay
+    void forgetDirectories() const;
+    void resetCaches() const;
+    
+private:
+    struct Folder {
+        int id;
+        bool onDisk;
+        Folder() : id(-1), onDisk(false) {}
+    };
+    
+    mutable std::atomic<int> hardLinks; // -1 not probed yet
+    mutable std::mutex folderMutex;
+    mutable std::unordered_map<std::string, Folder> folders;
+};
+
+// Waits on explorer-3.db locks held by other connections (the library app,
+// the indexer, our own writer), over all connections of the process
+struct DbLockStats {
+    unsigned long long waits;   // statements that found the DB locked
+    unsigned long long retries; // busy handler calls
+    unsigned long long waitUs;  // time slept in them
+    unsigned long long timeouts;
+    
+    DbLockStats() : waits(0), retries(0), waitUs(0), timeouts(0) {}
 };
 
 class BookManager {
@@ -44,45 +115,117 @@ public:
     ~BookManager();
     
     bool initialize(const std::string& ignored_path);
+    // A new connection: nothing remembered from the last one is trusted,
+    // the device may have changed in between
+    void startSession();
+    
+    // "carda" is the SD card, anything else internal storage
+    const StorageContext& getStorage(const std::string& onCard) const;
+    // Storage holding a file at lpath: internal storage unless only the
+    // SD card has it. For requests that name no storage (delete, sync).
+    const StorageContext& locateBook(const std::string& lpath) const;
     
-    bool addBook(const BookMetadata& metadata);
+    // Each opens its own connection; the sqlite3* overloads run on the
+    // caller's (DbWorker keeps one for the session)
+    bool addBook(const StorageContext& storage, const BookMetadata& metadata);
+    bool addBook(sqlite3* db, const StorageContext& storage, const BookMetadata& metadata);
     
-    bool updateBook(const BookMetadata& metadata); 
+    bool updateBook(const StorageContext& storage, const BookMetadata& metadata); 
 
-    bool updateBookSync(const BookMetadata& metadata); 
+    bool updateBookSync(const StorageContext& storage, const BookMetadata& metadata); 
+    bool updateBookSync(sqlite3* db, const StorageContext& storage, const BookMetadata& metadata);
+    
+    bool deleteBook(const StorageContext& storage, const std::string& lpath);
+    bool deleteBook(sqlite3* db, const StorageContext& storage, const std::string& lpath);
+    
+    std::vector<BookMetadata> getAllBooks(const StorageContext& storage); 
+    int getBookCount(const StorageContext& storage);
     
-    bool deleteBook(const std::string& lpath);
+    // What getAllBooks() depends on, to tell whether an earlier listing is
+    // still current. The DB part: reader profile, identity, size and mtime
+    // of the library DB and its WAL, the DB's change counter and the WAL's
+    // checkpoint sequence and salts. The directory part: mtimes of every
+    // directory from the storage root down to each listed book.
+    // Known gap: in WAL mode the change counter stays put, so a commit that
+    // is checkpointed and truncated away within one mtime tick (2 s on FAT),
+    // leaving the DB size unchanged, looks like no change. data_version
+    // covers that within a process; after a restart it can go unnoticed.
+    std::string getDbFingerprint() const;
+    // Directory -> its mtime as hashed. Given to getDirectoryFingerprint,
+    // stamps already there are reused and new ones added, so a session stats
+    // each directory once; forgetDirectoryStamps drops those a book's write or
+    // delete changed.
+    typedef std::map<std::string, std::string> DirectoryStamps;
+    std::string getDirectoryFingerprint(const StorageContext& storage,
+                                        const std::vector<BookMetadata>& books,
+                                        DirectoryStamps* stamps = nullptr) const;
+    static void forgetDirectoryStamps(const StorageContext& storage, const std::string& lpath,
+                                      DirectoryStamps& stamps);
+    // PRAGMA data_version on a connection kept open until destruction: it
+    // changes whenever another connection (ours or the firmware's) commits.
+    // Only comparable within this process; -1 if the DB cannot be opened.
+    long long getDataVersion();
     
-    std::vector<BookMetadata> getAllBooks(); 
-    int getBookCount();
-    std::string getBookFilePath(const std::string& lpath);
+    // mkdir -p for book directories. Directories seen this session are
+    // remembered, so a book going into a known directory costs no syscalls.
+    bool ensureDirectory(const StorageContext& storage, const std::string& dirPath);
+    // Someone else may have removed directories: check again
+    void forgetDirectories(const StorageContext& storage);
     
     // Public methods for collection management (used by CalibreProtocol)
     sqlite3* openDB();
     void closeDB(sqlite3* db);
+    
+    // Read-only connections, kept open between reads. A reader sees the
+    // last commit when its transaction starts, and never takes the write lock.
+    sqlite3* acquireReader();
+    void releaseReader(sqlite3* db);
+    void closeReaders();
+    
+    static DbLockStats getLockStats();
+    static void resetLockStats();
     int getOrCreateBookshelf(sqlite3* db, const std::string& name);
+    int findBookIdByPath(sqlite3* db, const StorageContext& storage, const std::string& lpath);
+    // Either storage, internal storage first (as locateBook)
     int findBookIdByPath(sqlite3* db, const std::string& lpath);
     void linkBookToShelf(sqlite3* db, int shelfId, int bookId);
+    // Makes the shelves match Calibre's collections (name -> lpaths). The
+    // lpaths may be on either storage; each book is found where it is.
+    bool syncCollections(sqlite3* db, const std::map<std::string, std::set<std::string>>& collections);
 	
 	bool hasSDCard() const;
 	std::string getSDCardPath() const;
-	void setTargetStorage(const std::string& storage); // "main", "carda"
-	std::string getCurrentStorage() const;
+	
+	// <internal storage>/system/<name>, e.g. /mnt/ext1/system/explorer-3/explorer-3.db
+	static std::string getSystemPath(const std::string& name);
 
 private:
-    const std::string SYSTEM_DB_PATH = "/mnt/ext1/system/explorer-3/explorer-3.db";
-    std::string booksDir;
+    const std::string SYSTEM_DB_PATH;
+    const StorageContext mainStorage;
+    const StorageContext cardStorage;
 	
 	time_t currentBatchTimestamp;
     
-    int getStorageId(const std::string& filename);
+    std::vector<sqlite3*> readers; // idle readers
+    std::mutex readersMutex;
+    sqlite3* versionWatch;
+    // profiles.id of the current reader profile, -1 until looked up. Read by
+    // the DB worker and the reader paths; the profile may change between sessions.
+    std::atomic<int> cachedProfileId;
+    
+    sqlite3* openConnection(int flags);
+    
     int getCurrentProfileId(sqlite3* db);
     std::string getFirstLetter(const std::string& str);
     
-    int getOrCreateFolder(sqlite3* db, const std::string& folderPath, int storageId);
+    int getOrCreateFolder(sqlite3* db, const StorageContext& storage, const std::string& folderPath);
     bool processBookSettings(sqlite3* db, int book_id, const BookMetadata& metadata, int profile_id);
+    static void diffCollection(const std::set<std::string>& calibreFiles,
+                               const std::set<std::string>& deviceFiles,
+                               std::vector<std::string>& toAdd,
+                               std::vector<std::string>& toRemove);
 	
-	std::string targetStorage; // "main" or "carda"
+	friend class BenchmarkAccess;
 };
 
 #endif // BOOK_MANAGER_H
\ No newline at end of file
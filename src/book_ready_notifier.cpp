@@ -0,0 +1,89 @@
+#include "book_ready_notifier.h"
+#include "logger.h"
+#include "metrics.h"
+#include "inkview.h"
+#include <vector>
+#include <chrono>
+
+#define logNotify(level, ...) LOG_AT(level, "NOTIFY", __VA_ARGS__)
+
+BookReadyNotifier::BookReadyNotifier(int idleMs)
+    : idleFlushMs(idleMs > 0 ? idleMs : 1), stopping(false), lastAddUs(0),
+      transferActive(false), notified(0), flushes(0), flushesDuringTransfer(0) {
+}
+
+BookReadyNotifier::~BookReadyNotifier() {
+    stop();
+}
+
+void BookReadyNotifier::add(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.insert(path);
+    lastAddUs = SessionMetrics::nowUs();
+
+    if (!timer.joinable()) {
+        stopping = false;
+        timer = std::thread(&BookReadyNotifier::runTimer, this);
+    }
+    wake.notify_one();
+}
+
+void BookReadyNotifier::flush() {
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending.empty()) return;
+        paths.assign(pending.begin(), pending.end());
+        pending.clear();
+    }
+
+    // Outside the lock: BookReady talks to the library process
+    for (size_t i = 0; i < paths.size(); i++) {
+        BookReady(paths[i].c_str());
+    }
+
+    notified += (int)paths.size();
+    flushes++;
+    if (transferActive) flushesDuringTransfer++;
+    logNotify(LOG_DEBUG, "BookReady sent for %zu books", paths.size());
+}
+
+void BookReadyNotifier::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        wake.notify_all();
+    }
+    if (timer.joinable()) {
+        timer.join();
+    }
+    flush();
+}
+
+void BookReadyNotifier::resetCounters() {
+    notified = 0;
+    flushes = 0;
+    flushesDuringTransfer = 0;
+}
+
+void BookReadyNotifier::runTimer() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (pending.empty()) {
+            wake.wait(lock);
+            continue;
+        }
+
+        unsigned long long idleUs = (unsigned long long)idleFlushMs * 1000ULL;
+        unsigned long long elapsed = SessionMetrics::nowUs() - lastAddUs;
+        if (elapsed < idleUs) {
+            wake.wait_for(lock, std::chrono::microseconds(idleUs - elapsed));
+            continue;
+        }
+
+        // Calibre went quiet without ending the batch
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
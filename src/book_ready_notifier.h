@@ -0,0 +1,54 @@
+#ifndef BOOK_READY_NOTIFIER_H
+#define BOOK_READY_NOTIFIER_H
+
+#include <string>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Collects the paths of received books and calls BookReady for them in one
+// go. Every BookReady makes the library rescan, so during a bulk transfer the
+// indexer would otherwise compete with the protocol thread once per book.
+// Paths are flushed at the end of a batch (SEND_BOOKLISTS), on disconnect,
+// or once no book has arrived for idleFlushMs. Thread-safe.
+class BookReadyNotifier {
+public:
+    explicit BookReadyNotifier(int idleFlushMs = 3000);
+    ~BookReadyNotifier();
+
+    BookReadyNotifier(const BookReadyNotifier&) = delete;
+    BookReadyNotifier& operator=(const BookReadyNotifier&) = delete;
+
+    void add(const std::string& path);
+    void flush();
+
+    // Flushes and stops the idle timer; add() restarts it
+    void stop();
+
+    // A book transfer batch is running: flushes now count as mid-transfer
+    void setTransferActive(bool active) { transferActive = active; }
+
+    int getNotified() const { return notified; }
+    int getFlushes() const { return flushes; }
+    int getFlushesDuringTransfer() const { return flushesDuringTransfer; }
+    void resetCounters();
+
+private:
+    std::set<std::string> pending;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread timer;
+    int idleFlushMs;
+    bool stopping;
+    unsigned long long lastAddUs;
+    std::atomic<bool> transferActive;
+    std::atomic<int> notified;
+    std::atomic<int> flushes;
+    std::atomic<int> flushesDuringTransfer;
+
+    void runTimer();
+};
+
+#endif // BOOK_READY_NOTIFIER_H
@@ -1,4 +1,6 @@
 #include "cache_manager.h"
+#include "logger.h"
+#include "trace.h"
 #include <json-c/json.h>
 #include <ctime>
 #include <cstdio>
@@ -7,17 +9,17 @@
 #include <cstring>
 #include <unistd.h> // Для fsync, unlink, rename
 
-// Оптимизация логгера: добавлен fflush и проверка указателя
-#define LOG_CACHE(fmt, ...) { \
-    FILE* f = fopen("/mnt/ext1/system/calibre-connect.log", "a"); \
-    if(f) { \
-        fprintf(f, "[CACHE] " fmt "\n", ##__VA_ARGS__); \
-        fflush(f); \
-        fclose(f); \
-    } \
-}
+#define LOG_CACHE(...) LOG_AT(LOG_INFO, "CACHE", __VA_ARGS__)
+
+// Top-level key next to the lpath entries; loaders without it skip it (no "book")
+static const char* SYNC_WATERMARK_KEY = "_sync_watermark_";
+
+// Session index file: magic, version, storages; all integers native-endian,
+// the file never leaves the device
+static const char INDEX_MAGIC[4] = { 'C', 'C', 'I', 'X' };
+static const unsigned INDEX_VERSION = 1;
 
-CacheManager::CacheManager() {
+CacheManager::CacheManager() : syncWatermark(0), indexDirty(false) {
 }
 
 CacheManager::~CacheManager() {
@@ -29,9 +31,19 @@ bool CacheManager::initialize(const std::string& deviceUuid) {
         return false;
     }
     
+    {
+        // A session index in memory is at least as recent as the file
+        std::lock_guard<std::mutex> lock(mutex);
+        if (deviceUuid != this->deviceUuid) {
+            sessionIndexes.clear();
+            indexDirty = false;
+        }
+    }
+    
     this->deviceUuid = deviceUuid;
     // Формируем путь. Можно вынести базовый путь в константу.
-    cacheFilePath = "/mnt/ext1/system/calibre_cache_" + deviceUuid + ".json";
+    cacheFilePath = BookManager::getSystemPath("calibre_cache_" + deviceUuid + ".json");
+    indexFilePath = BookManager::getSystemPath("calibre_index_" + deviceUuid + ".dat");
     
     LOG_CACHE("Initialized cache for device: %s", deviceUuid.c_str());
     
@@ -69,6 +81,11 @@ time_t CacheManager::parseTimestamp(const std::string& isoTime) const {
 }
 
 bool CacheManager::loadCache() {
+    std::lock_guard<std::mutex> lock(mutex);
+    syncWatermark = 0;
+    if (sessionIndexes.empty()) {
+        loadSessionIndexes();
+    }
     FILE* f = fopen(cacheFilePath.c_str(), "r");
     if (!f) {
         LOG_CACHE("Cache file not found, starting fresh");
@@ -105,7 +122,10 @@ bool CacheManager::loadCache() {
     int loaded = 0;
     
     json_object_object_foreach(root, key, val) {
-        (void)key;
+        if (strcmp(key, SYNC_WATERMARK_KEY) == 0) {
+            syncWatermark = (time_t)json_object_get_int64(val);
+            continue;
+        }
         
         json_object* bookObj = NULL;
         json_object* lastUsedObj = NULL;
@@ -131,6 +151,10 @@ bool CacheManager::loadCache() {
         metadata.authors = getString("authors");
         metadata.lpath = getString("lpath");
         metadata.lastModified = getString("last_modified");
+        metadata.contentHash = getString("_content_hash_");
+        if (!metadata.contentHash.empty() && json_object_object_get_ex(bookObj, "size", &tmp)) {
+            metadata.size = json_object_get_int64(tmp);
+        }
         
         if (json_object_object_get_ex(bookObj, "_is_read_", &tmp)) {
             metadata.isRead = json_object_get_boolean(tmp);
@@ -158,9 +182,15 @@ bool CacheManager::loadCache() {
 }
 
 bool CacheManager::saveCache() {
+    TraceSpan span("saveCache", "cache");
+    std::lock_guard<std::mutex> lock(mutex);
     LOG_CACHE("Saving cache with %d entries", (int)cacheData.size());
     
-    purgeOldEntries(30);
+    purge(30);
+    
+    if (indexDirty && saveSessionIndexes()) {
+        indexDirty = false;
+    }
     
     std::string tmpFilePath = cacheFilePath + ".tmp";
     FILE* f = fopen(tmpFilePath.c_str(), "w");
@@ -172,6 +202,10 @@ bool CacheManager::saveCache() {
     fprintf(f, "{");
     
     bool first = true;
+    if (syncWatermark > 0) {
+        fprintf(f, "\n  \"%s\": %lld", SYNC_WATERMARK_KEY, (long long)syncWatermark);
+        first = false;
+    }
     for (const auto& entry : cacheData) {
         if (!first) fprintf(f, ",");
         first = false;
@@ -200,6 +234,11 @@ bool CacheManager::saveCache() {
         fprintf(f, "\n      \"last_modified\": \"%s\",", meta.lastModified.c_str());
         fprintf(f, "\n      \"_is_read_\": %s,", meta.isRead ? "true" : "false");
         
+        if (!meta.contentHash.empty()) {
+            fprintf(f, "\n      \"size\": %lld,", meta.size);
+            fprintf(f, "\n      \"_content_hash_\": \"%s\",", meta.contentHash.c_str());
+        }
+        
         if (!meta.lastReadDate.empty()) {
             fprintf(f, "\n      \"_last_read_date_\": \"%s\",", meta.lastReadDate.c_str());
         }
@@ -227,6 +266,7 @@ bool CacheManager::saveCache() {
 }
 
 std::string CacheManager::getUuidForLpath(const std::string& lpath) const {
+    std::lock_guard<std::mutex> lock(mutex);
     auto it = cacheData.find(lpath);
     if (it != cacheData.end()) {
         return it->second.metadata.uuid;
@@ -235,6 +275,7 @@ std::string CacheManager::getUuidForLpath(const std::string& lpath) const {
 }
 
 bool CacheManager::getCachedMetadata(const std::string& lpath, BookMetadata& outMetadata) const {
+    std::lock_guard<std::mutex> lock(mutex);
     auto it = cacheData.find(lpath);
     if (it != cacheData.end()) {
         outMetadata = it->second.metadata;
@@ -247,6 +288,7 @@ void CacheManager::updateCache(const BookMetadata& metadata) {
     if (metadata.lpath.empty()) {
         return;
     }
+    std::lock_guard<std::mutex> lock(mutex);
     
     std::string uuidToStore = metadata.uuid;
     
@@ -262,18 +304,225 @@ void CacheManager::updateCache(const BookMetadata& metadata) {
     BookMetadata newMeta = metadata;
     newMeta.uuid = uuidToStore; // перемещение строки, если возможно, но здесь просто присваивание
     
+    // Metadata-only updates do not touch the file: keep what is known about it
+    if (newMeta.contentHash.empty() && it != cacheData.end()) {
+        newMeta.contentHash = it->second.metadata.contentHash;
+        newMeta.size = it->second.metadata.size;
+    }
+    
     std::string timestamp = getCurrentTimestamp();
     
     // insert_or_assign (C++17) или оператор []
     cacheData[metadata.lpath] = CacheEntry(newMeta, timestamp);
 }
 
+std::string CacheManager::findSameContent(long long size, const std::string& contentHash,
+                                          const std::string& excludeLpath) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& entry : cacheData) {
+        const BookMetadata& meta = entry.second.metadata;
+        if (meta.contentHash.empty() || meta.size != size || entry.first == excludeLpath) continue;
+        if (contentHash.empty() || meta.contentHash == contentHash) return entry.first;
+    }
+    return "";
+}
+
 void CacheManager::removeFromCache(const std::string& lpath) {
+    std::lock_guard<std::mutex> lock(mutex);
     cacheData.erase(lpath);
     LOG_CACHE("Removed from cache: %s", lpath.c_str());
 }
 
+void CacheManager::updateReadState(const std::string& lpath, bool isRead,
+                                   const std::string& lastReadDate) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cacheData.find(lpath);
+    if (it == cacheData.end()) return;
+    it->second.metadata.isRead = isRead;
+    it->second.metadata.lastReadDate = lastReadDate;
+}
+
+time_t CacheManager::getSyncWatermark() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return syncWatermark;
+}
+
+void CacheManager::setSyncWatermark(time_t watermark) {
+    std::lock_guard<std::mutex> lock(mutex);
+    syncWatermark = watermark;
+}
+
+void CacheManager::storeSessionIndex(int storageId, const std::vector<BookMetadata>& books,
+                                     const std::string& fingerprint, long long dataVersion) {
+    std::lock_guard<std::mutex> lock(mutex);
+    SessionIndex& index = sessionIndexes[storageId];
+    index.fingerprint = fingerprint;
+    index.dataVersion = dataVersion;
+    index.books = books;
+    indexDirty = true;
+}
+
+bool CacheManager::getSessionIndex(int storageId, std::vector<BookMetadata>& books,
+                                   std::string& fingerprint, long long& dataVersion) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = sessionIndexes.find(storageId);
+    if (it == sessionIndexes.end()) return false;
+    books = it->second.books;
+    fingerprint = it->second.fingerprint;
+    dataVersion = it->second.dataVersion;
+    return true;
+}
+
+void CacheManager::dropSessionIndex(int storageId) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (sessionIndexes.erase(storageId)) {
+        indexDirty = true;
+    }
+}
+
+static void putU32(std::string& out, unsigned value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void putI64(std::string& out, long long value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void putString(std::string& out, const std::string& value) {
+    putU32(out, (unsigned)value.size());
+    out += value;
+}
+
+// Bounds-checked reads over the loaded file; a short read fails the rest
+struct IndexReader {
+    const char* pos;
+    const char* end;
+    
+    bool bytes(void* out, size_t length) {
+        if ((size_t)(end - pos) < length) return false;
+        memcpy(out, pos, length);
+        pos += length;
+        return true;
+    }
+    bool u32(unsigned& value) { return bytes(&value, sizeof(value)); }
+    bool i64(long long& value) { return bytes(&value, sizeof(value)); }
+    bool string(std::string& value) {
+        unsigned length;
+        if (!u32(length) || (size_t)(end - pos) < length) return false;
+        value.assign(pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+void CacheManager::loadSessionIndexes() {
+    FILE* f = fopen(indexFilePath.c_str(), "rb");
+    if (!f) return;
+    
+    std::string data;
+    char chunk[64 * 1024];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data.append(chunk, got);
+    }
+    fclose(f);
+    
+    IndexReader in = { data.data(), data.data() + data.size() };
+    char magic[4];
+    unsigned version, storages;
+    if (!in.bytes(magic, sizeof(magic)) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+        !in.u32(version) || version != INDEX_VERSION || !in.u32(storages)) {
+        LOG_CACHE("Ignoring session index of another format");
+        return;
+    }
+    
+    std::map<int, SessionIndex> loaded;
+    for (unsigned s = 0; s < storages; s++) {
+        unsigned storageId, count;
+        if (!in.u32(storageId)) return;
+        SessionIndex& index = loaded[(int)storageId];
+        index.dataVersion = -1;
+        if (!in.string(index.fingerprint) || !in.u32(count)) return;
+        
+        index.books.resize(count);
+        for (BookMetadata& book : index.books) {
+            unsigned bookId, seriesIndex, flags;
+            long long readTime;
+            if (!in.u32(bookId) || !in.u32(seriesIndex) || !in.u32(flags) ||
+                !in.i64(book.size) || !in.i64(readTime) ||
+                !in.string(book.title) || !in.string(book.authors) || !in.string(book.series) ||
+                !in.string(book.lpath) || !in.string(book.lastModified) ||
+                !in.string(book.lastReadDate)) {
+                LOG_CACHE("Session index truncated, ignoring it");
+                return;
+            }
+            book.dbBookId = (int)bookId;
+            book.seriesIndex = (int)seriesIndex;
+            book.isRead = (flags & 1) != 0;
+            book.isFavorite = (flags & 2) != 0;
+            book.lastReadTime = (time_t)readTime;
+        }
+    }
+    
+    sessionIndexes.swap(loaded);
+    LOG_CACHE("Loaded session index for %d storage(s)", (int)sessionIndexes.size());
+}
+
+bool CacheManager::saveSessionIndexes() {
+    std::string data;
+    data.append(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    putU32(data, INDEX_VERSION);
+    putU32(data, (unsigned)sessionIndexes.size());
+    for (const auto& entry : sessionIndexes) {
+        const SessionIndex& index = entry.second;
+        putU32(data, (unsigned)entry.first);
+        putString(data, index.fingerprint);
+        putU32(data, (unsigned)index.books.size());
+        for (const BookMetadata& book : index.books) {
+            putU32(data, (unsigned)book.dbBookId);
+            putU32(data, (unsigned)book.seriesIndex);
+            putU32(data, (book.isRead ? 1 : 0) | (book.isFavorite ? 2 : 0));
+            putI64(data, book.size);
+            putI64(data, (long long)book.lastReadTime);
+            putString(data, book.title);
+            putString(data, book.authors);
+            putString(data, book.series);
+            putString(data, book.lpath);
+            putString(data, book.lastModified);
+            putString(data, book.lastReadDate);
+        }
+    }
+    
+    std::string tmpFilePath = indexFilePath + ".tmp";
+    FILE* f = fopen(tmpFilePath.c_str(), "wb");
+    if (!f) {
+        LOG_CACHE("Failed to open tmp session index for writing");
+        return false;
+    }
+    bool written = fwrite(data.data(), 1, data.size(), f) == data.size();
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    
+    if (!written || rename(tmpFilePath.c_str(), indexFilePath.c_str()) != 0) {
+        LOG_CACHE("Failed to write session index");
+        unlink(tmpFilePath.c_str());
+        return false;
+    }
+    return true;
+}
+
 void CacheManager::purgeOldEntries(int days) {
+    std::lock_guard<std::mutex> lock(mutex);
+    purge(days);
+}
+
+int CacheManager::getCacheSize() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return cacheData.size();
+}
+
+void CacheManager::purge(int days) {
     time_t now = time(NULL);
     time_t threshold = now - (days * 24 * 60 * 60);
     
@@ -295,6 +544,10 @@ void CacheManager::purgeOldEntries(int days) {
 }
 
 void CacheManager::clearCache() {
+    std::lock_guard<std::mutex> lock(mutex);
     cacheData.clear();
+    syncWatermark = 0;
+    sessionIndexes.clear();
+    indexDirty = true;
     LOG_CACHE("Cache cleared");
 }
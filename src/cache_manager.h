@@ -5,6 +5,8 @@
 #include <string>
 #include <unordered_map> // Оптимизация: HashMap вместо дерева
 #include <vector>
+#include <map>
+#include <mutex>
 
 // Cache entry structure matching Calibre's expectations
 struct CacheEntry {
@@ -16,6 +18,7 @@ struct CacheEntry {
         : metadata(meta), lastUsed(used) {}
 };
 
+// Thread-safe: the protocol thread and the book finalizer both use it
 class CacheManager {
 public:
     CacheManager();
@@ -39,25 +42,62 @@ public:
     // Update or add to cache
     void updateCache(const BookMetadata& metadata);
     
+    // lpath of another cached book with this size and content hash (any hash
+    // when contentHash is empty), or empty
+    std::string findSameContent(long long size, const std::string& contentHash,
+                                const std::string& excludeLpath) const;
+    
     // Remove from cache
     void removeFromCache(const std::string& lpath);
     
+    // Read state Calibre was last told for a cached book (no-op if not cached)
+    void updateReadState(const std::string& lpath, bool isRead, const std::string& lastReadDate);
+    
+    // When the device last sent Calibre its read states (0: never); books
+    // read before it, and as Calibre knows them, need not be sent again
+    time_t getSyncWatermark() const;
+    void setSyncWatermark(time_t watermark);
+    
+    // Booklist of a storage as last saved, with the library fingerprint it
+    // was taken at and the DB data_version (see BookManager), which is only
+    // kept in memory: -1 once read back from disk. Saved with the cache.
+    void storeSessionIndex(int storageId, const std::vector<BookMetadata>& books,
+                           const std::string& fingerprint, long long dataVersion);
+    bool getSessionIndex(int storageId, std::vector<BookMetadata>& books,
+                         std::string& fingerprint, long long& dataVersion) const;
+    void dropSessionIndex(int storageId);
+    
     // Clear old entries (called during save)
     void purgeOldEntries(int days = 30);
     
     // Get cache statistics
-    int getCacheSize() const { return cacheData.size(); }
+    int getCacheSize() const;
     
     // Clear all cache
     void clearCache();
     
 private:
+    struct SessionIndex {
+        std::string fingerprint;
+        long long dataVersion;
+        std::vector<BookMetadata> books;
+    };
+    
     std::string deviceUuid;
     std::string cacheFilePath;
+    std::string indexFilePath;
     
     // Оптимизация: unordered_map для доступа O(1)
     // Key: lpath (file path relative to root), Value: CacheEntry
     std::unordered_map<std::string, CacheEntry> cacheData; 
+    time_t syncWatermark;
+    std::map<int, SessionIndex> sessionIndexes; // by storage id
+    bool indexDirty;
+    mutable std::mutex mutex;
+    
+    void purge(int days);
+    void loadSessionIndexes();
+    bool saveSessionIndexes();
     
     // Helper to get current ISO timestamp
     std::string getCurrentTimestamp() const;
@@ -1,11 +1,15 @@
 #include "calibre_protocol.h"
+#include "logger.h"
+#include "trace.h"
+#include "json_writer.h"
+#include "json_pull.h"
 #include <sys/stat.h>
 #include <errno.h>
 #include <vector>
 #include <algorithm>
 #include "inkview.h"
 #include <json-c/json.h>
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <sys/statvfs.h>
 #include <cstring>
 #include <sstream>
@@ -15,30 +19,23 @@
 
 // Constants synchronized with driver.py
 static const int BASE_PACKET_LEN = 4096;
+// Book payloads are a plain byte stream: read them in larger pieces than Calibre's packets
+static const size_t BOOK_RECEIVE_CHUNK = 64 * 1024;
 static const int COVER_HEIGHT = 240;
+static const int COVER_WIDTH = 200; // for covers extracted from the book
 static const int DEFAULT_PATH_LENGTH = 37;
 static const int PROTOCOL_VERSION = 1;
 
-// Helper for logging with levels
-enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_ERROR };
+// Diagnostics, relative to the system folder (see BookManager::getSystemPath)
+static const char* METRICS_FILE = "calibre-connect-metrics.log";
+static const char* TRACE_FILE_PREFIX = "calibre-connect-trace";
 
-static void logProto(LogLevel level, const char* fmt, ...) {
-    if (level == LOG_DEBUG) return; 
+#define logProto(level, ...) LOG_AT(level, "PROTO", __VA_ARGS__)
 
-    FILE* f = fopen("/mnt/ext1/system/calibre-connect.log", "a");
-    if (f) {
-        const char* prefix[] = {"[DEBUG]", "[INFO]", "[ERROR]"};
-        fprintf(f, "%s ", prefix[level]);
-        
-        va_list args;
-        va_start(args, fmt);
-        vfprintf(f, fmt, args);
-        va_end(args);
-        fprintf(f, "\n");
-        // fflush(f); // Уберите fflush для ускорения, если не нужен реал-тайм лог при крешах
-        fclose(f);
-    }
-}
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
 
 // RAII wrapper for FILE*
 class FileHandle {
@@ -51,61 +48,6 @@ public:
     operator bool() const { return file != nullptr; }
 };
 
-// RAII wrapper for sqlite3_stmt
-class StmtHandle {
-    sqlite3_stmt* stmt;
-public:
-    explicit StmtHandle(sqlite3_stmt* s = nullptr) : stmt(s) {}
-    ~StmtHandle() { if (stmt) sqlite3_finalize(stmt); }
-    sqlite3_stmt* get() const { return stmt; }
-    sqlite3_stmt** ptr() { return &stmt; }
-    operator bool() const { return stmt != nullptr; }
-};
-
-static int recursiveMkdir(const std::string& path) {
-    std::string current_path;
-    std::string path_copy = path;
-    
-    if (!path_copy.empty() && path_copy.back() == '/') {
-        path_copy.pop_back();
-    }
-
-    size_t pos = 0;
-    if (!path_copy.empty() && path_copy[0] == '/') {
-        current_path = "/";
-        pos = 1;
-    }
-
-    while (pos < path_copy.length()) {
-        size_t next_slash = path_copy.find('/', pos);
-        std::string part;
-        
-        if (next_slash == std::string::npos) {
-            part = path_copy.substr(pos);
-            pos = path_copy.length();
-        } else {
-            part = path_copy.substr(pos, next_slash - pos);
-            pos = next_slash + 1;
-        }
-        
-        if (part.empty()) continue;
-
-        if (current_path.length() > 0 && current_path.back() != '/') {
-            current_path += "/";
-        }
-        current_path += part;
-
-        if (mkdir(current_path.c_str(), 0755) != 0) {
-            if (errno != EEXIST) {
-                logProto(LOG_ERROR, "Failed to create directory %s: %s", 
-                        current_path.c_str(), strerror(errno));
-                return -1;
-            }
-        }
-    }
-    return 0;
-}
-
 static std::string safeGetJsonString(json_object* val) {
     if (!val) return "";
     if (json_object_get_type(val) == json_type_null) return "";
@@ -119,10 +61,13 @@ CalibreProtocol::CalibreProtocol(NetworkManager* net, BookManager* bookMgr,
                                  const std::string& readDateCol, 
                                  const std::string& favCol) 
     : network(net), bookManager(bookMgr), cacheManager(cacheMgr),
-      connected(false),
+      connected(false), readSyncSince(-1), readSyncListed(0),
       readColumn(readCol), readDateColumn(readDateCol), favoriteColumn(favCol),
-      currentBookLength(0), currentBookReceived(0), currentBookFile(nullptr),
-      booksReceivedInSession(0), lastBatchCount(0) {
+      currentBookLength(0), currentBookReceived(0),
+      booksReceivedInSession(0), lastBatchCount(0), tracingEnabled(false),
+      coverWriter(bookReadyNotifier), dbWorker(*bookMgr),
+      bookFinalizer(dbWorker, cacheMgr, coverWriter, bookReadyNotifier, COVER_WIDTH, COVER_HEIGHT),
+      tokener(json_tokener_new()) {
     
     const char* model = GetDeviceModel();
     if (model && strlen(model) > 0) {
@@ -138,6 +83,9 @@ CalibreProtocol::CalibreProtocol(NetworkManager* net, BookManager* bookMgr,
 
 CalibreProtocol::~CalibreProtocol() {
     disconnect();
+    if (tokener) {
+        json_tokener_free(tokener);
+    }
 }
 
 std::string CalibreProtocol::getPasswordHash(const std::string& password, 
@@ -146,16 +94,18 @@ std::string CalibreProtocol::getPasswordHash(const std::string& password,
         return "";
     }
     
-    SHA_CTX ctx;
-    SHA1_Init(&ctx);
-    SHA1_Update(&ctx, password.c_str(), password.length());
-    SHA1_Update(&ctx, challenge.c_str(), challenge.length());
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr);
+    EVP_DigestUpdate(ctx, password.c_str(), password.length());
+    EVP_DigestUpdate(ctx, challenge.c_str(), challenge.length());
     
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1_Final(hash, &ctx);
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLength = 0;
+    EVP_DigestFinal_ex(ctx, hash, &hashLength);
+    EVP_MD_CTX_free(ctx);
     
     std::stringstream ss;
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+    for (unsigned int i = 0; i < hashLength; i++) {
         ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
     }
     
@@ -224,6 +174,19 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
     CalibreOpcode opcode;
     std::string jsonData;
     
+    metrics.reset();
+    bookManager->startSession();
+    
+    if (tracingEnabled) {
+        char stamp[32];
+        time_t now = time(NULL);
+        struct tm tmInfo;
+        localtime_r(&now, &tmInfo);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tmInfo);
+        Tracer::begin(BookManager::getSystemPath(std::string(TRACE_FILE_PREFIX) + "-" + stamp + ".json"));
+    }
+    TraceSpan handshakeSpan("handshake", "protocol");
+    
     if (!network->receiveJSON(opcode, jsonData)) {
         errorMessage = "Failed to receive initialization request";
         return false;
@@ -234,6 +197,8 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
         return false;
     }
     
+    unsigned long long handshakeStart = SessionMetrics::nowUs();
+    
     json_object* request = parseJSON(jsonData);
     if (!request) {
         errorMessage = "Failed to parse initialization request";
@@ -333,6 +298,8 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
         return false;
     }
     
+    metrics.recordHandshake(SessionMetrics::nowUs() - handshakeStart);
+    
     connected = true;
     return true;
 }
@@ -340,11 +307,23 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
 void CalibreProtocol::handleMessages(std::function<void(const std::string&)> statusCallback) {
     int lastBooklistCount = 0;
     
+    // Reused for every message so their buffers keep their capacity
+    std::string jsonData;
+    SendBookRequest bookRequest;
+    static const std::string metadataStatus = "Received book metadata";
+    
     while (connected && network->isConnected()) {
         CalibreOpcode opcode;
-        std::string jsonData;
+        bool received;
+        messageArena.reset();
+        unsigned long long bytesInStart = network->getBytesReceived();
         
-        if (!network->receiveJSON(opcode, jsonData)) {
+        {
+            MetricsPhaseScope phase(metrics, PHASE_IDLE);
+            received = network->receiveJSON(opcode, jsonData);
+        }
+        
+        if (!received) {
             if (network->isConnected()) {
                 logProto(LOG_ERROR, "Failed to receive message");
                 errorMessage = "Connection lost";
@@ -355,8 +334,26 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
             break;
         }
         
-        json_object* args = parseJSON(jsonData);
-        if (!args) {
+        TraceSpan messageSpan(getOpcodeName(opcode), "protocol");
+        unsigned long long messageStart = SessionMetrics::nowUs();
+        unsigned long long bytesOutStart = network->getBytesSent();
+        
+        // Book transfers skip the json-c DOM; everything else still goes through it
+        json_object* args = NULL;
+        bool pulled = false;
+        {
+            MetricsPhaseScope phase(metrics, PHASE_PARSE);
+            bookRequest.clear();
+            if (opcode == SEND_BOOK) {
+                pulled = pullSendBook(jsonData, bookRequest);
+            } else if (opcode == SEND_BOOK_METADATA) {
+                pulled = pullSendBookMetadata(jsonData, bookRequest.metadata);
+            }
+            if (!pulled) {
+                args = parseJSON(jsonData);
+            }
+        }
+        if (!pulled && !args) {
             logProto(LOG_ERROR, "Failed to parse JSON for opcode %d", (int)opcode);
             sendErrorResponse("Failed to parse request");
             continue;
@@ -365,6 +362,7 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
         bool shouldDisconnect = false;
         bool handlerSuccess = true;
         
+        metrics.enterPhase(PHASE_HANDLER);
         switch (opcode) {
             case SET_CALIBRE_DEVICE_INFO:
                 handlerSuccess = handleSetCalibreInfo(args);
@@ -398,6 +396,16 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
                 break;
                 
             case SEND_BOOKLISTS: {
+                // End of a batch: one library rescan for all of its books,
+                // once they are in the DB
+                bookReadyNotifier.setTransferActive(false);
+                {
+                    MetricsPhaseScope phase(metrics, PHASE_DB);
+                    bookFinalizer.flush();
+                    dbWorker.flush();
+                }
+                reportFailedBooks();
+                bookReadyNotifier.flush();
                 handlerSuccess = handleSendBooklists(args);
                 statusCallback("Processing booklists");
                 
@@ -412,7 +420,8 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
             }
                 
             case SEND_BOOK:
-                handlerSuccess = handleSendBook(args);
+                bookReadyNotifier.setTransferActive(true);
+                handlerSuccess = pulled ? handleSendBook(bookRequest) : handleSendBook(args);
                 if (handlerSuccess) {
                     statusCallback("BOOK_RECEIVED");
                 } else {
@@ -421,8 +430,9 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
                 break;
                 
             case SEND_BOOK_METADATA:
-                handlerSuccess = handleSendBookMetadata(args);
-                statusCallback("Received book metadata");
+                handlerSuccess = pulled ? handleSendBookMetadata(bookRequest.metadata)
+                                        : handleSendBookMetadata(args);
+                statusCallback(metadataStatus);
                 break;
                 
             case DELETE_BOOK:
@@ -456,8 +466,15 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
                 break;
         }
         
+        metrics.leavePhase();
+        
         freeJSON(args);
         
+        metrics.recordMessage(opcode,
+                              network->getBytesReceived() - bytesInStart,
+                              network->getBytesSent() - bytesOutStart,
+                              SessionMetrics::nowUs() - messageStart);
+        
         if (!handlerSuccess) {
             logProto(LOG_ERROR, "Handler failed for opcode %d", (int)opcode);
         }
@@ -498,14 +515,55 @@ void CalibreProtocol::disconnect() {
         connected = false;
     }
     
-    if (currentBookFile) {
-        iv_fclose(currentBookFile);
-        currentBookFile = nullptr;
+    if (bookWriter) {
+        bookWriter->abort();
+    }
+    
+    {
+        MetricsPhaseScope phase(metrics, PHASE_DB);
+        bookFinalizer.stop();
+        dbWorker.stop();
+    }
+    reportFailedBooks();
+    bookFinalizer.resetCounters();
+    metrics.recordDbWorker(dbWorker.getOperations(), dbWorker.getBusyUs(), dbWorker.getMaxQueued());
+    metrics.recordCheckpoints(dbWorker.getCheckpoints(), dbWorker.getCheckpointUs(),
+                              dbWorker.getMaxWalPages());
+    dbWorker.resetCounters();
+    bookManager->closeReaders();
+    DbLockStats locks = BookManager::getLockStats();
+    metrics.recordDbLocks(locks.waits, locks.retries, locks.waitUs, locks.timeouts);
+    BookManager::resetLockStats();
+    
+    coverWriter.finish();
+    bookReadyNotifier.setTransferActive(false);
+    bookReadyNotifier.stop();
+    metrics.recordBookReady(bookReadyNotifier.getNotified(), bookReadyNotifier.getFlushes(),
+                            bookReadyNotifier.getFlushesDuringTransfer());
+    bookReadyNotifier.resetCounters();
+    
+    if (cacheManager) {
+        MetricsPhaseScope phase(metrics, PHASE_DB);
+        saveSessionIndexes();
     }
+    listedStorages.clear();
     
     if (cacheManager) {
+        MetricsPhaseScope phase(metrics, PHASE_DISK);
+        if (readSyncListed > 0) cacheManager->setSyncWatermark(readSyncListed);
         cacheManager->saveCache();
     }
+    readSyncSince = -1;
+    readSyncListed = 0;
+    
+    if (metrics.hasData()) {
+        metrics.appendSummary(BookManager::getSystemPath(METRICS_FILE), deviceName);
+        metrics.reset();
+    }
+    
+    if (Tracer::isActive()) {
+        Tracer::end();
+    }
 }
 
 bool CalibreProtocol::handleSetCalibreInfo(json_object* args) {
@@ -517,7 +575,7 @@ bool CalibreProtocol::handleSetCalibreInfo(json_object* args) {
 
 bool CalibreProtocol::handleTotalSpace(json_object* args) {
     struct statvfs stat;
-    if (statvfs("/mnt/ext1", &stat) != 0) {
+    if (statvfs(FLASHDIR, &stat) != 0) {
         return sendErrorResponse("Failed to get total space");
     }
     
@@ -534,7 +592,7 @@ bool CalibreProtocol::handleTotalSpace(json_object* args) {
 
 bool CalibreProtocol::handleFreeSpace(json_object* args) {
     struct statvfs stat;
-    if (statvfs("/mnt/ext1", &stat) != 0) {
+    if (statvfs(FLASHDIR, &stat) != 0) {
         return sendErrorResponse("Failed to get free space");
     }
     
@@ -564,23 +622,16 @@ bool CalibreProtocol::handleGetBookCount(json_object* args) {
         if (card) requestedCard = card;
     }
     
-    std::vector<BookMetadata> allBooks = bookManager->getAllBooks();
-    
     sessionBooks.clear();
-    for (const auto& book : allBooks) {
-        std::string bookLocation = "main";
-        std::string fullPath = bookManager->getBookFilePath(book.lpath);
-        
-        if (fullPath.find(SDCARDDIR) == 0) {
-            bookLocation = "carda";
-        }
-        
-        if (requestedCard.empty()) {
-            if (bookLocation == "main") {
-                sessionBooks.push_back(book);
-            }
-        } else if (requestedCard == bookLocation) {
-            sessionBooks.push_back(book);
+    time_t listedAt = time(NULL);
+    if (requestedCard.empty() || requestedCard == "main" || requestedCard == "carda") {
+        TraceSpan span("getAllBooks", "db");
+        MetricsPhaseScope phase(metrics, PHASE_DB);
+        bookFinalizer.flush();
+        dbWorker.flush();
+        const StorageContext& storage = bookManager->getStorage(requestedCard);
+        if (!loadSessionIndex(listStorage(storage))) {
+            sessionBooks = bookManager->getAllBooks(storage);
         }
     }
     
@@ -592,13 +643,30 @@ bool CalibreProtocol::handleGetBookCount(json_object* args) {
         useCache = json_object_get_boolean(cacheObj);
     }
     
+    if (cacheManager && readSyncSince < 0) {
+        readSyncSince = cacheManager->getSyncWatermark();
+    }
+    
+    // Read state is sent for books read on the device since the watermark or
+    // differing from what Calibre last knew (its own sync, or our last report)
+    std::vector<char> readChanged(count, 1);
+    int changedCount = count;
+    
     if (cacheManager) {
         int matched = 0;
-        for (auto& book : sessionBooks) {
+        for (int i = 0; i < count; i++) {
+            BookMetadata& book = sessionBooks[i];
             BookMetadata cachedMeta;
             if (cacheManager->getCachedMetadata(book.lpath, cachedMeta)) {
                 bool usedCache = false;
                 
+                if (readSyncSince > 0 && book.isRead == cachedMeta.isRead &&
+                    book.lastReadDate == cachedMeta.lastReadDate &&
+                    (!book.isRead || book.lastReadTime < readSyncSince)) {
+                    readChanged[i] = 0;
+                    changedCount--;
+                }
+                
                 if (!cachedMeta.uuid.empty()) {
                     book.uuid = cachedMeta.uuid;
                     usedCache = true;
@@ -614,8 +682,8 @@ bool CalibreProtocol::handleGetBookCount(json_object* args) {
         logProto(LOG_INFO, "UUID & Time Patching: %d/%d books matched in cache", matched, count);
     }
     
-    logProto(LOG_INFO, "GetBookCount for %s: %d books, useCache=%d", 
-             requestedCard.empty() ? "main" : requestedCard.c_str(), count, useCache);
+    logProto(LOG_INFO, "GetBookCount for %s: %d books, useCache=%d, read state changed: %d", 
+             requestedCard.empty() ? "main" : requestedCard.c_str(), count, useCache, changedCount);
 
     json_object* response = json_object_new_object();
     json_object_object_add(response, "count", json_object_new_int(count));
@@ -628,28 +696,117 @@ bool CalibreProtocol::handleGetBookCount(json_object* args) {
     }
     freeJSON(response);
     
+    TraceSpan streamSpan("booklist stream", "protocol");
+    streamSpan.setArg("count", (long long)count);
+    streamSpan.setArg("cached", (long long)useCache);
+    
     for (int i = 0; i < count; i++) {
-        json_object* bookJson = NULL;
-        
-        if (useCache) {
-            bookJson = cachedMetadataToJson(sessionBooks[i], i);
-        } else {
-            bookJson = metadataToJson(sessionBooks[i]);
-            json_object_object_add(bookJson, "priKey", json_object_new_int(i));
-        }
-        
-        std::string bookStr = jsonToString(bookJson);
-        if (!network->sendJSON(OK, bookStr.c_str())) {
-            freeJSON(bookJson);
+        if (!sendBookJson(sessionBooks[i], useCache, i, readChanged[i] != 0)) {
             return false;
         }
-        freeJSON(bookJson);
+    }
+    
+    // Calibre now has these read states
+    if (cacheManager) {
+        for (int i = 0; i < count; i++) {
+            if (!readChanged[i]) continue;
+            const BookMetadata& book = sessionBooks[i];
+            cacheManager->updateReadState(book.lpath, book.isRead, book.lastReadDate);
+        }
+        if (readSyncListed == 0) readSyncListed = listedAt;
     }
     
     return true;
 }
 
-static std::string cleanCollectionName(const std::string& rawName) {
+CalibreProtocol::ListedStorage& CalibreProtocol::listStorage(const StorageContext& storage) {
+    for (ListedStorage& listed : listedStorages) {
+        if (listed.storage == &storage) return listed;
+    }
+    listedStorages.push_back(ListedStorage());
+    ListedStorage& listed = listedStorages.back();
+    listed.storage = &storage;
+    return listed;
+}
+
+// The booklist saved by an earlier session, if neither the library DB nor
+// the book directories changed since
+bool CalibreProtocol::loadSessionIndex(ListedStorage& listed) {
+    listed.fromIndex = false;
+    if (!cacheManager) return false;
+    
+    const StorageContext& storage = *listed.storage;
+    std::string fingerprint;
+    long long dataVersion;
+    if (!cacheManager->getSessionIndex(storage.storageId, sessionBooks, fingerprint, dataVersion)) {
+        return false;
+    }
+    listed.dataVersion = bookManager->getDataVersion();
+    listed.dbState = bookManager->getDbFingerprint();
+    listed.directories.clear();
+    bool current = (dataVersion < 0 || listed.dataVersion == dataVersion) &&
+                   listed.dbState +
+                   bookManager->getDirectoryFingerprint(storage, sessionBooks, &listed.directories) == fingerprint;
+    if (!current) {
+        logProto(LOG_INFO, "Library changed since the saved booklist of %s", storage.name.c_str());
+        sessionBooks.clear();
+        return false;
+    }
+    logProto(LOG_INFO, "Library unchanged, %s booklist from the session index", storage.name.c_str());
+    listed.fromIndex = true;
+    return true;
+}
+
+// Brings the saved booklists up to date with what this session wrote. The
+// DB state is taken before listing and checked again after: if the library
+// changed in between, nothing is saved rather than a listing that may not
+// match its fingerprint. Directories stat'ed when the booklist was loaded
+// are only looked at again where a book was written or deleted; one changed
+// otherwise since keeps its old stamp, which the next load sees as a change.
+void CalibreProtocol::saveSessionIndexes() {
+    for (ListedStorage& listed : listedStorages) {
+        const StorageContext* storage = listed.storage;
+        long long version = bookManager->getDataVersion();
+        std::string dbState = bookManager->getDbFingerprint();
+        
+        if (listed.fromIndex && version == listed.dataVersion && dbState == listed.dbState) {
+            continue; // the saved booklist still holds
+        }
+        
+        std::vector<BookMetadata> books = bookManager->getAllBooks(*storage);
+        if (version < 0 || bookManager->getDataVersion() != version ||
+            bookManager->getDbFingerprint() != dbState) {
+            logProto(LOG_INFO, "Library changing, %s booklist not saved", storage->name.c_str());
+            cacheManager->dropSessionIndex(storage->storageId);
+            continue;
+        }
+        cacheManager->storeSessionIndex(storage->storageId, books,
+                                        dbState + bookManager->getDirectoryFingerprint(
+                                            *storage, books, &listed.directories),
+                                        version);
+    }
+}
+
+// A book written or deleted changed the directories on its path
+void CalibreProtocol::forgetBookDirectories(const StorageContext& storage, const std::string& lpath) {
+    for (ListedStorage& listed : listedStorages) {
+        if (listed.storage == &storage) {
+            BookManager::forgetDirectoryStamps(storage, lpath, listed.directories);
+        }
+    }
+}
+
+// Books that failed to store after they were acknowledged: they are not in
+// the DB, so the next booklist leaves them out and Calibre resends them
+void CalibreProtocol::reportFailedBooks() {
+    std::vector<std::string> failed = bookFinalizer.takeFailures();
+    for (const std::string& lpath : failed) {
+        logProto(LOG_ERROR, "Book failed to store, Calibre will resend it: %s", lpath.c_str());
+    }
+    booksReceivedInSession -= (int)failed.size();
+}
+
+std::string CalibreProtocol::cleanCollectionName(const std::string& rawName) {
     if (rawName.empty() || rawName.back() != ')') {
         return rawName;
     }
@@ -688,159 +845,7 @@ bool CalibreProtocol::handleSendBooklists(json_object* args) {
                 cleanName.c_str(), (int)lpaths.size());
     }
     
-    std::map<std::string, std::set<std::string>> deviceCollections;
-    sqlite3* db = bookManager->openDB();
-    if (!db) {
-        logProto(LOG_ERROR, "Failed to open DB for collection sync");
-        return false;
-    }
-    
-    const char* sql = 
-        "SELECT bs.name, f.filename, fo.name "
-        "FROM bookshelfs bs "
-        "JOIN bookshelfs_books bb ON bs.id = bb.bookshelfid "
-        "JOIN books_impl b ON bb.bookid = b.id "
-        "JOIN files f ON b.id = f.book_id "
-        "JOIN folders fo ON f.folder_id = fo.id "
-        "WHERE bs.is_deleted = 0 AND bb.is_deleted = 0";
-    
-    StmtHandle stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, stmt.ptr(), nullptr) == SQLITE_OK) {
-        while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
-            const char* shelfName = (const char*)sqlite3_column_text(stmt.get(), 0);
-            const char* fileName = (const char*)sqlite3_column_text(stmt.get(), 1);
-            const char* folderName = (const char*)sqlite3_column_text(stmt.get(), 2);
-            
-            if (shelfName && fileName && folderName) {
-                std::string fullPath = std::string(folderName) + "/" + fileName;
-                
-                std::string lpath = fullPath;
-                if (lpath.find("/mnt/ext1/") == 0) {
-                    lpath = lpath.substr(10);
-                }
-                
-                deviceCollections[shelfName].insert(lpath);
-            }
-        }
-    }
-    
-    logProto(LOG_INFO, "Found %d collections on device", (int)deviceCollections.size());
-    
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-    time_t now = time(NULL);
-    
-    for (const auto& calibreEntry : calibreCollections) {
-        const std::string& collectionName = calibreEntry.first;
-        const std::set<std::string>& calibreFiles = calibreEntry.second;
-        
-        int shelfId = bookManager->getOrCreateBookshelf(db, collectionName);
-        if (shelfId == -1) {
-            logProto(LOG_ERROR, "Failed to get/create shelf: %s", collectionName.c_str());
-            continue;
-        }
-        
-        auto deviceIt = deviceCollections.find(collectionName);
-        
-        if (deviceIt != deviceCollections.end()) {
-            const std::set<std::string>& deviceFiles = deviceIt->second;
-            
-            std::vector<std::string> toAdd;
-            std::set_difference(calibreFiles.begin(), calibreFiles.end(),
-                              deviceFiles.begin(), deviceFiles.end(),
-                              std::back_inserter(toAdd));
-            
-            std::vector<std::string> toRemove;
-            std::set_difference(deviceFiles.begin(), deviceFiles.end(),
-                              calibreFiles.begin(), calibreFiles.end(),
-                              std::back_inserter(toRemove));
-            
-            logProto(LOG_DEBUG, "Collection '%s': %d to add, %d to remove", 
-                    collectionName.c_str(), (int)toAdd.size(), (int)toRemove.size());
-            
-            if (!toAdd.empty()) {
-                const char* insertSql = 
-                    "INSERT OR IGNORE INTO bookshelfs_books (bookshelfid, bookid, is_deleted, ts) "
-                    "VALUES (?, ?, 0, ?)";
-                StmtHandle insertStmt;
-                if (sqlite3_prepare_v2(db, insertSql, -1, insertStmt.ptr(), nullptr) == SQLITE_OK) {
-                    for (const std::string& lpath : toAdd) {
-                        int bookId = bookManager->findBookIdByPath(db, lpath);
-                        if (bookId != -1) {
-                            sqlite3_reset(insertStmt.get());
-                            sqlite3_bind_int(insertStmt.get(), 1, shelfId);
-                            sqlite3_bind_int(insertStmt.get(), 2, bookId);
-                            sqlite3_bind_int64(insertStmt.get(), 3, now);
-                            sqlite3_step(insertStmt.get());
-                        }
-                    }
-                }
-            }
-            
-            if (!toRemove.empty()) {
-                const char* deleteSql = 
-                    "UPDATE bookshelfs_books SET is_deleted = 1, ts = ? "
-                    "WHERE bookshelfid = ? AND bookid = ?";
-                StmtHandle deleteStmt;
-                if (sqlite3_prepare_v2(db, deleteSql, -1, deleteStmt.ptr(), nullptr) == SQLITE_OK) {
-                    for (const std::string& lpath : toRemove) {
-                        int bookId = bookManager->findBookIdByPath(db, lpath);
-                        if (bookId != -1) {
-                            sqlite3_reset(deleteStmt.get());
-                            sqlite3_bind_int64(deleteStmt.get(), 1, now);
-                            sqlite3_bind_int(deleteStmt.get(), 2, shelfId);
-                            sqlite3_bind_int(deleteStmt.get(), 3, bookId);
-                            sqlite3_step(deleteStmt.get());
-                        }
-                    }
-                }
-            }
-            
-            deviceCollections.erase(deviceIt);
-            
-        } else {
-            logProto(LOG_INFO, "Creating new collection: %s with %d books", 
-                    collectionName.c_str(), (int)calibreFiles.size());
-            
-            const char* insertSql = 
-                "INSERT OR IGNORE INTO bookshelfs_books (bookshelfid, bookid, is_deleted, ts) "
-                "VALUES (?, ?, 0, ?)";
-            StmtHandle insertStmt;
-            if (sqlite3_prepare_v2(db, insertSql, -1, insertStmt.ptr(), nullptr) == SQLITE_OK) {
-                for (const std::string& lpath : calibreFiles) {
-                    int bookId = bookManager->findBookIdByPath(db, lpath);
-                    if (bookId != -1) {
-                        sqlite3_reset(insertStmt.get());
-                        sqlite3_bind_int(insertStmt.get(), 1, shelfId);
-                        sqlite3_bind_int(insertStmt.get(), 2, bookId);
-                        sqlite3_bind_int64(insertStmt.get(), 3, now);
-                        sqlite3_step(insertStmt.get());
-                    }
-                }
-            }
-        }
-    }
-    
-    for (const auto& deviceEntry : deviceCollections) {
-        const std::string& collectionName = deviceEntry.first;
-        
-        logProto(LOG_INFO, "Removing collection no longer in Calibre: %s", 
-                collectionName.c_str());
-        
-        const char* deleteSql = "UPDATE bookshelfs SET is_deleted = 1, ts = ? WHERE name = ?";
-        StmtHandle deleteStmt;
-        if (sqlite3_prepare_v2(db, deleteSql, -1, deleteStmt.ptr(), nullptr) == SQLITE_OK) {
-            sqlite3_bind_int64(deleteStmt.get(), 1, now);
-            sqlite3_bind_text(deleteStmt.get(), 2, collectionName.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_step(deleteStmt.get());
-        }
-    }
-    
-    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
-    sqlite3_exec(db, "PRAGMA wal_checkpoint(FULL)", NULL, NULL, NULL);
-    
-    bookManager->closeDB(db);
-    
-    logProto(LOG_INFO, "Collection sync completed");
+    dbWorker.syncCollections(calibreCollections);
     return true;
 }
 
@@ -917,6 +922,15 @@ BookMetadata CalibreProtocol::jsonToMetadata(json_object* obj) {
     if (json_object_object_get_ex(obj, "size", &val)) metadata.size = json_object_get_int64(val);
     if (json_object_object_get_ex(obj, "last_modified", &val)) metadata.lastModified = safeGetJsonString(val);
 
+    json_object* thumbnail = NULL;
+    if (json_object_object_get_ex(obj, "thumbnail", &thumbnail) &&
+        json_object_get_type(thumbnail) == json_type_array &&
+        json_object_array_length(thumbnail) >= 3) {
+        metadata.thumbnailWidth = json_object_get_int(json_object_array_get_idx(thumbnail, 0));
+        metadata.thumbnailHeight = json_object_get_int(json_object_array_get_idx(thumbnail, 1));
+        metadata.thumbnail = safeGetJsonString(json_object_array_get_idx(thumbnail, 2));
+    }
+
     // Extract ISBN from identifiers
     json_object* identifiers = NULL;
     if (json_object_object_get_ex(obj, "identifiers", &identifiers)) {
@@ -945,77 +959,314 @@ BookMetadata CalibreProtocol::jsonToMetadata(json_object* obj) {
     return metadata;
 }
 
-json_object* CalibreProtocol::metadataToJson(const BookMetadata& metadata) {
-    json_object* obj = json_object_new_object();
+bool CalibreProtocol::pullMetadata(JsonPullParser& parser, BookMetadata& metadata, bool withThumbnail) {
+    if (!parser.enterObject()) return false;
+    
+    const char* key;
+    size_t keyLength;
+    while (parser.nextKey(key, keyLength)) {
+        bool read = true;
+        
+        if (JsonPullParser::keyIs(key, keyLength, "uuid")) read = parser.readString(metadata.uuid);
+        else if (JsonPullParser::keyIs(key, keyLength, "title")) read = parser.readString(metadata.title);
+        else if (JsonPullParser::keyIs(key, keyLength, "author_sort")) read = parser.readString(metadata.authorSort);
+        else if (JsonPullParser::keyIs(key, keyLength, "lpath")) read = parser.readString(metadata.lpath);
+        else if (JsonPullParser::keyIs(key, keyLength, "series")) read = parser.readString(metadata.series);
+        else if (JsonPullParser::keyIs(key, keyLength, "series_index")) read = parser.readInt(metadata.seriesIndex);
+        else if (JsonPullParser::keyIs(key, keyLength, "size")) read = parser.readInt64(metadata.size);
+        else if (JsonPullParser::keyIs(key, keyLength, "last_modified")) read = parser.readString(metadata.lastModified);
+        else if (JsonPullParser::keyIs(key, keyLength, "authors")) {
+            if (parser.peek() == '[') {
+                metadata.authors.clear();
+                const char* author;
+                size_t authorLength;
+                int index = 0;
+                parser.enterArray();
+                while (parser.nextElement()) {
+                    if (!parser.readString(author, authorLength, messageArena)) return false;
+                    if (index++ > 0) metadata.authors += ", ";
+                    metadata.authors.append(author, authorLength);
+                }
+            } else {
+                read = parser.readString(metadata.authors);
+            }
+        }
+        else if (withThumbnail && JsonPullParser::keyIs(key, keyLength, "thumbnail")) {
+            // [width, height, "base64 jpeg"], sized by our coverHeight
+            if (!parser.skipNull()) {
+                if (!parser.enterArray() ||
+                    !parser.nextElement() || !parser.readInt(metadata.thumbnailWidth) ||
+                    !parser.nextElement() || !parser.readInt(metadata.thumbnailHeight) ||
+                    !parser.nextElement() || !parser.readString(metadata.thumbnail)) {
+                    return false;
+                }
+                while (parser.nextElement()) {
+                    if (!parser.skipValue()) return false;
+                }
+            }
+        }
+        else if (JsonPullParser::keyIs(key, keyLength, "identifiers")) {
+            if (!parser.skipNull() && parser.enterObject()) {
+                while (parser.nextKey(key, keyLength)) {
+                    if (JsonPullParser::keyIs(key, keyLength, "isbn")) {
+                        if (!parser.readString(metadata.isbn)) return false;
+                        logProto(LOG_DEBUG, "Extracted ISBN: %s", metadata.isbn.c_str());
+                    } else if (!parser.skipValue()) {
+                        return false;
+                    }
+                }
+            }
+        }
+        else if (JsonPullParser::keyIs(key, keyLength, "user_metadata")) {
+            // Only the configured sync columns are looked at, the rest is skipped unparsed
+            if (!parser.skipNull() && parser.enterObject()) {
+                while (parser.nextKey(key, keyLength)) {
+                    bool isRead = JsonPullParser::keyIs(key, keyLength, readColumn);
+                    bool isFavorite = JsonPullParser::keyIs(key, keyLength, favoriteColumn);
+                    bool isReadDate = JsonPullParser::keyIs(key, keyLength, readDateColumn);
+                    
+                    if (!isRead && !isFavorite && !isReadDate) {
+                        if (!parser.skipValue()) return false;
+                        continue;
+                    }
+                    if (parser.skipNull()) continue;
+                    
+                    if (!parser.enterObject()) return false;
+                    while (parser.nextKey(key, keyLength)) {
+                        if (!JsonPullParser::keyIs(key, keyLength, "#value#")) {
+                            read = parser.skipValue();
+                        } else if (isRead || isFavorite) {
+                            bool flag = false;
+                            read = parser.readBool(flag);
+                            if (isRead) metadata.isRead = flag;
+                            if (isFavorite) metadata.isFavorite = flag;
+                        } else {
+                            read = parser.readString(metadata.lastReadDate);
+                        }
+                        if (!read) return false;
+                    }
+                }
+            }
+        }
+        else read = parser.skipValue();
+        
+        if (!read || !parser.ok()) return false;
+    }
+    
+    return parser.ok();
+}
+
+bool CalibreProtocol::pullSendBook(const std::string& frame, SendBookRequest& request) {
+    JsonPullParser parser(frame.data(), frame.size());
     
-    json_object_object_add(obj, "uuid", json_object_new_string(metadata.uuid.c_str()));
-    json_object_object_add(obj, "title", json_object_new_string(metadata.title.c_str()));
-    json_object_object_add(obj, "authors", json_object_new_string(metadata.authors.c_str()));
-    json_object_object_add(obj, "lpath", json_object_new_string(metadata.lpath.c_str()));
-    json_object_object_add(obj, "last_modified", json_object_new_string(metadata.lastModified.c_str()));
-    json_object_object_add(obj, "size", json_object_new_int64(metadata.size));
+    // [opcode, {...}]
+    if (!parser.enterArray() || !parser.nextElement() || !parser.skipValue() ||
+        !parser.nextElement() || !parser.enterObject()) {
+        return false;
+    }
     
-    if (!metadata.series.empty()) {
-        json_object_object_add(obj, "series", json_object_new_string(metadata.series.c_str()));
-        json_object_object_add(obj, "series_index", json_object_new_int(metadata.seriesIndex));
+    bool hasLpath = false, hasLength = false, hasMetadata = false;
+    const char* key;
+    size_t keyLength;
+    while (parser.nextKey(key, keyLength)) {
+        bool read;
+        if (JsonPullParser::keyIs(key, keyLength, "lpath")) {
+            read = hasLpath = parser.readString(request.lpath);
+        } else if (JsonPullParser::keyIs(key, keyLength, "length")) {
+            read = hasLength = parser.readInt64(request.length);
+        } else if (JsonPullParser::keyIs(key, keyLength, "on_card")) {
+            read = parser.readString(request.onCard);
+        } else if (JsonPullParser::keyIs(key, keyLength, "metadata")) {
+            read = hasMetadata = pullMetadata(parser, request.metadata, true);
+        } else {
+            read = parser.skipValue();
+        }
+        if (!read) return false;
     }
     
-    json_object_object_add(obj, "_is_read_", json_object_new_boolean(metadata.isRead));
-    json_object_object_add(obj, "_sync_type_", json_object_new_int(1));
+    // Missing fields are reported by the json-c path
+    return parser.ok() && hasLpath && hasLength && hasMetadata;
+}
+
+bool CalibreProtocol::pullSendBookMetadata(const std::string& frame, BookMetadata& metadata) {
+    JsonPullParser parser(frame.data(), frame.size());
     
-    if (!metadata.lastReadDate.empty()) {
-        json_object_object_add(obj, "_last_read_date_", 
-                              json_object_new_string(metadata.lastReadDate.c_str()));
+    if (!parser.enterArray() || !parser.nextElement() || !parser.skipValue() ||
+        !parser.nextElement() || !parser.enterObject()) {
+        return false;
+    }
+    
+    bool hasData = false;
+    const char* key;
+    size_t keyLength;
+    while (parser.nextKey(key, keyLength)) {
+        bool read;
+        if (JsonPullParser::keyIs(key, keyLength, "data")) {
+            read = hasData = pullMetadata(parser, metadata, false);
+        } else {
+            read = parser.skipValue();
+        }
+        if (!read) return false;
     }
     
-    return obj;
+    return parser.ok() && hasData;
 }
 
-/* void CalibreProtocol::generateCoverCache(const std::string& filePath) {
-    logProto(LOG_INFO, "generateCoverCache() called for: %s", filePath.c_str());
+namespace {
 
-    if (filePath.empty()) {
-        logProto(LOG_ERROR, "generateCoverCache(): filePath is empty");
-        return;
-    }
+enum BookJsonKind {
+    BOOK_JSON_TEXT,
+    BOOK_JSON_INT,
+    BOOK_JSON_INT64,
+    BOOK_JSON_BOOL,
+    BOOK_JSON_SYNC_TYPE,
+    BOOK_JSON_EXTENSION,
+    BOOK_JSON_PRIKEY
+};
 
-    // Recommended dimensions for PocketBook cover cache to avoid resizing
-    const int coverWidth = 200; 
-    const int coverHeight = COVER_HEIGHT;
+enum {
+    BOOK_JSON_SKIP_EMPTY = 1,   // text field omitted when empty
+    BOOK_JSON_WITH_SERIES = 2,  // emitted only for books in a series
+    BOOK_JSON_READ_STATE = 4    // omitted for books whose read state Calibre has
+};
 
-    // GetBookCover allocates an ibitmap structure and its pixel buffer
-    ibitmap* cover = GetBookCover(filePath.c_str(), coverWidth, coverHeight);
+struct BookJsonField {
+    const char* key;
+    BookJsonKind kind;
+    int flags;
+    std::string BookMetadata::* text;
+    int BookMetadata::* number;
+    long long BookMetadata::* bigNumber;
+    bool BookMetadata::* flag;
+    const char* fallback;
+};
+
+constexpr BookJsonField textField(const char* key, std::string BookMetadata::* m,
+                                  int flags = 0, const char* fallback = nullptr) {
+    return BookJsonField{ key, BOOK_JSON_TEXT, flags, m, nullptr, nullptr, nullptr, fallback };
+}
+
+constexpr BookJsonField intField(const char* key, int BookMetadata::* m, int flags = 0) {
+    return BookJsonField{ key, BOOK_JSON_INT, flags, nullptr, m, nullptr, nullptr, nullptr };
+}
 
-    if (!cover) {
-        logProto(LOG_ERROR, "GetBookCover() returned NULL for %s", filePath.c_str());
-        // Notify system even if cover failed so it can try to parse it later
-        BookReady(filePath.c_str());
-        return;
+constexpr BookJsonField int64Field(const char* key, long long BookMetadata::* m) {
+    return BookJsonField{ key, BOOK_JSON_INT64, 0, nullptr, nullptr, m, nullptr, nullptr };
+}
+
+constexpr BookJsonField boolField(const char* key, bool BookMetadata::* m, int flags = 0) {
+    return BookJsonField{ key, BOOK_JSON_BOOL, flags, nullptr, nullptr, nullptr, m, nullptr };
+}
+
+constexpr BookJsonField specialField(const char* key, BookJsonKind kind, int flags = 0) {
+    return BookJsonField{ key, kind, flags, nullptr, nullptr, nullptr, nullptr, nullptr };
+}
+
+// Full entry: GET_BOOK_COUNT without cache and NOOP priKey requests
+constexpr BookJsonField FULL_BOOK_FIELDS[] = {
+    textField("uuid", &BookMetadata::uuid),
+    textField("title", &BookMetadata::title),
+    textField("authors", &BookMetadata::authors),
+    textField("lpath", &BookMetadata::lpath),
+    textField("last_modified", &BookMetadata::lastModified),
+    int64Field("size", &BookMetadata::size),
+    textField("series", &BookMetadata::series, BOOK_JSON_SKIP_EMPTY),
+    intField("series_index", &BookMetadata::seriesIndex, BOOK_JSON_WITH_SERIES),
+    boolField("_is_read_", &BookMetadata::isRead),
+    specialField("_sync_type_", BOOK_JSON_SYNC_TYPE),
+    textField("_last_read_date_", &BookMetadata::lastReadDate, BOOK_JSON_SKIP_EMPTY),
+    specialField("priKey", BOOK_JSON_PRIKEY)
+};
+
+// Short entry when calibre uses its own metadata cache
+constexpr BookJsonField CACHED_BOOK_FIELDS[] = {
+    specialField("priKey", BOOK_JSON_PRIKEY),
+    textField("uuid", &BookMetadata::uuid),
+    textField("lpath", &BookMetadata::lpath),
+    textField("last_modified", &BookMetadata::lastModified, 0, "1970-01-01T00:00:00+00:00"),
+    specialField("extension", BOOK_JSON_EXTENSION),
+    boolField("_is_read_", &BookMetadata::isRead, BOOK_JSON_READ_STATE),
+    specialField("_sync_type_", BOOK_JSON_SYNC_TYPE, BOOK_JSON_READ_STATE),
+    textField("_last_read_date_", &BookMetadata::lastReadDate, BOOK_JSON_SKIP_EMPTY | BOOK_JSON_READ_STATE)
+};
+
+template <size_t N>
+void writeBookFields(JsonWriter& writer, const BookJsonField (&fields)[N],
+                     const BookMetadata& metadata, int priKey, bool readState) {
+    writer.beginObject();
+    
+    for (size_t i = 0; i < N; i++) {
+        const BookJsonField& f = fields[i];
+        if ((f.flags & BOOK_JSON_WITH_SERIES) && metadata.series.empty()) continue;
+        if ((f.flags & BOOK_JSON_READ_STATE) && !readState) continue;
+        
+        switch (f.kind) {
+            case BOOK_JSON_TEXT: {
+                const std::string& text = metadata.*(f.text);
+                if (text.empty()) {
+                    if (f.flags & BOOK_JSON_SKIP_EMPTY) break;
+                    if (f.fallback) {
+                        writer.key(f.key);
+                        writer.value(f.fallback, strlen(f.fallback));
+                        break;
+                    }
+                }
+                writer.field(f.key, text);
+                break;
+            }
+            case BOOK_JSON_INT:
+                writer.field(f.key, metadata.*(f.number));
+                break;
+            case BOOK_JSON_INT64:
+                writer.field(f.key, metadata.*(f.bigNumber));
+                break;
+            case BOOK_JSON_BOOL:
+                writer.field(f.key, metadata.*(f.flag));
+                break;
+            case BOOK_JSON_SYNC_TYPE:
+                writer.field(f.key, 1);
+                break;
+            case BOOK_JSON_EXTENSION: {
+                size_t pos = metadata.lpath.rfind('.');
+                writer.key(f.key);
+                if (pos != std::string::npos) {
+                    writer.value(metadata.lpath.data() + pos + 1, metadata.lpath.size() - pos - 1);
+                } else {
+                    writer.value("", 0);
+                }
+                break;
+            }
+            case BOOK_JSON_PRIKEY:
+                if (priKey >= 0) writer.field(f.key, priKey);
+                break;
+        }
     }
+    
+    writer.endObject();
+}
 
-    // In PocketBook SDK, CoverCachePut returns 0 on success.
-    // CCS_ADOBE is often more universal for the system Library app in SDK 6.x
-    int result = CoverCachePut(CCS_FBREADER, filePath.c_str(), cover);
+} // namespace
 
-    if (result == 0) {
-        logProto(LOG_INFO, "Cover cache created successfully (code %d)", result);
+void CalibreProtocol::writeBookJson(std::string& out, const BookMetadata& metadata,
+                                    bool cached, int priKey, bool readState) {
+    JsonWriter writer(out);
+    if (cached) {
+        writeBookFields(writer, CACHED_BOOK_FIELDS, metadata, priKey, readState);
     } else {
-        // Error 11 often means the cache system is busy or directory is inaccessible
-        logProto(LOG_ERROR, "CoverCachePut() failed with code %d", result);
+        writeBookFields(writer, FULL_BOOK_FIELDS, metadata, priKey, true);
     }
+}
 
-    // IMPORTANT: Use iv_freebitmap instead of free() to avoid memory leaks
-    // of the underlying pixel data buffer.
-    iv_freebitmap(cover);
-
-    // BookReady triggers the system indexer to notice the new/updated file
-    logProto(LOG_DEBUG, "Calling BookReady() for %s", filePath.c_str());
-    BookReady(filePath.c_str());
-} */
+bool CalibreProtocol::sendBookJson(const BookMetadata& metadata, bool cached, int priKey,
+                                   bool readState) {
+    jsonBuffer.clear();
+    writeBookJson(jsonBuffer, metadata, cached, priKey, readState);
+    
+    MetricsPhaseScope phase(metrics, PHASE_SEND);
+    return network->sendJSON(OK, jsonBuffer.data(), jsonBuffer.size());
+}
 
 bool CalibreProtocol::handleSendBook(json_object* args) {
-    logProto(LOG_INFO, "Starting handleSendBook");
-    
     json_object* metadataObj = NULL;
     json_object* lpathObj = NULL;
     json_object* lengthObj = NULL;
@@ -1027,13 +1278,23 @@ bool CalibreProtocol::handleSendBook(json_object* args) {
         return sendErrorResponse("Missing required fields");
     }
     
-    currentOnCard = "";
+    SendBookRequest request;
+    request.lpath = safeGetJsonString(lpathObj);
+    request.length = json_object_get_int64(lengthObj);
     if (json_object_object_get_ex(args, "on_card", &onCardObj)) {
-        const char* card = json_object_get_string(onCardObj);
-        if (card) {
-            currentOnCard = card;
-            logProto(LOG_INFO, "Book target storage: %s", currentOnCard.c_str());
-        }
+        request.onCard = safeGetJsonString(onCardObj);
+    }
+    request.metadata = jsonToMetadata(metadataObj);
+    
+    return handleSendBook(request);
+}
+
+bool CalibreProtocol::handleSendBook(SendBookRequest& request) {
+    logProto(LOG_INFO, "Starting handleSendBook");
+    
+    currentOnCard = request.onCard;
+    if (!currentOnCard.empty()) {
+        logProto(LOG_INFO, "Book target storage: %s", currentOnCard.c_str());
     }
     
     if (currentOnCard == "carda") {
@@ -1041,39 +1302,56 @@ bool CalibreProtocol::handleSendBook(json_object* args) {
             logProto(LOG_ERROR, "SD Card requested but not available");
             return sendErrorResponse("SD Card not available");
         }
-        bookManager->setTargetStorage("carda");
-    } else {
-        bookManager->setTargetStorage("main");
     }
+    const StorageContext& storage = bookManager->getStorage(currentOnCard);
     
-    currentBookLpath = json_object_get_string(lpathObj);
-    currentBookLength = json_object_get_int64(lengthObj);
+    currentBookLpath = request.lpath;
+    currentBookLength = request.length;
     currentBookReceived = 0;
     
     logProto(LOG_INFO, "Receiving book: %s (%lld bytes) to %s", 
             currentBookLpath.c_str(), currentBookLength,
-            bookManager->getCurrentStorage().c_str());
+            storage.name.c_str());
     
-    BookMetadata metadata = jsonToMetadata(metadataObj);
+    BookMetadata& metadata = request.metadata;
     metadata.lpath = currentBookLpath;
     metadata.size = currentBookLength;
     
-    std::string filePath = bookManager->getBookFilePath(currentBookLpath);
+    std::string filePath = storage.getBookFilePath(currentBookLpath);
     logProto(LOG_DEBUG, "Target path: %s", filePath.c_str());
     
-    size_t pos = filePath.rfind('/');
-    if (pos != std::string::npos) {
-        std::string dir = filePath.substr(0, pos);
-        if (recursiveMkdir(dir) != 0) {
+    // A resend of a book still being finalized reuses its part file
+    bookFinalizer.waitFor(currentBookLpath);
+    if (!bookWriter) {
+        bookWriter = bookFinalizer.takeWriter();
+    }
+    
+    {
+        MetricsPhaseScope phase(metrics, PHASE_DISK);
+        size_t pos = filePath.rfind('/');
+        std::string dir = pos != std::string::npos ? filePath.substr(0, pos) : std::string();
+        if (!bookManager->ensureDirectory(storage, dir)) {
             logProto(LOG_ERROR, "Failed to create directory structure for book");
             return sendErrorResponse("Failed to create directory");
         }
+        
+        // Re-sent books are compared with what is already on disk instead of rewritten
+        std::string reference = findReferenceFile(storage, filePath, currentBookLpath, currentBookLength);
+        if (!reference.empty()) {
+            logProto(LOG_DEBUG, "Comparing with %s", reference.c_str());
+        }
+        if (!bookWriter->open(filePath, currentBookLpath, currentBookLength, reference)) {
+            // A directory remembered this session may have been removed behind our back
+            bookManager->forgetDirectories(storage);
+            if (bookManager->ensureDirectory(storage, dir)) {
+                bookWriter->open(filePath, currentBookLpath, currentBookLength, reference);
+            }
+        }
     }
-    
-    currentBookFile = iv_fopen(filePath.c_str(), "wb");
-    if (!currentBookFile) {
-        logProto(LOG_ERROR, "Failed to open file for writing!");
-        return sendErrorResponse("Failed to create book file");
+    if (!bookWriter->isOpen()) {
+        logProto(LOG_ERROR, "Failed to open file for writing: %s", bookWriter->getError().c_str());
+        return sendErrorResponse(bookWriter->getError().empty() ? "Failed to create book file"
+                                                               : bookWriter->getError());
     }
     
     json_object* response = json_object_new_object();
@@ -1082,94 +1360,125 @@ bool CalibreProtocol::handleSendBook(json_object* args) {
     if (!sendOKResponse(response)) {
         logProto(LOG_ERROR, "Failed to send OK response");
         freeJSON(response);
-        if (currentBookFile) {
-            iv_fclose(currentBookFile);
-            currentBookFile = nullptr;
-        }
+        bookWriter->abort();
         return false;
     }
     freeJSON(response);
     
-    std::vector<char> buffer(BASE_PACKET_LEN);
+    if (transferBuffer.size() < BOOK_RECEIVE_CHUNK) {
+        transferBuffer.resize(BOOK_RECEIVE_CHUNK);
+    }
     
     logProto(LOG_DEBUG, "Starting binary transfer...");
     
+    TraceSpan transferSpan("book transfer", "io");
+    transferSpan.setArg("lpath", currentBookLpath);
+    transferSpan.setArg("bytes", currentBookLength);
+    unsigned long long netUsStart = metrics.getPhaseUs(PHASE_RECEIVE);
+    unsigned long long diskUsStart = metrics.getPhaseUs(PHASE_DISK);
+    
     while (currentBookReceived < currentBookLength) {
         size_t toRead = std::min((size_t)(currentBookLength - currentBookReceived), 
-                                (size_t)BASE_PACKET_LEN);
+                                BOOK_RECEIVE_CHUNK);
         
-        if (!network->receiveBinaryData(buffer.data(), toRead)) {
+        bool chunkReceived;
+        {
+            MetricsPhaseScope phase(metrics, PHASE_RECEIVE);
+            chunkReceived = network->receiveBinaryData(transferBuffer.data(), toRead);
+        }
+        if (!chunkReceived) {
             logProto(LOG_ERROR, "Network error during file transfer");
-            if (currentBookFile) {
-                iv_fclose(currentBookFile);
-                currentBookFile = nullptr;
-            }
+            bookWriter->abort();
             return false;
         }
         
-        size_t written = fwrite(buffer.data(), 1, toRead, currentBookFile);
-        if (written != toRead) {
-            logProto(LOG_ERROR, "Disk write error");
-            if (currentBookFile) {
-                iv_fclose(currentBookFile);
-                currentBookFile = nullptr;
-            }
+        bool written;
+        {
+            MetricsPhaseScope phase(metrics, PHASE_DISK);
+            written = bookWriter->write(transferBuffer.data(), toRead);
+        }
+        if (!written) {
+            logProto(LOG_ERROR, "Disk write error: %s", bookWriter->getError().c_str());
+            bookWriter->abort();
             return sendErrorResponse("Failed to write book data");
         }
         
         currentBookReceived += toRead;
     }
     
-    logProto(LOG_INFO, "Transfer complete.");
-    iv_fclose(currentBookFile);
-    currentBookFile = nullptr;
+    transferSpan.setArg("network_us", (long long)(metrics.getPhaseUs(PHASE_RECEIVE) - netUsStart));
+    transferSpan.setArg("disk_us", (long long)(metrics.getPhaseUs(PHASE_DISK) - diskUsStart));
     
-    bookManager->addBook(metadata);
-    
-    if (cacheManager) {
-        cacheManager->updateCache(metadata);
-    }
-    
-    // generateCoverCache(filePath);
-	BookReady(filePath.c_str());
+    // Closing the file, the DB insert, the cache and the cover happen in the
+    // background while the next message is read
+    forgetBookDirectories(storage, metadata.lpath);
+    bookFinalizer.submit(bookWriter, storage, filePath, metadata);
     
     booksReceivedInSession++;
-    logProto(LOG_INFO, "Book added to DB and cache.");
+    logProto(LOG_INFO, "Book received, finalizing.");
     
     return true;
 }
 
+// A file that probably holds the incoming bytes: the book already at filePath,
+// or another cached book of the same size. The latter only pays off as a hard
+// link; without them (FAT) comparing against it just adds reads.
+std::string CalibreProtocol::findReferenceFile(const StorageContext& storage, const std::string& filePath,
+                                               const std::string& lpath, long long length) {
+    struct stat st;
+    if (stat(filePath.c_str(), &st) == 0 && st.st_size == length) {
+        return filePath;
+    }
+    if (!cacheManager || length <= 0 || !storage.supportsHardLinks()) return "";
+    
+    std::string other = cacheManager->findSameContent(length, "", lpath);
+    if (other.empty()) return "";
+    std::string otherPath = storage.getBookFilePath(other);
+    if (stat(otherPath.c_str(), &st) == 0 && st.st_size == length) {
+        return otherPath;
+    }
+    return "";
+}
+
 bool CalibreProtocol::handleSendBookMetadata(json_object* args) {
     json_object* dataObj = NULL;
     if (!json_object_object_get_ex(args, "data", &dataObj)) {
         return sendErrorResponse("Missing metadata");
     }
     
-    BookMetadata metadata = jsonToMetadata(dataObj);
-    
+    return handleSendBookMetadata(jsonToMetadata(dataObj));
+}
+
+bool CalibreProtocol::handleSendBookMetadata(const BookMetadata& metadata) {
     logProto(LOG_INFO, "Syncing metadata for: %s (Read: %d, Date: %s)", 
              metadata.title.c_str(), metadata.isRead, metadata.lastReadDate.c_str());
     
-    if (bookManager->updateBookSync(metadata)) {
-        for(auto& b : sessionBooks) {
-            if (b.lpath == metadata.lpath) { 
-                b.isRead = metadata.isRead;
-                b.isFavorite = metadata.isFavorite;
-                b.lastReadDate = metadata.lastReadDate;
-                b.series = metadata.series;
-                b.seriesIndex = metadata.seriesIndex;
-                break;
-            }
+    {
+        MetricsPhaseScope phase(metrics, PHASE_DB);
+        if (!bookFinalizer.waitFor(metadata.lpath)) {
+            logProto(LOG_ERROR, "Metadata not synced, book failed to store: %s", metadata.lpath.c_str());
+            return true;
         }
-        
-        if (cacheManager) {
-            cacheManager->updateCache(metadata);
+        dbWorker.syncBook(bookManager->locateBook(metadata.lpath), metadata);
+    }
+    
+    // The DB update runs in the background; the booklist or the cache
+    // knowing the book stands in for its result
+    bool known = false;
+    for(auto& b : sessionBooks) {
+        if (b.lpath == metadata.lpath) { 
+            b.isRead = metadata.isRead;
+            b.isFavorite = metadata.isFavorite;
+            b.lastReadDate = metadata.lastReadDate;
+            b.series = metadata.series;
+            b.seriesIndex = metadata.seriesIndex;
+            known = true;
+            break;
         }
-
-		NotifyConfigChanged();
-        
-    } else {
-        logProto(LOG_ERROR, "Warning: Attempted to sync metadata for non-existent book");
+    }
+    
+    if (cacheManager && (known || !cacheManager->getUuidForLpath(metadata.lpath).empty())) {
+        cacheManager->updateCache(metadata);
     }
     
     return true;
@@ -1218,15 +1527,28 @@ bool CalibreProtocol::handleDeleteBook(json_object* args) {
     freeJSON(initialResponse);
     logProto(LOG_DEBUG, "Sent initial DELETE_BOOK acknowledgment");
     
-    // Now perform actual deletion and send individual responses
+    // Queue all deletions, then confirm each once it is done
+    std::vector<std::future<bool>> deletions;
+    deletions.reserve(booksToDelete.size());
+    for (size_t i = 0; i < booksToDelete.size(); i++) {
+        const std::string& lpath = booksToDelete[i].first;
+        MetricsPhaseScope phase(metrics, PHASE_DB);
+        bookFinalizer.waitFor(lpath);
+        const StorageContext& storage = bookManager->locateBook(lpath);
+        forgetBookDirectories(storage, lpath);
+        deletions.push_back(dbWorker.deleteBook(storage, lpath));
+    }
+    
     for (size_t i = 0; i < booksToDelete.size(); i++) {
         const std::string& lpath = booksToDelete[i].first;
         const std::string& uuid = booksToDelete[i].second;
         
         logProto(LOG_DEBUG, "Deleting book %d/%d: %s", (int)i+1, count, lpath.c_str());
         
-        // Perform deletion
-        bookManager->deleteBook(lpath);
+        {
+            MetricsPhaseScope phase(metrics, PHASE_DB);
+            deletions[i].wait();
+        }
         
         // Remove from cache
         if (cacheManager) {
@@ -1267,7 +1589,8 @@ bool CalibreProtocol::handleGetBookFileSegment(json_object* args) {
     }
     
     std::string lpath = json_object_get_string(lpathObj);
-    std::string filePath = bookManager->getBookFilePath(lpath);
+    bookFinalizer.waitFor(lpath);
+    std::string filePath = bookManager->locateBook(lpath).getBookFilePath(lpath);
     
     FileHandle file(filePath.c_str(), "rb");
     if (!file) {
@@ -1287,12 +1610,19 @@ bool CalibreProtocol::handleGetBookFileSegment(json_object* args) {
     }
     freeJSON(response);
     
-    std::vector<char> buffer(BASE_PACKET_LEN);
+    if (transferBuffer.size() < (size_t)BASE_PACKET_LEN) {
+        transferBuffer.resize(BASE_PACKET_LEN);
+    }
     
     while (!feof(file.get())) {
-        size_t read = fread(buffer.data(), 1, BASE_PACKET_LEN, file.get());
+        size_t read;
+        {
+            MetricsPhaseScope phase(metrics, PHASE_DISK);
+            read = fread(transferBuffer.data(), 1, BASE_PACKET_LEN, file.get());
+        }
         if (read > 0) {
-            if (!network->sendBinaryData(buffer.data(), read)) {
+            MetricsPhaseScope phase(metrics, PHASE_SEND);
+            if (!network->sendBinaryData(transferBuffer.data(), read)) {
                 return false;
             }
         }
@@ -1328,14 +1658,7 @@ bool CalibreProtocol::handleNoop(json_object* args) {
         // logProto(LOG_DEBUG, "Calibre requested details for book index: %d", index);
         
         if (index >= 0 && index < (int)sessionBooks.size()) {
-            json_object* bookJson = metadataToJson(sessionBooks[index]);
-            
-            if (sessionBooks[index].isRead) {
-                json_object_object_add(bookJson, "_is_read_", json_object_new_boolean(true));
-            }
-            
-            sendOKResponse(bookJson); // <--- ПРОБЛЕМА ЗДЕСЬ
-            freeJSON(bookJson);
+            sendBookJson(sessionBooks[index], false, -1);
         } else {
             logProto(LOG_ERROR, "Error: Requested priKey %d out of bounds", index);
             json_object* resp = json_object_new_object();
@@ -1358,11 +1681,15 @@ bool CalibreProtocol::handleNoop(json_object* args) {
     json_object* response = json_object_new_object();
     bool result = sendOKResponse(response);
     freeJSON(response);
+    
+    // Plain keep-alive: Calibre is idle, a good time to checkpoint the WAL
+    dbWorker.idle();
     return result;
 }
 
 bool CalibreProtocol::sendOKResponse(json_object* data) {
     std::string jsonStr = jsonToString(data);
+    MetricsPhaseScope phase(metrics, PHASE_SEND);
     return network->sendJSON(OK, jsonStr.c_str());
 }
 
@@ -1371,7 +1698,11 @@ bool CalibreProtocol::sendErrorResponse(const std::string& message) {
     json_object_object_add(error, "message", json_object_new_string(message.c_str()));
     
     std::string jsonStr = jsonToString(error);
-    bool result = network->sendJSON(ERROR_OPCODE, jsonStr.c_str());
+    bool result;
+    {
+        MetricsPhaseScope phase(metrics, PHASE_SEND);
+        result = network->sendJSON(ERROR_OPCODE, jsonStr.c_str());
+    }
     
     freeJSON(error);
     return result;
@@ -1393,8 +1724,13 @@ json_object* CalibreProtocol::parseJSON(const std::string& jsonStr) {
         return NULL;
     }
     
-    std::string dataStr = jsonStr.substr(dataStart + 1, dataEnd - dataStart - 1);
-    return json_tokener_parse(dataStr.c_str());
+    // Parse the body in place instead of copying it out of the frame
+    if (dataEnd <= dataStart || !tokener) {
+        return NULL;
+    }
+    json_tokener_reset(tokener);
+    return json_tokener_parse_ex(tokener, jsonStr.data() + dataStart + 1,
+                                 (int)(dataEnd - dataStart - 1));
 }
 
 void CalibreProtocol::freeJSON(json_object* obj) {
@@ -1402,38 +1738,3 @@ void CalibreProtocol::freeJSON(json_object* obj) {
         json_object_put(obj);
     }
 }
-
-json_object* CalibreProtocol::cachedMetadataToJson(const BookMetadata& metadata, int index) {
-    json_object* obj = json_object_new_object();
-    
-    json_object_object_add(obj, "priKey", json_object_new_int(index));
-    json_object_object_add(obj, "uuid", json_object_new_string(metadata.uuid.c_str()));
-    json_object_object_add(obj, "lpath", json_object_new_string(metadata.lpath.c_str()));
-    
-    if (!metadata.lastModified.empty()) {
-        json_object_object_add(obj, "last_modified", 
-                              json_object_new_string(metadata.lastModified.c_str()));
-    } else {
-        json_object_object_add(obj, "last_modified", 
-                              json_object_new_string("1970-01-01T00:00:00+00:00"));
-    }
-    
-    std::string ext = "";
-    size_t pos = metadata.lpath.rfind('.');
-    if (pos != std::string::npos) {
-        ext = metadata.lpath.substr(pos + 1);
-    }
-    json_object_object_add(obj, "extension", json_object_new_string(ext.c_str()));
-    
-    json_object_object_add(obj, "_is_read_", json_object_new_boolean(metadata.isRead));
-    json_object_object_add(obj, "_sync_type_", json_object_new_int(1));
-    
-    if (!metadata.lastReadDate.empty()) {
-        json_object_object_add(obj, "_last_read_date_", 
-                              json_object_new_string(metadata.lastReadDate.c_str()));
-    }
-    
-    return obj;
-
-}
-
@@ -4,11 +4,38 @@
 #include "network.h"
 #include "book_manager.h"
 #include "cache_manager.h"
+#include "metrics.h"
+#include "arena.h"
+#include "book_ready_notifier.h"
+#include "cover_writer.h"
+#include "book_file_writer.h"
+#include "db_worker.h"
+#include "book_finalizer.h"
 #include <string>
 #include <functional>
+#include <memory>
 #include <cstdio> 
 
 struct json_object;
+struct json_tokener;
+class JsonPullParser;
+
+// Fields of a SEND_BOOK request used by the handler
+struct SendBookRequest {
+    std::string lpath;
+    long long length;
+    std::string onCard;
+    BookMetadata metadata;
+    
+    SendBookRequest() : length(0) {}
+    
+    void clear() {
+        lpath.clear();
+        length = 0;
+        onCard.clear();
+        metadata.clear();
+    }
+};
 
 class CalibreProtocol {
 public:
@@ -30,6 +57,11 @@ public:
     // ДОБАВЛЕНО: Геттер для количества книг в последней партии
     int getLastBatchCount() const { return lastBatchCount; }
     
+    const SessionMetrics& getMetrics() const { return metrics; }
+    
+    // Write a Chrome trace_event file (TRACE_FILE_PREFIX-<time>.json) for each session
+    void setTracingEnabled(bool enabled) { tracingEnabled = enabled; }
+    
 private:
     NetworkManager* network;
     BookManager* bookManager;
@@ -38,6 +70,28 @@ private:
     std::string errorMessage;
     std::vector<BookMetadata> sessionBooks;
     
+    // Read states in the cached booklist only for books changed since the
+    // cache's sync watermark, read once per session (-1 until then). The
+    // first complete listing's time becomes the next watermark on disconnect.
+    time_t readSyncSince;
+    time_t readSyncListed;
+    
+    // Storages listed this session; their booklists are saved on disconnect
+    // for the next GET_BOOK_COUNT to skip the DB while the library is unchanged
+    struct ListedStorage {
+        const StorageContext* storage;
+        bool fromIndex;          // listed from a saved booklist found current
+        long long dataVersion;   // DB state it was checked against
+        std::string dbState;
+        BookManager::DirectoryStamps directories; // stat'ed this session
+    };
+    std::vector<ListedStorage> listedStorages;
+    ListedStorage& listStorage(const StorageContext& storage);
+    bool loadSessionIndex(ListedStorage& listed);
+    void saveSessionIndexes();
+    void forgetBookDirectories(const StorageContext& storage, const std::string& lpath);
+    void reportFailedBooks();
+    
     // Calibre sync column configuration
     std::string readColumn;
     std::string readDateColumn;
@@ -50,12 +104,34 @@ private:
     std::string currentBookLpath;
     long long currentBookLength;
     long long currentBookReceived;
-    FILE* currentBookFile;
+    std::unique_ptr<BookFileWriter> bookWriter; // the book being received
     int booksReceivedInSession;
     
     // ДОБАВЛЕНО: Счетчик для текущей пачки передачи
     int lastBatchCount;
     
+    // Per-opcode and per-phase timings, appended to METRICS_FILE on disconnect
+    SessionMetrics metrics;
+    bool tracingEnabled;
+    
+    // Scratch memory for the message being handled, reset before each message
+    Arena messageArena;
+    // Book bytes received or sent, kept between books
+    std::vector<char> transferBuffer;
+    
+    // BookReady for received books, sent once per batch; declared before
+    // coverWriter, whose workers feed it
+    BookReadyNotifier bookReadyNotifier;
+    
+    // Covers for received books (thumbnail or extracted), finished on disconnect
+    CoverWriter coverWriter;
+    
+    // Library DB writes, off the protocol thread; stopped on disconnect
+    DbWorker dbWorker;
+    
+    // Completes received books (file, DB, cache, cover) in the background
+    BookFinalizer bookFinalizer;
+    
     // Protocol handlers
     bool handleGetInitializationInfo(json_object* args);
     bool handleGetDeviceInformation(json_object* args);
@@ -66,7 +142,11 @@ private:
     bool handleGetBookCount(json_object* args);
     bool handleSendBooklists(json_object* args);
     bool handleSendBook(json_object* args);
+    bool handleSendBook(SendBookRequest& request);
+    std::string findReferenceFile(const StorageContext& storage, const std::string& filePath,
+                                  const std::string& lpath, long long length);
     bool handleSendBookMetadata(json_object* args);
+    bool handleSendBookMetadata(const BookMetadata& metadata);
     bool handleDeleteBook(json_object* args);
     bool handleGetBookFileSegment(json_object* args);
     bool handleDisplayMessage(json_object* args);
@@ -78,22 +158,40 @@ private:
     json_object* createDeviceInfo();
     std::string getPasswordHash(const std::string& password, 
                                const std::string& challenge);
-    json_object* cachedMetadataToJson(const BookMetadata& metadata, int index);
     
     // JSON helpers
     std::string jsonToString(json_object* obj);
     json_object* parseJSON(const std::string& jsonStr);
+    json_tokener* tokener; // reused by parseJSON
     void freeJSON(json_object* obj);
     std::string parseJsonStringOrArray(json_object* val);
-	
-    void generateCoverCache(const std::string& filePath);
     
     // Metadata conversion
     BookMetadata jsonToMetadata(json_object* obj);
-    json_object* metadataToJson(const BookMetadata& metadata);
+    
+    // SEND_BOOK / SEND_BOOK_METADATA are read straight from the frame;
+    // false means "use the json-c path" (malformed or unexpected types)
+    bool pullMetadata(JsonPullParser& parser, BookMetadata& metadata, bool withThumbnail);
+    bool pullSendBook(const std::string& frame, SendBookRequest& request);
+    bool pullSendBookMetadata(const std::string& frame, BookMetadata& metadata);
+    
+    // Booklist entries are streamed into jsonBuffer from a static field table,
+    // without building a json-c tree. priKey < 0 leaves the key out.
+    std::string jsonBuffer;
+    // readState false leaves the read fields out of a cached entry
+    static void writeBookJson(std::string& out, const BookMetadata& metadata,
+                              bool cached, int priKey, bool readState = true);
+    bool sendBookJson(const BookMetadata& metadata, bool cached, int priKey,
+                      bool readState = true);
 	
 	bool handleCardPrefix(json_object* args);
 	std::string currentOnCard; // "carda", "cardb" or empty for main
+    
+    // Collections: calibre appends the category, e.g. "Fantasy (Tags)"
+    static std::string cleanCollectionName(const std::string& rawName);
+    
+    // Micro-benchmarks (bench/micro_bench.cpp) call the private hot paths
+    friend class BenchmarkAccess;
 };
 
 #endif // CALIBRE_PROTOCOL_H
\ No newline at end of file
@@ -0,0 +1,233 @@
+#include "cover_writer.h"
+#include "base64.h"
+#include "book_ready_notifier.h"
+#include "logger.h"
+#include "inkview.h"
+#include <cstdio>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define logCover(level, ...) LOG_AT(level, "COVER", __VA_ARGS__)
+
+// Covers waiting for a worker; a thumbnail job holds ~16 KB of base64
+static const size_t MAX_PENDING = 32;
+
+// LoadJPEG reads from a file; /tmp is RAM on the device, so this costs no flash writes
+static const char* COVER_TEMP_FILE = "/tmp/calibre-connect-cover";
+
+// Neutral brightness/contrast, keep the aspect ratio
+static const int JPEG_BRIGHTNESS = 64;
+static const int JPEG_CONTRAST = 128;
+static const int JPEG_PROPORTIONAL = 1;
+
+// Only runs when nothing else wants the CPU. On Linux nice is per thread;
+// it is the fallback when the kernel refuses SCHED_IDLE.
+static void lowerThreadPriority() {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+#ifdef SCHED_IDLE
+    struct sched_param param;
+    param.sched_priority = 0;
+    int rc = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    if (rc != 0) {
+        logCover(LOG_DEBUG, "SCHED_IDLE not available (%d), using nice 19", rc);
+    }
+#endif
+}
+
+CoverWriter::CoverWriter(BookReadyNotifier& readyNotifier, int workerCount)
+    : notifier(readyNotifier), maxWorkers(workerCount > 0 ? workerCount : 1), stopping(false),
+      written(0), failed(0), cancelled(0) {
+}
+
+CoverWriter::~CoverWriter() {
+    finish();
+}
+
+bool CoverWriter::push(Job& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.size() >= MAX_PENDING) {
+        return false;
+    }
+
+    if (workers.empty()) {
+        stopping = false;
+        for (int i = 0; i < maxWorkers; i++) {
+            workers.push_back(std::thread(&CoverWriter::run, this, i));
+        }
+    }
+
+    queue.push_back(Job());
+    Job& queued = queue.back();
+    queued.bookPath.swap(job.bookPath);
+    queued.thumbnail.swap(job.thumbnail);
+    queued.width = job.width;
+    queued.height = job.height;
+    wake.notify_one();
+    return true;
+}
+
+bool CoverWriter::enqueue(const std::string& bookPath, std::string& thumbnail, int width, int height) {
+    Job job;
+    job.bookPath = bookPath;
+    job.width = width;
+    job.height = height;
+    job.thumbnail.swap(thumbnail);
+    if (push(job)) return true;
+    thumbnail.swap(job.thumbnail);
+    return false;
+}
+
+bool CoverWriter::enqueueExtract(const std::string& bookPath, int width, int height) {
+    Job job;
+    job.bookPath = bookPath;
+    job.width = width;
+    job.height = height;
+    return push(job);
+}
+
+void CoverWriter::finish() {
+    std::vector<std::string> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (workers.empty()) return;
+
+        std::deque<Job> keep;
+        for (size_t i = 0; i < queue.size(); i++) {
+            if (queue[i].thumbnail.empty()) {
+                dropped.push_back(queue[i].bookPath);
+            } else {
+                keep.push_back(Job());
+                keep.back().bookPath.swap(queue[i].bookPath);
+                keep.back().thumbnail.swap(queue[i].thumbnail);
+                keep.back().width = queue[i].width;
+                keep.back().height = queue[i].height;
+            }
+        }
+        queue.swap(keep);
+        stopping = true;
+        wake.notify_all();
+    }
+
+    // An extraction already running is not interruptible; wait for it
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+
+    for (size_t i = 0; i < dropped.size(); i++) {
+        notifier.add(dropped[i]);
+    }
+    cancelled += (int)dropped.size();
+
+    logCover(LOG_INFO, "Covers cached: %d, failed: %d, cancelled: %d",
+             written.load(), failed.load(), cancelled.load());
+}
+
+void CoverWriter::run(int index) {
+    lowerThreadPriority();
+
+    char tempFile[64];
+    snprintf(tempFile, sizeof(tempFile), "%s-%d.jpg", COVER_TEMP_FILE, index);
+    std::vector<unsigned char> jpeg;
+
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) break; // stopping and drained
+            job.bookPath.swap(queue.front().bookPath);
+            job.thumbnail.swap(queue.front().thumbnail);
+            job.width = queue.front().width;
+            job.height = queue.front().height;
+            queue.pop_front();
+        }
+
+        bool ok = job.thumbnail.empty() ? extractCover(job)
+                                        : writeThumbnail(job, tempFile, jpeg);
+        if (ok) {
+            written++;
+        } else {
+            failed++;
+        }
+
+        // Cover first, so the library does not extract one itself
+        notifier.add(job.bookPath);
+    }
+
+    remove(tempFile);
+}
+
+bool CoverWriter::writeThumbnail(const Job& job, const std::string& tempFile,
+                                 std::vector<unsigned char>& jpeg) {
+    jpeg.resize(base64DecodedSize(job.thumbnail.size()));
+    size_t length = 0;
+    if (!base64Decode(job.thumbnail.data(), job.thumbnail.size(), jpeg.data(), length) || length == 0) {
+        logCover(LOG_ERROR, "Invalid thumbnail data for %s", job.bookPath.c_str());
+        return false;
+    }
+
+    FILE* f = fopen(tempFile.c_str(), "wb");
+    if (!f) {
+        logCover(LOG_ERROR, "Cannot create %s", tempFile.c_str());
+        return false;
+    }
+    bool complete = fwrite(jpeg.data(), 1, length, f) == length;
+    complete = fclose(f) == 0 && complete;
+    if (!complete) {
+        logCover(LOG_ERROR, "Cannot write %s", tempFile.c_str());
+        return false;
+    }
+
+    int result;
+    {
+        std::lock_guard<std::mutex> lock(inkviewMutex);
+        ibitmap* cover = LoadJPEG(tempFile.c_str(), job.width, job.height,
+                                  JPEG_BRIGHTNESS, JPEG_CONTRAST, JPEG_PROPORTIONAL);
+        if (!cover) {
+            logCover(LOG_ERROR, "LoadJPEG() failed for %s", job.bookPath.c_str());
+            return false;
+        }
+
+        result = CoverCachePut(CCS_FBREADER, job.bookPath.c_str(), cover);
+        iv_freebitmap(cover);
+    }
+
+    if (result != 0) {
+        logCover(LOG_ERROR, "CoverCachePut() failed with code %d for %s", result, job.bookPath.c_str());
+        return false;
+    }
+
+    logCover(LOG_DEBUG, "Cover cached for %s (%dx%d, %zu bytes)",
+             job.bookPath.c_str(), job.width, job.height, length);
+    return true;
+}
+
+bool CoverWriter::extractCover(const Job& job) {
+    int result;
+    {
+        std::lock_guard<std::mutex> lock(inkviewMutex);
+        // GetBookCover allocates an ibitmap structure and its pixel buffer
+        ibitmap* cover = GetBookCover(job.bookPath.c_str(), job.width, job.height);
+        if (!cover) {
+            logCover(LOG_ERROR, "GetBookCover() returned NULL for %s", job.bookPath.c_str());
+            return false;
+        }
+
+        result = CoverCachePut(CCS_FBREADER, job.bookPath.c_str(), cover);
+        iv_freebitmap(cover);
+    }
+
+    if (result != 0) {
+        // Error 11 often means the cache system is busy or directory is inaccessible
+        logCover(LOG_ERROR, "CoverCachePut() failed with code %d for %s", result, job.bookPath.c_str());
+        return false;
+    }
+
+    logCover(LOG_DEBUG, "Cover extracted for %s", job.bookPath.c_str());
+    return true;
+}
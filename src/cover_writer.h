@@ -0,0 +1,69 @@
+#ifndef COVER_WRITER_H
+#define COVER_WRITER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class BookReadyNotifier;
+
+// Fills the PocketBook cover cache for received books off the protocol thread,
+// then hands the book to the BookReadyNotifier, so the library shows the cover
+// without opening the book to extract one.
+//  - thumbnail jobs: the cover Calibre sent with SEND_BOOK (cheap)
+//  - extract jobs: no thumbnail, GetBookCover parses the book (slow)
+// Workers run at SCHED_IDLE / nice 19, so they only use CPU the transfer leaves.
+// InkView's cover cache and book parsers are not known to be reentrant, so its
+// calls are serialized by inkviewMutex; one worker is the default for the same reason.
+class CoverWriter {
+public:
+    explicit CoverWriter(BookReadyNotifier& notifier, int maxWorkers = 1);
+    ~CoverWriter();
+
+    CoverWriter(const CoverWriter&) = delete;
+    CoverWriter& operator=(const CoverWriter&) = delete;
+
+    // Takes over thumbnail (base64 JPEG). False when the queue is full:
+    // the caller then notifies the book itself and the library extracts the cover.
+    bool enqueue(const std::string& bookPath, std::string& thumbnail, int width, int height);
+    bool enqueueExtract(const std::string& bookPath, int width, int height);
+
+    // Writes the thumbnails still queued, cancels pending extractions
+    // (their books are just notified) and stops the workers
+    void finish();
+
+    int getWritten() const { return written; }
+    int getFailed() const { return failed; }
+    int getCancelled() const { return cancelled; }
+
+private:
+    struct Job {
+        std::string bookPath;
+        std::string thumbnail; // empty: extract from the book
+        int width;
+        int height;
+    };
+
+    BookReadyNotifier& notifier;
+    std::deque<Job> queue;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::mutex inkviewMutex;
+    std::vector<std::thread> workers;
+    int maxWorkers;
+    bool stopping;
+    std::atomic<int> written;
+    std::atomic<int> failed;
+    std::atomic<int> cancelled;
+
+    bool push(Job& job);
+    void run(int index);
+    bool writeThumbnail(const Job& job, const std::string& tempFile, std::vector<unsigned char>& jpeg);
+    bool extractCover(const Job& job);
+};
+
+#endif // COVER_WRITER_H
@@ -0,0 +1,217 @@
+#include "db_worker.h"
+#include "logger.h"
+#include "metrics.h"
+#include "inkview.h"
+
+#define logDb(level, ...) LOG_AT(level, "DBW", __VA_ARGS__)
+
+// Operations waiting for the worker; a full queue holds up the protocol
+// thread instead of buffering a whole transfer's metadata
+static const size_t MAX_PENDING = 64;
+// WAL size (pages) checkpointed without an idle gap: once the queue drains,
+// or right away past WAL_FORCE_PAGES
+static const int WAL_LIMIT_PAGES = 1000;
+static const int WAL_FORCE_PAGES = 4 * WAL_LIMIT_PAGES;
+
+DbWorker::DbWorker(BookManager& bookManager)
+    : books(bookManager), stopping(false), operations(0), busyUs(0), maxQueued(0),
+      checkpoints(0), checkpointUs(0), maxWalPages(0), walPages(0) {
+}
+
+DbWorker::~DbWorker() {
+    stop();
+}
+
+std::future<bool> DbWorker::push(Op& op) {
+    std::future<bool> result = op.done.get_future();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    space.wait(lock, [this] { return queue.size() < MAX_PENDING; });
+
+    if (!worker.joinable()) {
+        stopping = false;
+        worker = std::thread(&DbWorker::run, this);
+    }
+
+    queue.push_back(std::move(op));
+    if ((int)queue.size() > maxQueued) maxQueued = (int)queue.size();
+    wake.notify_one();
+    return result;
+}
+
+std::future<bool> DbWorker::addBook(const StorageContext& storage, const BookMetadata& metadata) {
+    Op op;
+    op.kind = ADD_BOOK;
+    op.storage = &storage;
+    op.metadata = metadata;
+    // Not stored in the DB; the cover writer has its own copy
+    std::string().swap(op.metadata.thumbnail);
+    return push(op);
+}
+
+std::future<bool> DbWorker::syncBook(const StorageContext& storage, const BookMetadata& metadata) {
+    Op op;
+    op.kind = SYNC_BOOK;
+    op.storage = &storage;
+    op.metadata = metadata;
+    std::string().swap(op.metadata.thumbnail);
+    return push(op);
+}
+
+std::future<bool> DbWorker::deleteBook(const StorageContext& storage, const std::string& lpath) {
+    Op op;
+    op.kind = DELETE_BOOK;
+    op.storage = &storage;
+    op.lpath = lpath;
+    return push(op);
+}
+
+std::future<bool> DbWorker::syncCollections(std::map<std::string, std::set<std::string>>& collections) {
+    Op op;
+    op.kind = SYNC_COLLECTIONS;
+    op.collections.swap(collections);
+    return push(op);
+}
+
+void DbWorker::flush() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker.joinable()) return;
+    }
+    Op op;
+    op.kind = BARRIER;
+    op.storage = nullptr;
+    push(op).wait();
+}
+
+void DbWorker::idle() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker.joinable()) return;
+    }
+    Op op;
+    op.kind = CHECKPOINT;
+    op.storage = nullptr;
+    push(op);
+}
+
+void DbWorker::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker.joinable()) return;
+        stopping = true;
+        wake.notify_all();
+    }
+    worker.join();
+    worker = std::thread();
+
+    logDb(LOG_INFO, "DB operations: %d, busy %llu ms, max queued %d, checkpoints %d (%llu ms)",
+          operations.load(), busyUs.load() / 1000, maxQueued.load(),
+          checkpoints.load(), checkpointUs.load() / 1000);
+}
+
+void DbWorker::resetCounters() {
+    operations = 0;
+    busyUs = 0;
+    maxQueued = 0;
+    checkpoints = 0;
+    checkpointUs = 0;
+    maxWalPages = 0;
+}
+
+void DbWorker::run() {
+    sqlite3* db = nullptr;
+
+    for (;;) {
+        Op op;
+        bool drained;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) break; // stopping and drained
+            op = std::move(queue.front());
+            queue.pop_front();
+            drained = queue.empty();
+            space.notify_one();
+        }
+
+        if (op.kind == BARRIER) {
+            op.done.set_value(true);
+            continue;
+        }
+        if (op.kind == CHECKPOINT) {
+            if (db && walPages > 0) checkpoint(db, SQLITE_CHECKPOINT_PASSIVE);
+            op.done.set_value(true);
+            continue;
+        }
+
+        unsigned long long start = SessionMetrics::nowUs();
+        if (!db) {
+            db = books.openDB();
+            if (db) sqlite3_wal_hook(db, onWalCommit, this);
+        }
+        bool ok = db && execute(db, op);
+        busyUs += SessionMetrics::nowUs() - start;
+        operations++;
+        op.done.set_value(ok);
+
+        if (db && (walPages >= WAL_FORCE_PAGES || (drained && walPages >= WAL_LIMIT_PAGES))) {
+            checkpoint(db, SQLITE_CHECKPOINT_PASSIVE);
+        }
+    }
+
+    if (db) checkpoint(db, SQLITE_CHECKPOINT_TRUNCATE);
+    books.closeDB(db);
+}
+
+bool DbWorker::execute(sqlite3* db, Op& op) {
+    switch (op.kind) {
+        case ADD_BOOK:
+            return books.addBook(db, *op.storage, op.metadata);
+
+        case SYNC_BOOK:
+            if (!books.updateBookSync(db, *op.storage, op.metadata)) {
+                logDb(LOG_ERROR, "Metadata sync for a book not in the DB: %s", op.metadata.lpath.c_str());
+                return false;
+            }
+            NotifyConfigChanged();
+            return true;
+
+        case DELETE_BOOK:
+            return books.deleteBook(db, *op.storage, op.lpath);
+
+        case SYNC_COLLECTIONS:
+            return books.syncCollections(db, op.collections);
+
+        case CHECKPOINT:
+        case BARRIER:
+            break;
+    }
+    return true;
+}
+
+void DbWorker::checkpoint(sqlite3* db, int mode) {
+    unsigned long long start = SessionMetrics::nowUs();
+    int logPages = 0;
+    int copied = 0;
+    int rc = sqlite3_wal_checkpoint_v2(db, NULL, mode, &logPages, &copied);
+    checkpointUs += SessionMetrics::nowUs() - start;
+    checkpoints++;
+
+    const char* name = mode == SQLITE_CHECKPOINT_TRUNCATE ? "TRUNCATE" : "PASSIVE";
+    if (rc != SQLITE_OK) {
+        logDb(LOG_ERROR, "%s checkpoint failed: %s", name, sqlite3_errmsg(db));
+        return;
+    }
+    // Frames still needed by a reader's snapshot wait for the next checkpoint
+    walPages = logPages - copied;
+    logDb(LOG_DEBUG, "%s checkpoint: %d of %d pages", name, copied, logPages);
+}
+
+// Replaces SQLite's own hook, so commits never checkpoint inline
+int DbWorker::onWalCommit(void* worker, sqlite3*, const char*, int pages) {
+    DbWorker* self = static_cast<DbWorker*>(worker);
+    self->walPages = pages;
+    if (pages > self->maxWalPages) self->maxWalPages = pages;
+    return SQLITE_OK;
+}
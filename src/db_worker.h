@@ -0,0 +1,91 @@
+#ifndef DB_WORKER_H
+#define DB_WORKER_H
+
+#include "book_manager.h"
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Runs the library DB writes of a session on one thread, over a connection
+// kept open until stop(). Operations run in the order they were queued and
+// each returns a future for its result; the protocol only waits for those
+// whose outcome goes back to Calibre, so receiving the next book overlaps
+// with inserting the previous one.
+//
+// The connection keeps SQLite from checkpointing the WAL inside a commit.
+// Instead the worker checkpoints (PASSIVE, never waiting for readers) when
+// Calibre goes idle, or between operations once the WAL passes a size limit,
+// and truncates the WAL when it stops.
+class DbWorker {
+public:
+    explicit DbWorker(BookManager& books);
+    ~DbWorker();
+
+    DbWorker(const DbWorker&) = delete;
+    DbWorker& operator=(const DbWorker&) = delete;
+
+    std::future<bool> addBook(const StorageContext& storage, const BookMetadata& metadata);
+    // Read state and favorite; the library then reloads its settings
+    std::future<bool> syncBook(const StorageContext& storage, const BookMetadata& metadata);
+    std::future<bool> deleteBook(const StorageContext& storage, const std::string& lpath);
+    // Takes over collections; their books may be on either storage
+    std::future<bool> syncCollections(std::map<std::string, std::set<std::string>>& collections);
+
+    // Returns once everything queued so far has run: before reading the library
+    void flush();
+    // Calibre has nothing to send (keep-alive NOOP): checkpoint what the
+    // session wrote while nothing is waiting on the DB
+    void idle();
+    // Runs what is queued, closes the connection and stops the thread;
+    // the next operation starts them again
+    void stop();
+
+    int getOperations() const { return operations; }
+    unsigned long long getBusyUs() const { return busyUs; }
+    int getMaxQueued() const { return maxQueued; }
+    int getCheckpoints() const { return checkpoints; }
+    unsigned long long getCheckpointUs() const { return checkpointUs; }
+    int getMaxWalPages() const { return maxWalPages; }
+    void resetCounters();
+
+private:
+    enum Kind { ADD_BOOK, SYNC_BOOK, DELETE_BOOK, SYNC_COLLECTIONS, CHECKPOINT, BARRIER };
+
+    struct Op {
+        Kind kind;
+        const StorageContext* storage; // book ops
+        BookMetadata metadata; // ADD_BOOK, SYNC_BOOK
+        std::string lpath;     // DELETE_BOOK
+        std::map<std::string, std::set<std::string>> collections;
+        std::promise<bool> done;
+    };
+
+    BookManager& books;
+    std::deque<Op> queue;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable space;
+    std::thread worker;
+    bool stopping;
+    std::atomic<int> operations;
+    std::atomic<unsigned long long> busyUs;
+    std::atomic<int> maxQueued;
+    std::atomic<int> checkpoints;
+    std::atomic<unsigned long long> checkpointUs;
+    std::atomic<int> maxWalPages;
+    int walPages; // WAL frames not yet checkpointed; worker thread only
+
+    std::future<bool> push(Op& op);
+    void run();
+    bool execute(sqlite3* db, Op& op);
+    void checkpoint(sqlite3* db, int mode);
+    static int onWalCommit(void* worker, sqlite3* db, const char* name, int pages);
+};
+
+#endif // DB_WORKER_H
@@ -0,0 +1,335 @@
+#include "json_pull.h"
+#include "arena.h"
+#include <cstdlib>
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool readHex4(const char* p, unsigned& value) {
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        int v = hexValue(p[i]);
+        if (v < 0) return false;
+        value = (value << 4) | (unsigned)v;
+    }
+    return true;
+}
+
+static char* appendUtf8(char* out, unsigned cp) {
+    if (cp < 0x80) {
+        *out++ = (char)cp;
+    } else if (cp < 0x800) {
+        *out++ = (char)(0xC0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *out++ = (char)(0xE0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+        *out++ = (char)(0xF0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+bool JsonPullParser::expect(char c) {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos >= end || *pos != c) return fail();
+    pos++;
+    return true;
+}
+
+bool JsonPullParser::matchLiteral(const char* literal, size_t length) {
+    if ((size_t)(end - pos) < length || memcmp(pos, literal, length) != 0) return fail();
+    pos += length;
+    return true;
+}
+
+bool JsonPullParser::nextKey(const char*& key, size_t& keyLength) {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos >= end) return fail();
+    if (*pos == '}') {
+        pos++;
+        return false;
+    }
+    if (*pos == ',') {
+        pos++;
+        skipWhitespace();
+    }
+    if (pos >= end || *pos != '"') return fail();
+
+    bool escaped;
+    if (!scanString(key, keyLength, escaped)) return false;
+    return expect(':');
+}
+
+bool JsonPullParser::nextElement() {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos >= end) return fail();
+    if (*pos == ']') {
+        pos++;
+        return false;
+    }
+    if (*pos == ',') pos++;
+    return true;
+}
+
+bool JsonPullParser::scanString(const char*& start, size_t& length, bool& escaped) {
+    pos++;
+    start = pos;
+
+    // memchr keeps long base64 strings cheap; a quote preceded by an odd run of backslashes is escaped
+    for (;;) {
+        const char* quote = static_cast<const char*>(memchr(pos, '"', end - pos));
+        if (!quote) return fail();
+
+        const char* back = quote;
+        while (back > start && back[-1] == '\\') back--;
+        pos = quote + 1;
+        if ((quote - back) % 2 == 0) {
+            length = quote - start;
+            break;
+        }
+    }
+
+    escaped = memchr(start, '\\', length) != NULL;
+    return true;
+}
+
+bool JsonPullParser::scanNumber(const char*& start, size_t& length) {
+    start = pos;
+    while (pos < end && ((*pos >= '0' && *pos <= '9') || *pos == '-' || *pos == '+' ||
+                         *pos == '.' || *pos == 'e' || *pos == 'E')) {
+        pos++;
+    }
+    length = pos - start;
+    return length > 0 ? true : fail();
+}
+
+// Every escape is at least as long as what it decodes to, so out needs at most length bytes
+size_t JsonPullParser::unescape(const char* start, size_t length, char* out) {
+    char* dst = out;
+    const char* p = start;
+    const char* stop = start + length;
+
+    while (p < stop) {
+        const char* slash = static_cast<const char*>(memchr(p, '\\', stop - p));
+        if (!slash) {
+            memcpy(dst, p, stop - p);
+            dst += stop - p;
+            break;
+        }
+        memcpy(dst, p, slash - p);
+        dst += slash - p;
+        p = slash + 1;
+        if (p >= stop) break;
+
+        char c = *p++;
+        switch (c) {
+            case 'b': *dst++ = '\b'; break;
+            case 'f': *dst++ = '\f'; break;
+            case 'n': *dst++ = '\n'; break;
+            case 'r': *dst++ = '\r'; break;
+            case 't': *dst++ = '\t'; break;
+            case 'u': {
+                unsigned cp;
+                if (stop - p < 4 || !readHex4(p, cp)) {
+                    *dst++ = 'u';
+                    break;
+                }
+                p += 4;
+                // Surrogate pair -> one code point
+                unsigned low;
+                if (cp >= 0xD800 && cp <= 0xDBFF && stop - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                    readHex4(p + 2, low) && low >= 0xDC00 && low <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                dst = appendUtf8(dst, cp);
+                break;
+            }
+            default:
+                *dst++ = c; // \" \\ \/
+                break;
+        }
+    }
+    return dst - out;
+}
+
+bool JsonPullParser::readString(std::string& out) {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos < end && *pos == 'n') {
+        if (!matchLiteral("null", 4)) return false;
+        out.clear();
+        return true;
+    }
+    if (pos >= end || *pos != '"') return fail();
+
+    const char* start;
+    size_t length;
+    bool escaped;
+    if (!scanString(start, length, escaped)) return false;
+
+    if (escaped) {
+        out.resize(length);
+        out.resize(unescape(start, length, &out[0]));
+    } else {
+        out.assign(start, length);
+    }
+    return true;
+}
+
+bool JsonPullParser::readString(const char*& str, size_t& length, Arena& arena) {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos < end && *pos == 'n') {
+        str = "";
+        length = 0;
+        return matchLiteral("null", 4);
+    }
+    if (pos >= end || *pos != '"') return fail();
+
+    bool escaped;
+    if (!scanString(str, length, escaped)) return false;
+
+    if (escaped) {
+        // Unescaping only shrinks, so the raw length is enough
+        char* out = static_cast<char*>(arena.allocate(length + 1, 1));
+        length = unescape(str, length, out);
+        out[length] = '\0';
+        str = out;
+    }
+    return true;
+}
+
+bool JsonPullParser::readInt64(long long& out) {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos >= end) return fail();
+
+    switch (*pos) {
+        case 'n': out = 0; return matchLiteral("null", 4);
+        case 't': out = 1; return matchLiteral("true", 4);
+        case 'f': out = 0; return matchLiteral("false", 5);
+        default: break;
+    }
+
+    const char* start;
+    size_t length;
+    if (!scanNumber(start, length)) return false;
+
+    if (memchr(start, '.', length) || memchr(start, 'e', length) || memchr(start, 'E', length)) {
+        // series_index arrives as a double; json-c truncates it the same way
+        char buf[64];
+        if (length >= sizeof(buf)) return fail();
+        memcpy(buf, start, length);
+        buf[length] = '\0';
+        out = (long long)strtod(buf, NULL);
+        return true;
+    }
+
+    const char* p = start;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    if (p == start + length) return fail();
+
+    unsigned long long value = 0;
+    for (; p < start + length; p++) {
+        if (*p < '0' || *p > '9') return fail();
+        value = value * 10 + (unsigned)(*p - '0');
+    }
+    out = negative ? -(long long)value : (long long)value;
+    return true;
+}
+
+bool JsonPullParser::readInt(int& out) {
+    long long value;
+    if (!readInt64(value)) return false;
+    out = (int)value;
+    return true;
+}
+
+bool JsonPullParser::readBool(bool& out) {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos >= end) return fail();
+
+    switch (*pos) {
+        case 't': out = true; return matchLiteral("true", 4);
+        case 'f': out = false; return matchLiteral("false", 5);
+        case 'n': out = false; return matchLiteral("null", 4);
+        case '"': return fail();
+        default: break;
+    }
+
+    long long value;
+    if (!readInt64(value)) return false;
+    out = value != 0;
+    return true;
+}
+
+bool JsonPullParser::skipValue() {
+    if (failed) return false;
+    skipWhitespace();
+    if (pos >= end) return fail();
+
+    const char* start;
+    size_t length;
+    bool escaped;
+
+    switch (*pos) {
+        case '"':
+            return scanString(start, length, escaped);
+        case '{':
+        case '[': {
+            int depth = 0;
+            while (pos < end) {
+                char c = *pos;
+                if (c == '"') {
+                    if (!scanString(start, length, escaped)) return false;
+                    continue;
+                }
+                if (c == '{' || c == '[') {
+                    depth++;
+                } else if (c == '}' || c == ']') {
+                    if (--depth == 0) {
+                        pos++;
+                        return true;
+                    }
+                }
+                pos++;
+            }
+            return fail();
+        }
+        case 't': return matchLiteral("true", 4);
+        case 'f': return matchLiteral("false", 5);
+        case 'n': return matchLiteral("null", 4);
+        default:
+            return scanNumber(start, length);
+    }
+}
+
+bool JsonPullParser::skipNull() {
+    if (failed) return false;
+    skipWhitespace();
+    if (end - pos >= 4 && memcmp(pos, "null", 4) == 0) {
+        pos += 4;
+        return true;
+    }
+    return false;
+}
+
+char JsonPullParser::peek() {
+    skipWhitespace();
+    return pos < end ? *pos : '\0';
+}
@@ -0,0 +1,70 @@
+#ifndef JSON_PULL_H
+#define JSON_PULL_H
+
+#include <string>
+#include <cstddef>
+#include <cstring>
+
+class Arena;
+
+// Forward-only reader over a received frame. Nothing is copied or allocated
+// except the strings the caller asks for; values it does not ask for are
+// skipped in place (comments, unused user_metadata columns).
+// Any unexpected type makes the read fail so the caller can fall back to json-c.
+class JsonPullParser {
+public:
+    JsonPullParser(const char* data, size_t length)
+        : pos(data), end(data + length), failed(false) {}
+
+    bool enterObject() { return expect('{'); }
+    bool enterArray() { return expect('['); }
+
+    // Next member of the current object; false after the closing '}' or on error.
+    // The key is the raw text between the quotes.
+    bool nextKey(const char*& key, size_t& keyLength);
+    // Next element of the current array; false after the closing ']' or on error
+    bool nextElement();
+
+    // Typed reads follow json-c's getters for the types Calibre sends; null reads as empty
+    bool readString(std::string& out);
+    // Points into the frame when there is nothing to unescape, otherwise into the arena
+    bool readString(const char*& str, size_t& length, Arena& arena);
+    bool readInt64(long long& out);
+    bool readInt(int& out);
+    bool readBool(bool& out);
+
+    bool skipValue();
+    // Consumes a null, returns false (and consumes nothing) for anything else
+    bool skipNull();
+    char peek();
+
+    bool ok() const { return !failed; }
+
+    static bool keyIs(const char* key, size_t keyLength, const char* name) {
+        return strlen(name) == keyLength && memcmp(key, name, keyLength) == 0;
+    }
+    static bool keyIs(const char* key, size_t keyLength, const std::string& name) {
+        return !name.empty() && name.size() == keyLength && memcmp(key, name.data(), keyLength) == 0;
+    }
+
+private:
+    const char* pos;
+    const char* end;
+    bool failed;
+
+    bool fail() {
+        failed = true;
+        return false;
+    }
+    void skipWhitespace() {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) pos++;
+    }
+    bool expect(char c);
+    bool matchLiteral(const char* literal, size_t length);
+    // pos at the opening quote; leaves pos after the closing one
+    bool scanString(const char*& start, size_t& length, bool& escaped);
+    bool scanNumber(const char*& start, size_t& length);
+    static size_t unescape(const char* start, size_t length, char* out);
+};
+
+#endif // JSON_PULL_H
@@ -0,0 +1,97 @@
+#include "json_writer.h"
+
+void JsonWriter::beginObject() {
+    separator();
+    out += '{';
+    needComma = false;
+}
+
+void JsonWriter::endObject() {
+    out += '}';
+    needComma = true;
+}
+
+void JsonWriter::beginArray() {
+    separator();
+    out += '[';
+    needComma = false;
+}
+
+void JsonWriter::endArray() {
+    out += ']';
+    needComma = true;
+}
+
+void JsonWriter::key(const char* name) {
+    separator();
+    out += '"';
+    out += name;
+    out += "\":";
+    needComma = false;
+}
+
+void JsonWriter::value(const char* str, size_t length) {
+    separator();
+    out += '"';
+    appendEscaped(out, str, length);
+    out += '"';
+    needComma = true;
+}
+
+void JsonWriter::value(long long number) {
+    separator();
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    unsigned long long magnitude = number < 0 ? 0ULL - (unsigned long long)number
+                                              : (unsigned long long)number;
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (number < 0) *--p = '-';
+    out.append(p, end - p);
+    needComma = true;
+}
+
+void JsonWriter::value(bool flag) {
+    separator();
+    out += flag ? "true" : "false";
+    needComma = true;
+}
+
+void JsonWriter::null() {
+    separator();
+    out += "null";
+    needComma = true;
+}
+
+// Copies runs of plain bytes at once; UTF-8 sequences pass through unchanged
+void JsonWriter::appendEscaped(std::string& out, const char* str, size_t length) {
+    static const char HEX[] = "0123456789abcdef";
+    size_t runStart = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        out.append(str + runStart, i - runStart);
+        runStart = i + 1;
+
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default: {
+                char esc[6] = { '\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 0xF] };
+                out.append(esc, sizeof(esc));
+                break;
+            }
+        }
+    }
+    out.append(str + runStart, length - runStart);
+}
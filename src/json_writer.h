@@ -0,0 +1,48 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <string>
+#include <cstddef>
+
+// Appends JSON text to a caller-owned buffer. Used on the hot paths instead of
+// building a json-c tree; the buffer keeps its capacity between messages, so
+// steady-state writes do not allocate. Keys must not need escaping.
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& buffer) : out(buffer), needComma(false) {}
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    void key(const char* name);
+
+    void value(const char* str, size_t length);
+    void value(const std::string& str) { value(str.data(), str.size()); }
+    void value(long long number);
+    void value(int number) { value((long long)number); }
+    void value(bool flag);
+    void null();
+
+    template <typename T>
+    void field(const char* name, const T& v) {
+        key(name);
+        value(v);
+    }
+
+    std::string& buffer() { return out; }
+
+    // The string escaping of value(), without the quotes; for JSON built by hand
+    static void appendEscaped(std::string& out, const char* str, size_t length);
+
+private:
+    std::string& out;
+    bool needComma;
+
+    void separator() {
+        if (needComma) out += ',';
+    }
+};
+
+#endif // JSON_WRITER_H
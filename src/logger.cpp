@@ -0,0 +1,227 @@
+#include "logger.h"
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <system_error>
+#include <sys/stat.h>
+
+// Ring geometry: 256 slots of 384 bytes (~96 KB, allocated once in .bss)
+static const size_t RING_SIZE = 256;
+static const size_t RING_MASK = RING_SIZE - 1;
+static const size_t SLOT_TEXT_LEN = 384;
+
+// Flusher wakes up at least this often, and early every RING_SIZE / 2 lines
+static const int FLUSH_INTERVAL_MS = 100;
+
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    size_t length;
+    char text[SLOT_TEXT_LEN];
+};
+
+// Bounded MPSC queue (Vyukov): a slot is free for position P when its sequence
+// equals P and holds a finished line when its sequence equals P + 1.
+static LogSlot ring[RING_SIZE];
+static std::atomic<size_t> enqueuePos(0);
+static size_t dequeuePos = 0; // Flusher thread only
+static std::once_flag ringOnce;
+static std::atomic<bool> ringReady(false);
+static std::atomic<unsigned long> droppedLines(0);
+
+// Flusher state, guarded by controlMutex for open/close
+static std::mutex controlMutex;
+static std::mutex wakeMutex;
+static std::condition_variable wakeCond;
+static std::thread flusherThread;
+static std::atomic<bool> stopRequested(false);
+static FILE* logFile = NULL;
+static std::string logPath;
+static size_t logMaxSize = 0;
+static size_t logSize = 0;
+
+std::atomic<int> Logger::minLevel(LOG_OFF);
+
+static void initRing() {
+    std::call_once(ringOnce, []() {
+        for (size_t i = 0; i < RING_SIZE; i++) {
+            ring[i].sequence.store(i, std::memory_order_relaxed);
+            ring[i].length = 0;
+        }
+        ringReady.store(true, std::memory_order_release);
+    });
+}
+
+static void rotateLog() {
+    if (logFile) {
+        fclose(logFile);
+        logFile = NULL;
+    }
+    std::string oldPath = logPath + ".1";
+    rename(logPath.c_str(), oldPath.c_str());
+    logFile = fopen(logPath.c_str(), "w");
+    logSize = 0;
+}
+
+// Writes out every finished line; returns the number of lines written
+static size_t drainRing() {
+    size_t lines = 0;
+    for (;;) {
+        LogSlot& slot = ring[dequeuePos & RING_MASK];
+        size_t seq = slot.sequence.load(std::memory_order_acquire);
+        if (seq != dequeuePos + 1) break;
+
+        if (logFile) {
+            fwrite(slot.text, 1, slot.length, logFile);
+            logSize += slot.length;
+        }
+        slot.sequence.store(dequeuePos + RING_SIZE, std::memory_order_release);
+        dequeuePos++;
+        lines++;
+
+        if (logMaxSize > 0 && logSize >= logMaxSize) {
+            rotateLog();
+        }
+    }
+    return lines;
+}
+
+static void flusherLoop() {
+    unsigned long reportedDrops = 0;
+
+    while (!stopRequested.load(std::memory_order_acquire)) {
+        {
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            wakeCond.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+        }
+
+        size_t lines = drainRing();
+
+        unsigned long drops = droppedLines.load(std::memory_order_relaxed);
+        if (drops != reportedDrops && logFile) {
+            logSize += fprintf(logFile, "[logger] %lu line(s) dropped, ring buffer full\n",
+                               drops - reportedDrops);
+            reportedDrops = drops;
+            lines++;
+        }
+
+        if (lines > 0 && logFile) fflush(logFile);
+    }
+
+    drainRing();
+    if (logFile) fflush(logFile);
+}
+
+bool Logger::open(const char* path, size_t maxSize) {
+    std::lock_guard<std::mutex> lock(controlMutex);
+    if (flusherThread.joinable()) return true;
+
+    initRing();
+
+    logPath = path;
+    logMaxSize = maxSize;
+    logSize = 0;
+
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        logSize = st.st_size;
+    }
+
+    if (maxSize > 0 && logSize >= maxSize) {
+        rotateLog();
+    } else {
+        logFile = fopen(path, "a");
+    }
+
+    if (!logFile) return false;
+
+    stopRequested.store(false, std::memory_order_release);
+    try {
+        flusherThread = std::thread(flusherLoop);
+    } catch (const std::system_error&) {
+        fclose(logFile);
+        logFile = NULL;
+        return false;
+    }
+    return true;
+}
+
+void Logger::close() {
+    std::lock_guard<std::mutex> lock(controlMutex);
+    minLevel.store(LOG_OFF, std::memory_order_relaxed);
+
+    if (flusherThread.joinable()) {
+        stopRequested.store(true, std::memory_order_release);
+        wakeCond.notify_one();
+        flusherThread.join();
+    }
+
+    if (logFile) {
+        fclose(logFile);
+        logFile = NULL;
+    }
+}
+
+void Logger::setLevel(LogLevel level) {
+    minLevel.store(level, std::memory_order_relaxed);
+}
+
+unsigned long Logger::getDroppedCount() {
+    return droppedLines.load(std::memory_order_relaxed);
+}
+
+void Logger::write(LogLevel level, const char* tag, const char* fmt, ...) {
+    if (!ringReady.load(std::memory_order_acquire)) return;
+
+    // Claim a slot; never block the caller, drop the line if the ring is full
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    for (;;) {
+        slot = &ring[pos & RING_MASK];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            droppedLines.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    static const char* levelNames[] = {"DEBUG", "INFO", "ERROR", "OFF"};
+
+    time_t now = time(NULL);
+    struct tm tmInfo;
+    localtime_r(&now, &tmInfo);
+
+    int prefixLen = snprintf(slot->text, SLOT_TEXT_LEN, "[%02d:%02d:%02d][%s][%s] ",
+                             tmInfo.tm_hour, tmInfo.tm_min, tmInfo.tm_sec,
+                             levelNames[level], tag);
+    size_t len = prefixLen > 0 ? std::min((size_t)prefixLen, SLOT_TEXT_LEN - 2) : 0;
+
+    // Leave room for the trailing newline
+    va_list args;
+    va_start(args, fmt);
+    int msgLen = vsnprintf(slot->text + len, SLOT_TEXT_LEN - 1 - len, fmt, args);
+    va_end(args);
+
+    if (msgLen > 0) {
+        len += std::min((size_t)msgLen, SLOT_TEXT_LEN - 2 - len);
+    }
+    slot->text[len++] = '\n';
+    slot->length = len;
+
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    if (level == LOG_ERROR || (pos & (RING_SIZE / 2 - 1)) == 0) {
+        wakeCond.notify_one();
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <cstddef>
+
+enum LogLevel {
+    LOG_DEBUG = 0,
+    LOG_INFO  = 1,
+    LOG_ERROR = 2,
+    LOG_OFF   = 3
+};
+
+// Process-wide asynchronous logger.
+// Producers format a line straight into a slot of a lock-free ring buffer,
+// a background thread appends finished lines to the log file and rotates it
+// once it grows past the size limit. Nothing is formatted (and the arguments
+// are not even evaluated) when the level is filtered out, see LOG_AT.
+class Logger {
+public:
+    // Start the flusher thread and open (append) the log file
+    static bool open(const char* path, size_t maxSize);
+
+    // Drain pending lines, stop the flusher thread and close the file
+    static void close();
+
+    // Lines below this level are discarded before formatting; LOG_OFF disables all
+    static void setLevel(LogLevel level);
+
+    static bool isEnabled(LogLevel level) {
+        return (int)level >= minLevel.load(std::memory_order_relaxed);
+    }
+
+    static void write(LogLevel level, const char* tag, const char* fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
+    // Lines lost because the ring buffer was full
+    static unsigned long getDroppedCount();
+
+private:
+    static std::atomic<int> minLevel;
+};
+
+#define LOG_AT(level, tag, ...) \
+    do { if (Logger::isEnabled(level)) Logger::write(level, tag, __VA_ARGS__); } while (0)
+
+#endif // LOGGER_H
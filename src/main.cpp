@@ -4,6 +4,7 @@
 #include "book_manager.h"
 #include "cache_manager.h"
 #include "i18n.h"
+#include "logger.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -32,64 +33,24 @@
 
 #define MAX_LOG_SIZE (256 * 1024)
 
-// --- Logging System (Thread Safe) ---
+// --- Logging System (see logger.h) ---
+#define logMsg(...) LOG_AT(LOG_INFO, "APP", __VA_ARGS__)
+
+static const char* LOG_PATH = "/mnt/ext1/system/calibre-connect.log";
 static std::atomic<bool> isLoggingEnabled(false);
-static FILE* logFile = NULL;
-static std::mutex logMutex; // Mutex for log file access
 
 void initLog() {
     if (!isLoggingEnabled) return;
 
-    const char* logPath = "/mnt/ext1/system/calibre-connect.log";
-    
-    std::lock_guard<std::mutex> lock(logMutex);
-
-    if (logFile) return;
-
-    struct stat st;
-    if (stat(logPath, &st) == 0) {
-        if (st.st_size >= MAX_LOG_SIZE) {
-            remove(logPath); 
-        }
-    }
-
-    logFile = fopen(logPath, "a");
-    if (logFile) {
-        time_t now = time(NULL);
-        fprintf(logFile, "\n= Calibre Connect Started [%s] =\n", ctime(&now));
-        fflush(logFile);
+    if (Logger::open(LOG_PATH, MAX_LOG_SIZE)) {
+        Logger::setLevel(LOG_INFO);
+        logMsg("= Calibre Connect Started =");
     }
 }
 
-void logMsg(const char* format, ...) {
-    if (!isLoggingEnabled) return;
-
-    std::lock_guard<std::mutex> lock(logMutex);
-    
-    if (!logFile) return;
-    
-    time_t now = time(NULL);
-    struct tm* tm_info = localtime(&now);
-    fprintf(logFile, "[%02d:%02d:%02d] ", 
-            tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec);
-    
-    va_list args;
-    va_start(args, format);
-    vfprintf(logFile, format, args);
-    va_end(args);
-    fprintf(logFile, "\n");
-    fflush(logFile);
-}
-
 void closeLog() {
-    std::lock_guard<std::mutex> lock(logMutex);
-    if (logFile) {
-        time_t now = time(NULL);
-        fprintf(logFile, "= Calibre Connect Closed [%s] =\n", ctime(&now));
-        fflush(logFile);
-        fclose(logFile);
-        logFile = NULL;
-    }
+    logMsg("= Calibre Connect Closed =");
+    Logger::close();
 }
 
 // --- Global Config ---
@@ -108,6 +69,9 @@ static const char *KEY_FAVORITE_COLUMN = "favorite_column";
 static const char *KEY_ENABLE_LOG = "enable_logging";
 static const char *DEFAULT_ENABLE_LOG = "0";
 
+// Hidden (not shown in the editor): per-session Chrome trace files
+static const char *KEY_ENABLE_TRACE = "enable_tracing";
+
 // Default values
 static const char *DEFAULT_IP = "192.168.1.100";
 static const char *DEFAULT_PORT = "9090";
@@ -344,6 +308,7 @@ void startCalibreConnection() {
         readDateCol ? readDateCol : "", 
         favCol ? favCol : ""
     ));
+    protocol->setTracingEnabled(ReadInt(appConfig, KEY_ENABLE_TRACE, 0) != 0);
     
     // --- 3. Start Thread ---
     if (connectionThread.joinable()) {
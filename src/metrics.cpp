@@ -0,0 +1,176 @@
+#include "metrics.h"
+#include "json_writer.h"
+#include "network.h"
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+// Keep the metrics file bounded, older sessions move to <path>.1
+static const long MAX_METRICS_FILE_SIZE = 256 * 1024;
+
+static const char* PHASE_NAMES[PHASE_COUNT] = {
+    "idle", "receive", "parse", "handler", "db", "disk", "send"
+};
+
+SessionMetrics::SessionMetrics() {
+    reset();
+}
+
+void SessionMetrics::reset() {
+    memset(opcodes, 0, sizeof(opcodes));
+    memset(phaseUs, 0, sizeof(phaseUs));
+    phaseDepth = 0;
+    phaseMark = 0;
+    totalMessages = 0;
+    handshakeUs = 0;
+    bookReadyBooks = 0;
+    bookReadyFlushes = 0;
+    bookReadyMidTransfer = 0;
+    dbOperations = 0;
+    dbBusyUs = 0;
+    dbMaxQueued = 0;
+    dbCheckpoints = 0;
+    dbCheckpointUs = 0;
+    dbMaxWalPages = 0;
+    dbLockWaits = 0;
+    dbLockRetries = 0;
+    dbLockWaitUs = 0;
+    dbLockTimeouts = 0;
+    sessionStartUs = nowUs();
+    sessionStart = time(NULL);
+}
+
+unsigned long long SessionMetrics::nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void SessionMetrics::enterPhase(MetricsPhase phase) {
+    unsigned long long now = nowUs();
+    if (phaseDepth > 0) {
+        phaseUs[phaseStack[phaseDepth - 1]] += now - phaseMark;
+    }
+    phaseMark = now;
+    if (phaseDepth < MAX_PHASE_DEPTH) {
+        phaseStack[phaseDepth] = phase;
+    }
+    phaseDepth++;
+}
+
+void SessionMetrics::leavePhase() {
+    if (phaseDepth <= 0) return;
+    unsigned long long now = nowUs();
+    int top = phaseDepth <= MAX_PHASE_DEPTH ? phaseDepth - 1 : MAX_PHASE_DEPTH - 1;
+    phaseUs[phaseStack[top]] += now - phaseMark;
+    phaseMark = now;
+    phaseDepth--;
+}
+
+void SessionMetrics::recordMessage(int opcode, unsigned long long bytesIn,
+                                   unsigned long long bytesOut, unsigned long long latencyUs) {
+    if (opcode < 0 || opcode >= MAX_OPCODES) return;
+
+    OpcodeStats& s = opcodes[opcode];
+    s.count++;
+    s.bytesIn += bytesIn;
+    s.bytesOut += bytesOut;
+    s.totalUs += latencyUs;
+    if (latencyUs > s.maxUs) s.maxUs = latencyUs;
+
+    int bucket = 0;
+    unsigned long long v = latencyUs >> 1;
+    while (v && bucket < LATENCY_BUCKETS - 1) {
+        v >>= 1;
+        bucket++;
+    }
+    s.histogram[bucket]++;
+
+    totalMessages++;
+}
+
+unsigned long long SessionMetrics::getOpcodeCount(int opcode) const {
+    if (opcode < 0 || opcode >= MAX_OPCODES) return 0;
+    return opcodes[opcode].count;
+}
+
+// Upper bound of the bucket holding the given percentile
+static unsigned long long histogramPercentile(const unsigned int* histogram, int buckets,
+                                              unsigned long long count, double pct,
+                                              unsigned long long maxUs) {
+    unsigned long long target = (unsigned long long)(count * pct + 0.999999);
+    unsigned long long seen = 0;
+    for (int i = 0; i < buckets; i++) {
+        seen += histogram[i];
+        if (seen >= target) {
+            if (i == buckets - 1) return maxUs;
+            unsigned long long bound = 2ULL << i;
+            return bound < maxUs ? bound : maxUs;
+        }
+    }
+    return maxUs;
+}
+
+bool SessionMetrics::appendSummary(const std::string& path, const std::string& deviceName) const {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && st.st_size > MAX_METRICS_FILE_SIZE) {
+        std::string oldPath = path + ".1";
+        rename(path.c_str(), oldPath.c_str());
+    }
+
+    FILE* f = fopen(path.c_str(), "a");
+    if (!f) return false;
+
+    char startBuf[32];
+    struct tm tmInfo;
+    gmtime_r(&sessionStart, &tmInfo);
+    strftime(startBuf, sizeof(startBuf), "%Y-%m-%dT%H:%M:%S+00:00", &tmInfo);
+
+    // The device name comes from Calibre
+    std::string device;
+    JsonWriter::appendEscaped(device, deviceName.data(), deviceName.size());
+
+    fprintf(f, "{\"session_start\":\"%s\",\"device\":\"%s\",\"duration_us\":%llu,"
+               "\"handshake_us\":%llu,\"messages\":%llu,\"phases_us\":{",
+            startBuf, device.c_str(), nowUs() - sessionStartUs, handshakeUs, totalMessages);
+
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(f, "%s\"%s\":%llu", i ? "," : "", PHASE_NAMES[i], phaseUs[i]);
+    }
+    fprintf(f, "},\"book_ready\":{\"books\":%d,\"flushes\":%d,\"mid_transfer\":%d},"
+               "\"db_worker\":{\"ops\":%d,\"busy_us\":%llu,\"max_queued\":%d,"
+               "\"checkpoints\":%d,\"checkpoint_us\":%llu,\"max_wal_pages\":%d},"
+               "\"db_locks\":{\"waits\":%llu,\"retries\":%llu,\"wait_us\":%llu,\"timeouts\":%llu},"
+               "\"opcodes\":{",
+            bookReadyBooks, bookReadyFlushes, bookReadyMidTransfer,
+            dbOperations, dbBusyUs, dbMaxQueued, dbCheckpoints, dbCheckpointUs, dbMaxWalPages,
+            dbLockWaits, dbLockRetries, dbLockWaitUs, dbLockTimeouts);
+
+    bool first = true;
+    for (int op = 0; op < MAX_OPCODES; op++) {
+        const OpcodeStats& s = opcodes[op];
+        if (s.count == 0) continue;
+
+        fprintf(f, "%s\"%s\":{\"count\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+                   "\"total_us\":%llu,\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,"
+                   "\"max_us\":%llu,\"histogram\":[",
+                first ? "" : ",", getOpcodeName(op), s.count, s.bytesIn, s.bytesOut, s.totalUs,
+                histogramPercentile(s.histogram, LATENCY_BUCKETS, s.count, 0.50, s.maxUs),
+                histogramPercentile(s.histogram, LATENCY_BUCKETS, s.count, 0.90, s.maxUs),
+                histogramPercentile(s.histogram, LATENCY_BUCKETS, s.count, 0.99, s.maxUs),
+                s.maxUs);
+        first = false;
+
+        // Trailing empty buckets are omitted
+        int last = LATENCY_BUCKETS - 1;
+        while (last > 0 && s.histogram[last] == 0) last--;
+        for (int b = 0; b <= last; b++) {
+            fprintf(f, "%s%u", b ? "," : "", s.histogram[b]);
+        }
+        fprintf(f, "]}");
+    }
+
+    fprintf(f, "}}\n");
+    fclose(f);
+    return true;
+}
@@ -0,0 +1,127 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <ctime>
+
+// Where the protocol thread spends its time. Phases are accounted exclusively:
+// time spent in a nested phase (e.g. DB inside a handler) is not also counted
+// for the enclosing one.
+enum MetricsPhase {
+    PHASE_IDLE = 0,   // Blocked waiting for the next frame from Calibre
+    PHASE_RECEIVE,    // Reading book payloads
+    PHASE_PARSE,      // JSON -> request
+    PHASE_HANDLER,    // Handler code not covered by the phases below
+    PHASE_DB,         // SQLite (explorer-3.db)
+    PHASE_DISK,       // Book and cache file I/O
+    PHASE_SEND,       // Writing responses to the socket
+    PHASE_COUNT
+};
+
+// Per-session counters for CalibreProtocol. Only touched from the protocol
+// thread, so plain integers are enough and recording costs a couple of
+// monotonic clock reads per message.
+class SessionMetrics {
+public:
+    static const int MAX_OPCODES = 64;
+    static const int LATENCY_BUCKETS = 24; // log2(us): [0,2) [2,4) ... [2^23, inf)
+
+    SessionMetrics();
+
+    void reset();
+    bool hasData() const { return totalMessages > 0; }
+
+    void enterPhase(MetricsPhase phase);
+    void leavePhase();
+
+    // Service time of one message: from the end of the frame read to the end of the handler
+    void recordMessage(int opcode, unsigned long long bytesIn,
+                       unsigned long long bytesOut, unsigned long long latencyUs);
+    void recordHandshake(unsigned long long durationUs) { handshakeUs = durationUs; }
+
+    // BookReady calls and the library rescans they caused (one per flush)
+    void recordBookReady(int books, int flushes, int flushesDuringTransfer) {
+        bookReadyBooks = books;
+        bookReadyFlushes = flushes;
+        bookReadyMidTransfer = flushesDuringTransfer;
+    }
+
+    // Operations run by the DbWorker, its thread's busy time and deepest queue
+    void recordDbWorker(int operations, unsigned long long busyUs, int maxQueued) {
+        dbOperations = operations;
+        dbBusyUs = busyUs;
+        dbMaxQueued = maxQueued;
+    }
+
+    // WAL checkpoints run by the DbWorker and the largest the WAL grew
+    void recordCheckpoints(int count, unsigned long long durationUs, int maxWalPages) {
+        dbCheckpoints = count;
+        dbCheckpointUs = durationUs;
+        dbMaxWalPages = maxWalPages;
+    }
+
+    // Lock contention on the library DB (see DbLockStats)
+    void recordDbLocks(unsigned long long waits, unsigned long long retries,
+                       unsigned long long waitUs, unsigned long long timeouts) {
+        dbLockWaits = waits;
+        dbLockRetries = retries;
+        dbLockWaitUs = waitUs;
+        dbLockTimeouts = timeouts;
+    }
+
+    // Appends one JSON line describing the session
+    bool appendSummary(const std::string& path, const std::string& deviceName) const;
+
+    unsigned long long getPhaseUs(MetricsPhase phase) const { return phaseUs[phase]; }
+    unsigned long long getOpcodeCount(int opcode) const;
+
+    static unsigned long long nowUs();
+
+private:
+    struct OpcodeStats {
+        unsigned long long count;
+        unsigned long long bytesIn;
+        unsigned long long bytesOut;
+        unsigned long long totalUs;
+        unsigned long long maxUs;
+        unsigned int histogram[LATENCY_BUCKETS];
+    };
+
+    static const int MAX_PHASE_DEPTH = 8;
+
+    OpcodeStats opcodes[MAX_OPCODES];
+    unsigned long long phaseUs[PHASE_COUNT];
+    MetricsPhase phaseStack[MAX_PHASE_DEPTH];
+    int phaseDepth;
+    unsigned long long phaseMark;
+
+    unsigned long long totalMessages;
+    unsigned long long handshakeUs;
+    int bookReadyBooks;
+    int bookReadyFlushes;
+    int bookReadyMidTransfer;
+    int dbOperations;
+    unsigned long long dbBusyUs;
+    int dbMaxQueued;
+    int dbCheckpoints;
+    unsigned long long dbCheckpointUs;
+    int dbMaxWalPages;
+    unsigned long long dbLockWaits;
+    unsigned long long dbLockRetries;
+    unsigned long long dbLockWaitUs;
+    unsigned long long dbLockTimeouts;
+    unsigned long long sessionStartUs;
+    time_t sessionStart;
+};
+
+// RAII phase marker
+class MetricsPhaseScope {
+    SessionMetrics& metrics;
+public:
+    MetricsPhaseScope(SessionMetrics& m, MetricsPhase phase) : metrics(m) { metrics.enterPhase(phase); }
+    ~MetricsPhaseScope() { metrics.leavePhase(); }
+    MetricsPhaseScope(const MetricsPhaseScope&) = delete;
+    MetricsPhaseScope& operator=(const MetricsPhaseScope&) = delete;
+};
+
+#endif // METRICS_H
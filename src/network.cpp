@@ -1,4 +1,5 @@
 #include "network.h"
+#include "logger.h"
 #include <cstring>
 #include <fcntl.h>
 #include <errno.h>
@@ -10,8 +11,7 @@
 #include <vector>
 #include <algorithm>
 
-// Use the thread-safe logger from main.cpp
-extern void logMsg(const char* format, ...);
+#define logMsg(...) LOG_AT(LOG_INFO, "NET", __VA_ARGS__)
 
 // RAII Wrapper for socket file descriptors to ensure they are closed
 class SocketGuard {
@@ -29,8 +29,35 @@ public:
     SocketGuard& operator=(const SocketGuard&) = delete;
 };
 
+const char* getOpcodeName(int opcode) {
+    switch (opcode) {
+        case OK:                      return "OK";
+        case SET_CALIBRE_DEVICE_INFO: return "SET_CALIBRE_DEVICE_INFO";
+        case SET_CALIBRE_DEVICE_NAME: return "SET_CALIBRE_DEVICE_NAME";
+        case GET_DEVICE_INFORMATION:  return "GET_DEVICE_INFORMATION";
+        case TOTAL_SPACE:             return "TOTAL_SPACE";
+        case FREE_SPACE:              return "FREE_SPACE";
+        case GET_BOOK_COUNT:          return "GET_BOOK_COUNT";
+        case SEND_BOOKLISTS:          return "SEND_BOOKLISTS";
+        case SEND_BOOK:               return "SEND_BOOK";
+        case GET_INITIALIZATION_INFO: return "GET_INITIALIZATION_INFO";
+        case BOOK_DONE:               return "BOOK_DONE";
+        case NOOP:                    return "NOOP";
+        case DELETE_BOOK:             return "DELETE_BOOK";
+        case GET_BOOK_FILE_SEGMENT:   return "GET_BOOK_FILE_SEGMENT";
+        case GET_BOOK_METADATA:       return "GET_BOOK_METADATA";
+        case SEND_BOOK_METADATA:      return "SEND_BOOK_METADATA";
+        case DISPLAY_MESSAGE:         return "DISPLAY_MESSAGE";
+        case CALIBRE_BUSY:            return "CALIBRE_BUSY";
+        case SET_LIBRARY_INFO:        return "SET_LIBRARY_INFO";
+        case ERROR_OPCODE:            return "ERROR";
+        case CARD_PREFIX:             return "CARD_PREFIX";
+    }
+    return "UNKNOWN";
+}
+
 NetworkManager::NetworkManager() 
-    : socketFd(-1), udpSocketFd(-1) {
+    : socketFd(-1), udpSocketFd(-1), bytesSent(0), bytesReceived(0) {
 }
 
 NetworkManager::~NetworkManager() {
@@ -294,6 +321,32 @@ bool NetworkManager::sendAll(const void* data, size_t length) {
         }
         ptr += sent;
         remaining -= sent;
+        bytesSent += sent;
+    }
+    return true;
+}
+
+bool NetworkManager::sendAllv(struct iovec* parts, int count) {
+    while (count > 0) {
+        ssize_t sent = writev(socketFd, parts, count);
+        if (sent <= 0) {
+            if (errno == EINTR) continue;
+            logMsg("Send failed: %s", strerror(errno));
+            return false;
+        }
+        bytesSent += sent;
+        
+        // Skip fully written parts, advance into a partially written one
+        size_t done = (size_t)sent;
+        while (count > 0 && done >= parts->iov_len) {
+            done -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = static_cast<char*>(parts->iov_base) + done;
+            parts->iov_len -= done;
+        }
     }
     return true;
 }
@@ -311,11 +364,12 @@ bool NetworkManager::receiveAll(void* buffer, size_t length) {
         }
         ptr += received;
         remaining -= received;
+        bytesReceived += received;
     }
     return true;
 }
 
-std::string NetworkManager::receiveString() {
+bool NetworkManager::receiveString(std::string& str) {
     // Read length prefix byte by byte (e.g. "1234[")
     // This is not performance critical as it's just a few bytes
     char lengthBuf[32];
@@ -324,7 +378,7 @@ std::string NetworkManager::receiveString() {
     while (lengthPos < sizeof(lengthBuf) - 1) {
         char c;
         if (!receiveAll(&c, 1)) {
-            return "";
+            return false;
         }
         
         if (c == '[') {
@@ -339,40 +393,52 @@ std::string NetworkManager::receiveString() {
     
     if (dataLength <= 0 || dataLength > 10 * 1024 * 1024) { // 10MB limit check
         logMsg("Invalid string length: %d", dataLength);
-        return "";
+        return false;
     }
     
-    // Optimization: Read directly into string to avoid double allocation/copy
-    std::string str;
+    // Read directly into the caller's string; its capacity is reused between messages
     try {
-        str.resize(dataLength + 1); // +1 for the initial '['
+        str.resize(dataLength); // The length includes the initial '['
     } catch (const std::bad_alloc&) {
         logMsg("Failed to allocate memory for string of size %d", dataLength);
-        return "";
+        return false;
     }
     
     str[0] = '['; // Restore the bracket we consumed
     
     // Read the rest of the JSON directly into the string buffer
     // &str[1] points to the second character in the string's internal buffer
-    if (!receiveAll(&str[1], dataLength - 1)) {
-        return "";
-    }
-    
-    return str;
+    return receiveAll(&str[1], dataLength - 1);
 }
 
 bool NetworkManager::sendJSON(CalibreOpcode opcode, const char* jsonData) {
+    return sendJSON(opcode, jsonData, strlen(jsonData));
+}
+
+bool NetworkManager::sendJSON(CalibreOpcode opcode, const char* jsonData, size_t length) {
     if (socketFd < 0) {
         logMsg("Cannot send JSON: socket not connected");
         return false;
     }
     
     // Protocol: length_of_message + [opcode, json_body]
-    std::string message = "[" + std::to_string((int)opcode) + "," + jsonData + "]";
-    std::string packet = std::to_string(message.length()) + message;
-    
-    return sendAll(packet.c_str(), packet.length());
+    // Header and trailer are gathered around the caller's buffer, the body is never copied
+    char opcodeBuf[16];
+    int opcodeLen = snprintf(opcodeBuf, sizeof(opcodeBuf), "%d", (int)opcode);
+    size_t messageLength = 1 + opcodeLen + 1 + length + 1;
+    
+    char header[48];
+    int headerLen = snprintf(header, sizeof(header), "%zu[%s,", messageLength, opcodeBuf);
+    
+    struct iovec parts[3];
+    parts[0].iov_base = header;
+    parts[0].iov_len = headerLen;
+    parts[1].iov_base = const_cast<char*>(jsonData);
+    parts[1].iov_len = length;
+    parts[2].iov_base = const_cast<char*>("]");
+    parts[2].iov_len = 1;
+    
+    return sendAllv(parts, 3);
 }
 
 bool NetworkManager::receiveJSON(CalibreOpcode& opcode, std::string& jsonData) {
@@ -381,27 +447,24 @@ bool NetworkManager::receiveJSON(CalibreOpcode& opcode, std::string& jsonData) {
         return false;
     }
     
-    std::string message = receiveString();
-    if (message.empty()) {
+    if (!receiveString(jsonData)) {
         return false;
     }
     
-    jsonData = message;
-    
     // Parse opcode from JSON array: [opcode, {...}]
     // We expect at least "[0,"
-    if (message.length() < 3 || message[0] != '[') {
+    if (jsonData.length() < 3 || jsonData[0] != '[') {
         logMsg("Failed to parse JSON message format");
         return false;
     }
 
-    size_t opcodeEnd = message.find(',');
-    if (opcodeEnd == std::string::npos) {
+    if (jsonData.find(',') == std::string::npos) {
         logMsg("Invalid JSON structure (no comma)");
         return false;
     }
     
-    int opcodeValue = atoi(message.substr(1, opcodeEnd - 1).c_str());
+    // atoi stops at the comma
+    int opcodeValue = atoi(jsonData.c_str() + 1);
     opcode = static_cast<CalibreOpcode>(opcodeValue);
     
     return true;
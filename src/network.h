@@ -2,6 +2,7 @@
 #define NETWORK_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -34,6 +35,9 @@ enum CalibreOpcode {
 	CARD_PREFIX = 32
 };
 
+// Human readable opcode name for logs and metrics ("UNKNOWN" if not in the enum)
+const char* getOpcodeName(int opcode);
+
 // Broadcast ports for Calibre discovery
 const int BROADCAST_PORTS[] = {54982, 48123, 39001, 44044, 59678};
 const int BROADCAST_PORT_COUNT = 5;
@@ -51,6 +55,7 @@ public:
     
     // Communication methods
     bool sendJSON(CalibreOpcode opcode, const char* jsonData);
+    bool sendJSON(CalibreOpcode opcode, const char* jsonData, size_t length);
     bool receiveJSON(CalibreOpcode& opcode, std::string& jsonData);
     bool sendBinaryData(const void* data, size_t length);
     bool receiveBinaryData(void* buffer, size_t length);
@@ -58,9 +63,15 @@ public:
     // Connection status
     bool isConnected() const { return socketFd >= 0; }
     
+    // Traffic counters (TCP, including frame headers), never reset
+    unsigned long long getBytesSent() const { return bytesSent; }
+    unsigned long long getBytesReceived() const { return bytesReceived; }
+    
 private:
     int socketFd;
     int udpSocketFd;
+    unsigned long long bytesSent;
+    unsigned long long bytesReceived;
     
     // Helper methods
     bool createUDPSocket();
@@ -69,9 +80,10 @@ private:
     bool receiveUDPResponse(std::string& host, int& port, int timeoutMs);
     
     bool sendAll(const void* data, size_t length);
+    bool sendAllv(struct iovec* parts, int count);
     bool receiveAll(void* buffer, size_t length);
     
-    std::string receiveString();
+    bool receiveString(std::string& str);
 };
 
 #endif // NETWORK_H
\ No newline at end of file
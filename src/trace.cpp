@@ -0,0 +1,129 @@
+#include "trace.h"
+#include "json_writer.h"
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Upper bound for one session (~100 bytes per event in memory)
+static const size_t MAX_TRACE_EVENTS = 200000;
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    unsigned long long startUs;
+    unsigned long long durationUs;
+    int tid;
+    std::string args;
+};
+
+static std::mutex traceMutex;
+static std::vector<TraceEvent> traceEvents;
+static std::string tracePath;
+static size_t droppedEvents = 0;
+
+std::atomic<bool> Tracer::active(false);
+
+static int currentTid() {
+    return (int)syscall(SYS_gettid);
+}
+
+unsigned long long Tracer::nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+bool Tracer::begin(const std::string& path) {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.clear();
+    traceEvents.reserve(4096);
+    tracePath = path;
+    droppedEvents = 0;
+    active.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void Tracer::addComplete(const char* name, const char* category,
+                         unsigned long long startUs, unsigned long long durationUs,
+                         const std::string& argsJson) {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (!active.load(std::memory_order_relaxed)) return;
+
+    if (traceEvents.size() >= MAX_TRACE_EVENTS) {
+        droppedEvents++;
+        return;
+    }
+
+    TraceEvent ev;
+    ev.name = name;
+    ev.category = category;
+    ev.startUs = startUs;
+    ev.durationUs = durationUs;
+    ev.tid = currentTid();
+    ev.args = argsJson;
+    traceEvents.push_back(std::move(ev));
+}
+
+bool Tracer::end() {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (!active.load(std::memory_order_relaxed)) return false;
+    active.store(false, std::memory_order_relaxed);
+
+    FILE* f = fopen(tracePath.c_str(), "w");
+    if (!f) {
+        traceEvents.clear();
+        return false;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%lu},\"traceEvents\":[",
+            (unsigned long)droppedEvents);
+
+    int pid = (int)getpid();
+    for (size_t i = 0; i < traceEvents.size(); i++) {
+        const TraceEvent& ev = traceEvents[i];
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                   "\"pid\":%d,\"tid\":%d,\"args\":{%s}}",
+                i ? "," : "", ev.name, ev.category, ev.startUs, ev.durationUs,
+                pid, ev.tid, ev.args.c_str());
+    }
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    traceEvents.clear();
+    traceEvents.shrink_to_fit();
+    return true;
+}
+
+TraceSpan::TraceSpan(const char* n, const char* cat)
+    : name(n), category(cat), startUs(0), recording(Tracer::isActive()) {
+    if (recording) startUs = Tracer::nowUs();
+}
+
+TraceSpan::~TraceSpan() {
+    if (!recording) return;
+    unsigned long long endUs = Tracer::nowUs();
+    Tracer::addComplete(name, category, startUs, endUs - startUs, args);
+}
+
+void TraceSpan::setArg(const char* key, const std::string& value) {
+    if (!recording) return;
+    if (!args.empty()) args += ',';
+    args += '"';
+    args += key;
+    args += "\":\"";
+    JsonWriter::appendEscaped(args, value.data(), value.size());
+    args += '"';
+}
+
+void TraceSpan::setArg(const char* key, long long value) {
+    if (!recording) return;
+    if (!args.empty()) args += ',';
+    args += '"';
+    args += key;
+    args += "\":";
+    args += std::to_string(value);
+}
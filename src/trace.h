@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <string>
+
+// Optional Chrome trace_event recorder (load the file in chrome://tracing or
+// ui.perfetto.dev). While no session is active a span costs one relaxed load.
+class Tracer {
+public:
+    // Start collecting events; they are written to 'path' by end()
+    static bool begin(const std::string& path);
+
+    // Write collected events as {"traceEvents":[...]} and stop collecting
+    static bool end();
+
+    static bool isActive() { return active.load(std::memory_order_relaxed); }
+
+    // 'name' and 'category' must be string literals; 'argsJson' is either
+    // empty or the body of a JSON object ("\"key\":value,...")
+    static void addComplete(const char* name, const char* category,
+                            unsigned long long startUs, unsigned long long durationUs,
+                            const std::string& argsJson);
+
+    static unsigned long long nowUs();
+
+private:
+    static std::atomic<bool> active;
+};
+
+// Complete ("X") event covering the lifetime of the object
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const char* category);
+    ~TraceSpan();
+
+    void setArg(const char* key, const std::string& value);
+    void setArg(const char* key, long long value);
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    const char* category;
+    unsigned long long startUs;
+    bool recording;
+    std::string args;
+};
+
+#endif // TRACE_H